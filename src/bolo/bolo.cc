@@ -1,8 +1,12 @@
 #include "bolo.h"
 
+#include <fnmatch.h>
+
 #include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <memory>
+#include <sstream>
 #include <thread>
 #include <unordered_set>
 
@@ -11,13 +15,66 @@
 #include "libfswatch/c++/libfswatch_exception.hpp"
 #include "libfswatch/c++/monitor.hpp"
 #include "libfswatch/c++/monitor_factory.hpp"
+#include "pipe.h"
+#include "store.h"
 #include "tar.h"
 #include "util.h"
 
 namespace bolo {
 using namespace std::string_literals;
 
-Result<std::unique_ptr<Bolo>, std::string> Bolo::LoadFromJsonFile(const fs::path &path) try {
+namespace {
+// `name` or one of its parent directories matches one of the glob `patterns`; a trailing '/'
+// is ignored on both
+bool MatchPatterns(const std::vector<std::string> &patterns, const std::string &name) {
+  auto trim = [](std::string s) {
+    while (s.size() > 1 && s.back() == '/') s.pop_back();
+    return s;
+  };
+  for (auto p = fs::path(trim(name)); !p.empty(); p = p.parent_path())
+    for (auto &pattern : patterns)
+      if (fnmatch(trim(pattern).c_str(), p.c_str(), FNM_PATHNAME) == 0) return true;
+  return false;
+}
+
+// backups are found by the absolute paths of the events
+fs::path RootOf(const BackupFile &f) {
+  std::error_code ec;
+  auto p = fs::absolute(f.path, ec);
+  return ec ? fs::path(f.path) : p.lexically_normal();
+}
+
+// deduplicated backups in the same directory share one chunk store
+fs::path ChunkRoot(const BackupFile &f) { return fs::path(f.backup_path).parent_path() / "chunks"; }
+
+// a deduplicated backup is rewritten in full once it has that many layers
+constexpr int kMaxLayers = 16;
+
+// the manifest of a deduplicated backup with its layers put on top
+Result<bolo_store::Manifest, std::string> LoadSnapshot(const BackupFile &f) {
+  auto m = bolo_store::Manifest::Load(f.backup_path);
+  for (int i = 1; m && i <= f.layers; i++) {
+    auto layer = bolo_store::Manifest::Load(f.layer_path(i));
+    if (!layer) return layer;
+    m.value().Apply(layer.value());
+  }
+  return m;
+}
+
+void RemoveLayers(const BackupFile &f) {
+  for (int i = 1; i <= f.layers; i++) fs::remove(f.layer_path(i));
+}
+
+bolo_store::ChunkStore ChunkStoreOf(const BackupFile &f) {
+  bolo_compress::Options opts;
+  opts.level = f.level;
+  return bolo_store::ChunkStore(ChunkRoot(f),
+                                f.is_compressed ? f.scheme : bolo_compress::Scheme::STORE, opts);
+}
+};  // namespace
+
+Result<std::unique_ptr<Bolo>, std::string> Bolo::LoadFromJsonFile(
+    const fs::path &path, MonitorFactory create_monitor) try {
   json config;
 
   // read config
@@ -37,6 +94,12 @@ Result<std::unique_ptr<Bolo>, std::string> Bolo::LoadFromJsonFile(const fs::path
   fs::path cloud_path = config.at("cloud_mount_path").get<std::string>();
   cloud_path = cloud_path.lexically_normal();
 
+  // optional: how the events of the monitor are turned into updates
+  SchedulerOptions update_opts;
+  update_opts.quiet = std::chrono::milliseconds(config.value("update_quiet_ms", 2000));
+  update_opts.max_delay = std::chrono::milliseconds(config.value("update_max_delay_ms", 30000));
+  update_opts.workers = config.value("update_workers", 1);
+
   // create and check backup_dir
   fs::create_directories(backup_dir);
   // if backup_path exists
@@ -49,7 +112,8 @@ Result<std::unique_ptr<Bolo>, std::string> Bolo::LoadFromJsonFile(const fs::path
   }
 
   return Ok(std::unique_ptr<Bolo>(new Bolo(path, std::move(config), std::move(list), next_id,
-                                           backup_dir, cloud_path, enable_auto_update)));
+                                           backup_dir, cloud_path, enable_auto_update,
+                                           update_opts, std::move(create_monitor))));
 } catch (const fs::filesystem_error &e) {
   return Err("filesystem error: "s + e.what());
 } catch (const json::out_of_range &e) {
@@ -59,7 +123,8 @@ Result<std::unique_ptr<Bolo>, std::string> Bolo::LoadFromJsonFile(const fs::path
 }
 
 Bolo::Bolo(const fs::path &config_path, json &&config, BackupList &&m, BackupFileId next_id,
-           const fs::path &backup_dir, const fs::path &cloud_path, bool enable_auto_update)
+           const fs::path &backup_dir, const fs::path &cloud_path, bool enable_auto_update,
+           const SchedulerOptions &update_opts, MonitorFactory create_monitor)
     : config_file_path_{config_path},
       config_(std::move(config)),
       backup_files_{std::move(m)},
@@ -67,183 +132,438 @@ Bolo::Bolo(const fs::path &config_path, json &&config, BackupList &&m, BackupFil
       backup_dir_{backup_dir},
       cloud_path_{cloud_path},
       fs_monitor_{nullptr},
+      create_monitor_{std::move(create_monitor)},
       enable_auto_update_{enable_auto_update} {
-  if (enable_auto_update_)
-    thread_ = std::make_shared<std::thread>([this](auto t) { this->UpdateMonitor(t); }, nullptr);
+  auto roots = std::make_shared<PathTrie<BackupFileId>>();
+  for (auto &it : backup_files_)
+    if (!it.second.is_encrypted) roots->Insert(RootOf(it.second), it.first);
+  roots_ = std::move(roots);
+  if (!enable_auto_update_) return;
+
+  // updates run on the workers of the scheduler and only hold the lock of their backup, so the
+  // monitor is not held up and the updates of different backups run at the same time
+  scheduler_ = std::make_unique<UpdateScheduler>(
+      [this](BackupFileId id, std::vector<fs::path> paths, bool full) {
+        auto file = GetBackupFile(id);
+        if (!file) return;  // removed meanwhile
+        auto ins = full ? Update(id) : Patch(id, paths);
+        if (ins) Log(LogLevel::Error, "monitor update error: " + ins.error());
+        Log(LogLevel::Info, "fsw_monitor: "s + file.value().path);
+      },
+      update_opts);
+  thread_ = std::make_shared<std::thread>([this] { this->RunMonitor(); });
 }
 
-void Bolo::UpdateMonitor(std::shared_ptr<std::thread> join) try {
-  // stop monitor
-  if (fs_monitor_ != nullptr) {
-    fs_monitor_->stop();
-    if (join != nullptr && join->joinable()) join->join();
+Bolo::~Bolo() {
+  if (thread_ == nullptr) return;
+  std::shared_ptr<fsw::monitor> monitor;
+  {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    closing_ = true;
+    monitor = fs_monitor_;
   }
+  // a monitor that has not started yet returns from start() at once
+  if (monitor != nullptr) monitor->stop();
+  thread_->join();
+}
 
-  std::vector<std::string> paths;
-  for (auto &it : backup_files_) {
-    paths.push_back(it.second.path);
-  }
+// 监控线程: 监控所有的备份路径.
+// 路径在运行时由 WatchRoot 增删;
+// 只有不支持的 monitor 才会被停下, 再用新的路径重新创建.
+void Bolo::RunMonitor() {
+  while (true) {
+    std::shared_ptr<fsw::monitor> monitor;
+    try {
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
+      if (closing_) break;
+      restart_monitor_ = false;
 
-  // create a new monitor
-  fs_monitor_ = std::shared_ptr<fsw::monitor>(fsw::monitor_factory::create_monitor(
-      ::system_default_monitor_type, paths,
-      [](const std::vector<fsw::event> &e, void *_bolo) {
+      std::vector<std::string> paths;
+      for (auto &it : backup_files_) paths.push_back(it.second.path);
+
+      // create a new monitor
+      fsw::FSW_EVENT_CALLBACK *callback = [](const std::vector<fsw::event> &e, void *_bolo) {
         Bolo *bolo = static_cast<Bolo *>(_bolo);
         bolo->MonitorCallback(e);
-      },    // callback
-      this  // context
-      ));
-  fs_monitor_->set_recursive(true);
-  fs_monitor_->set_latency(1);
-  fs_monitor_->set_allow_overflow(false);
-  fs_monitor_->set_event_type_filters({
-      {fsw_event_flag::Created},
-      {fsw_event_flag::Updated},
-      {fsw_event_flag::Renamed},
-      {fsw_event_flag::Removed},
-      {fsw_event_flag::MovedTo},
-  });
-  fs_monitor_->start();
+      };
+      fs_monitor_ = std::shared_ptr<fsw::monitor>(
+          create_monitor_ ? create_monitor_(paths, callback, this)
+                          : fsw::monitor_factory::create_monitor(::system_default_monitor_type,
+                                                                 paths, callback, this));
+      fs_monitor_->set_recursive(true);
+      fs_monitor_->set_latency(1);
+      // lost events are reported as an Overflow event, and the backups are updated in full;
+      // otherwise the monitor would stop
+      fs_monitor_->set_allow_overflow(true);
+      fs_monitor_->set_event_type_filters({
+          {fsw_event_flag::Created},
+          {fsw_event_flag::Updated},
+          {fsw_event_flag::Renamed},
+          {fsw_event_flag::Removed},
+          {fsw_event_flag::MovedTo},
+          {fsw_event_flag::Overflow},
+      });
+      monitor = fs_monitor_;
+    } catch (const fsw::libfsw_exception &e) {
+      Log(LogLevel::Error, "libfsw error: "s + e.what());
+      break;
+    }
+
+    try {
+      monitor->start();
+    } catch (const fsw::libfsw_exception &e) {
+      Log(LogLevel::Error, "libfsw error: "s + e.what());
+      break;
+    }
 
-} catch (const fsw::libfsw_exception &e) {
-  Log(LogLevel::Error, "libfsw error: "s + e.what());
-} catch (const std::system_error &e) {
-  Log(LogLevel::Error, "system error: failed to create threads, "s + e.what());
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    if (closing_ || !restart_monitor_) break;
+  }
 }
 
-void Bolo::MonitorCallback(const std::vector<fsw::event> &events) try {
-  std::unordered_set<std::string> visited;
-
-  for (auto &it : backup_files_) {
-    auto path = fs::path(it.second.path).lexically_normal().relative_path();
-    if (visited.count(path.string()) > 0 || it.second.is_encrypted) continue;
-    visited.insert(path.string());
-
-    for (const auto &e : events) {
-      auto e_path = fs::path(e.get_path()).lexically_normal().relative_path();
-      if (e_path.string().find(path.string()) != std::string::npos) {
-        if (auto ins = Update(it.second.id)) {
-          Log(LogLevel::Error, "monitor update error: " + ins.error());
-        }
-        Log(LogLevel::Info, "fsw_monitor: "s + it.second.path);
-        break;
-      }
+// 开始或者停止监控一个备份的路径, 调用者持有 mutex_
+void Bolo::WatchRoot(const BackupFile &file, bool watch) {
+  // the monitor thread picks up the new paths when it creates the monitor
+  if (fs_monitor_ == nullptr || restart_monitor_) return;
+
+  // other backups of the same path are still watched
+  if (!watch)
+    for (auto &it : backup_files_)
+      if (it.second.path == file.path) return;
+
+  try {
+    if (watch)
+      fs_monitor_->add_root_path(file.path);
+    else
+      fs_monitor_->remove_root_path(file.path);
+  } catch (const fsw::libfsw_exception &e) {
+    if (e.error_code() != FSW_ERR_UNSUPPORTED_OPERATION) {
+      Log(LogLevel::Error, "libfsw error: "s + e.what());
+      return;
     }
+    restart_monitor_ = true;
+    fs_monitor_->stop();
   }
-} catch (const fs::filesystem_error &e) {
-  Log(LogLevel::Error, "fs error: "s + e.what());
 }
 
-Result<BackupFile, std::string> Bolo::Backup(const fs::path &path, bool is_compressed,
-                                             bool is_encrypted, bool enable_cloud,
-                                             const std::string &key) try {
-  auto id = NextId();
-  // remove '/' in directory path
-  auto p = path.string().back() == '/' ? path.parent_path() : path;
+// the paths of the events are handed to Patch through the scheduler, which merges the events
+// of a backup for a while. Events are coalesced, so a path is added or removed by whether it
+// exists then, not by the flags of its events.
+// mutex_ is not taken: the monitor must keep reading events while backups are written
+void Bolo::MonitorCallback(const std::vector<fsw::event> &events) {
+  std::shared_ptr<const PathTrie<BackupFileId>> roots;
+  {
+    std::lock_guard<std::mutex> lock(roots_mutex_);
+    roots = roots_;
+  }
 
-  std::string filename = p.lexically_relative(p.parent_path());
+  // events were dropped: every backup is updated in full
+  bool overflow = false;
+  std::unordered_map<BackupFileId, std::vector<fs::path>> changed;
+  for (const auto &e : events) {
+    for (auto flag : e.get_flags()) overflow |= flag == fsw_event_flag::Overflow;
+    fs::path path = e.get_path();
+    for (auto id : roots->Match(path)) changed[id].push_back(path);
+  }
+  if (overflow)
+    for (auto id : roots->Values()) changed[id];
 
-  // backup filename = filename + id
-  auto backup_path = ((enable_cloud ? cloud_path_ : backup_dir_) / (std::to_string(id) + filename));
+  for (auto &[id, paths] : changed) scheduler_->Schedule(id, std::move(paths), overflow);
+}
 
-  auto file = BackupFile{
-      id, filename, p, backup_path, GetTimestamp(), is_compressed, is_encrypted, enable_cloud,
-  };
+void Bolo::UpdateRoots(const BackupFile &file, bool insert) {
+  if (file.is_encrypted) return;  // 没有密钥, 不能自动更新
 
-  backup_files_[file.id] = file;
+  std::lock_guard<std::mutex> lock(roots_mutex_);
+  auto roots = std::make_shared<PathTrie<BackupFileId>>(*roots_);
+  if (insert)
+    roots->Insert(RootOf(file), file.id);
+  else
+    roots->Erase(RootOf(file), file.id);
+  roots_ = std::move(roots);
+}
 
-  std::string err;
-  if (auto ins = BackupImpl(file, key)) {
-    err = ins.error();
-    goto clean;
+Bolo::BackupLock Bolo::LockBackup(const BackupFile &file) {
+  std::shared_ptr<std::mutex> mutex;
+  std::shared_ptr<std::shared_mutex> store;
+  {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto &m = backup_locks_[file.id];
+    if (m == nullptr) m = std::make_shared<std::mutex>();
+    mutex = m;
+    if (file.is_deduplicated) {
+      auto &s = store_locks_[ChunkRoot(file).string()];
+      if (s == nullptr) s = std::make_shared<std::shared_mutex>();
+      store = s;
+    }
   }
+  // never taken while holding mutex_, the backup first and then its store
+  BackupLock res{mutex, std::unique_lock<std::mutex>(*mutex), store, {}};
+  if (store != nullptr) res.store_lock = std::shared_lock<std::shared_mutex>(*store);
+  return res;
+}
+
+Bolo::BackupLock Bolo::LockBackup(BackupFileId id, BackupFile &file) {
+  auto found = GetBackupFile(id);
+  if (!found) return {};
+
+  auto lock = LockBackup(found.value());
+  found = GetBackupFile(id);
+  if (!found) return {};
+  file = found.value();
+  return lock;
+}
+
+Insidious<std::string> Bolo::SaveBackupFile(const BackupFile &file) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (backup_files_.find(file.id) == backup_files_.end()) return Safe;
+  backup_files_[file.id] = file;
+  return UpdateConfig();
+}
 
-  if (auto ins = UpdateConfig()) {
-    err = ins.error();
-    goto clean;
+Result<BackupFile, std::string> Bolo::Backup(const fs::path &path, bool is_compressed,
+                                             bool is_encrypted, bool enable_cloud,
+                                             const std::string &key, bolo_compress::Scheme scheme,
+                                             int level, bool deduplicate) try {
+  if (deduplicate && is_encrypted) return Err("deduplicated backups can not be encrypted"s);
+
+  BackupFile file;
+  {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto id = NextId();
+    // remove '/' in directory path
+    auto p = path.string().back() == '/' ? path.parent_path() : path;
+
+    std::string filename = p.lexically_relative(p.parent_path());
+
+    // backup filename = filename + id
+    auto backup_path =
+        ((enable_cloud ? cloud_path_ : backup_dir_) / (std::to_string(id) + filename));
+
+    file = BackupFile{
+        id, filename, p, backup_path, GetTimestamp(), is_compressed, is_encrypted, enable_cloud,
+        scheme, level, deduplicate,
+    };
   }
 
-  return Ok(file);
+  // the backup is listed once it is complete
+  auto lock = LockBackup(file);
+  auto ins = BackupImpl(file, key);
+  if (!ins) {
+    std::lock_guard<std::recursive_mutex> list_lock(mutex_);
+    backup_files_[file.id] = file;
+    ins = UpdateConfig();
+    if (!ins) {
+      UpdateRoots(file, true);
+      WatchRoot(file, true);
+      return Ok(file);
+    }
+    backup_files_.erase(file.id);
+  }
 
-clean:
-  backup_files_.erase(file.id);
   fs::remove_all(file.backup_path);
-  return Err(err);
+  fs::remove(file.index_path());
+  if (file.is_deduplicated) CollectChunks(lock, file);
+  return Err(ins.error());
 } catch (const fs::filesystem_error &e) {
   return Err("filesystem error: "s + e.what());
 }
 
-// `f` has already being inserted into config
+// the caller holds the lock of `f`
 Insidious<std::string> Bolo::BackupImpl(BackupFile &f, const std::string &key) {
-  auto temp = f.path;
-
-  if (f.is_compressed || f.is_encrypted) {
-    temp = MakeTemp();
-    if (auto tar = bolo_tar::Tar::Open(temp)) {
-      if (auto res = tar.value()->Append(f.path)) return Danger("tar error: "s + res.error());
-    } else {
-      return Danger(tar.error());
-    }
+  if (f.is_deduplicated) return BackupChunks(f);
+
+  if (!f.is_compressed && !f.is_encrypted) {
+    // cannot use rename: Invalid cross-device link
+    std::thread([f]() {
+      try {
+        fs::copy(f.path, f.backup_path,
+                 fs::copy_options::update_existing | fs::copy_options::recursive);
+      } catch (const fs::filesystem_error &e) {
+        Log(LogLevel::Error, "copy error: "s + e.what());
+      }
+    }).detach();
+    return Safe;
+  }
 
-    if (f.is_compressed) {
-      auto t = MakeTemp();
-      std::ifstream ifs(temp, std::ios_base::binary);
-      if (!ifs.good()) return Danger("failded to open "s + temp);
-      std::ofstream ofs(t, std::ios_base::binary | std::ios_base::trunc);
-      if (!ofs.good()) return Danger("failded to open "s + t);
+  if (f.is_encrypted && key == "") return Danger("the file is encrypted, but the key is empty"s);
+
+  // tar -> compress -> encrypt -> backup_path, connected by bounded pipes
+  std::vector<Stage> stages;
+  std::vector<bolo_tar::Tar::TarFile> index;
+  stages.push_back([&f, &index](std::istream &, std::ostream &out) -> Insidious<std::string> {
+    auto tar = bolo_tar::Tar::Writer(out);
+    // sorted: the same contents always give the same archive
+    bolo_tar::AppendOptions opts{std::thread::hardware_concurrency(), true};
+    if (auto res = tar->Append(f.path, opts)) return Danger("tar error: "s + res.error());
+    index = tar->index();
+    return tar->Write();
+  });
 
-      if (auto ins = bolo_compress::Compress(ifs, ofs, bolo_compress::Scheme::DEFLATE))
+  if (f.is_compressed) {
+    stages.push_back([&f](std::istream &in, std::ostream &out) -> Insidious<std::string> {
+      bolo_compress::Options opts;
+      opts.level = f.level;
+      // high levels are for cold archives: larger blocks let matches reach further back
+      if (f.level >= 9) opts.block_size = opts.window = 4 << 20;
+      if (auto ins = bolo_compress::Compress(in, out, f.scheme, opts))
         return Danger("compression error: "s + ins.error());
+      return Safe;
+    });
+  }
 
-      // update temp
-      temp = t;
-    }
+  if (f.is_encrypted) {
+    stages.push_back([&key](std::istream &in, std::ostream &out) -> Insidious<std::string> {
+      if (auto ins = bolo_crypto::Encrypt(in, out, key))
+        return Danger("encrypt error: "s + ins.error());
+      return Safe;
+    });
+  }
 
-    if (f.is_encrypted) {
-      if (key == "") return Danger("the file is encrypted, but the key is empty"s);
+  // write next to the old backup and replace it only when the new one is complete
+  auto part = f.backup_path + ".part";
+  std::ofstream ofs(part, std::ios_base::binary | std::ios_base::trunc);
+  if (!ofs.good()) return Danger("failded to open "s + part);
 
-      auto t = MakeTemp();
-      std::ifstream ifs(temp, std::ios_base::binary);
-      if (!ifs.good()) return Danger("failded to open "s + temp);
-      std::ofstream ofs(t, std::ios_base::binary | std::ios_base::trunc);
-      if (!ofs.good()) return Danger("failded to open "s + t);
+  std::istringstream empty;
+  auto ins = RunPipeline(empty, stages, ofs);
+  ofs.close();
 
-      if (auto ins = bolo_crypto::Encrypt(ifs, ofs, key))
-        return Danger("encrypt error: "s + ins.error());
+  if (!ins && !ofs) ins = Danger("failed to write to "s + part);
+  if (ins) {
+    fs::remove(part);
+    return ins;
+  }
 
-      // update temp
-      temp = t;
+  fs::rename(part, f.backup_path);
+
+  // the index only speeds up restoring single files, a backup without one is still complete
+  fs::remove(f.index_path());
+  if (!f.is_encrypted) {
+    std::ofstream idx(f.index_path(), std::ios_base::binary | std::ios_base::trunc);
+    auto ins = bolo_tar::Tar::WriteIndex(idx, index);
+    idx.close();
+    if (ins || !idx) {
+      Log(LogLevel::Warning, "failed to write the index of "s + f.backup_path);
+      fs::remove(f.index_path());
     }
   }
+  return Safe;
+}
 
-  // remove the old file
-  // if (fs::exists(f.backup_path)) fs::remove_all(f.backup_path);
+// only the files changed since the last snapshot are read, and only the chunks that are not
+// stored yet are written. An update adds a layer with the changed entries.
+Insidious<std::string> Bolo::BackupChunks(BackupFile &f) {
+  auto store = ChunkStoreOf(f);
+  auto threads = std::thread::hardware_concurrency();
+
+  bolo_store::Manifest base;
+  bool has_base = fs::exists(f.backup_path);
+  if (has_base) {
+    auto m = LoadSnapshot(f);
+    if (!m) return Danger(m.error());
+    base = std::move(m.value());
+  }
 
-  // rename temp
-  // cannot use rename: Invalid cross-device link
-  std::thread([f, temp]() {
-    try {
-      fs::copy(temp, f.backup_path,
-               fs::copy_options::update_existing | fs::copy_options::recursive);
-    } catch (const fs::filesystem_error &e) {
-      Log(LogLevel::Error, "copy error: "s + e.what());
-    }
-  }).detach();
-  // fs::copy(temp, f.backup_path, fs::copy_options::update_existing | fs::copy_options::recursive);
+  auto manifest = bolo_store::Snapshot(f.path, store, bolo_store::Chunker(), threads,
+                                       has_base ? &base : nullptr);
+  if (!manifest) return Danger("chunk store error: "s + manifest.error());
+
+  if (has_base) {
+    auto layer = bolo_store::Manifest::Delta(base, manifest.value());
+    return AddLayer(f, std::move(base), layer);
+  }
+
+  if (auto ins = manifest.value().Save(f.backup_path)) return ins;
+  RemoveLayers(f);
+  f.layers = 0;
   return Safe;
 }
 
+// collecting chunks reads every manifest of the store and lists all its chunks, so it is only
+// done once the layers are put together and saved, and when a backup is removed; the chunks
+// replaced in between stay until then
+Insidious<std::string> Bolo::AddLayer(BackupFile &f, bolo_store::Manifest base,
+                                      const bolo_store::Manifest &layer) {
+  if (layer.entries.empty() && layer.removed.empty()) return Safe;
+
+  if (f.layers < kMaxLayers) {
+    if (auto ins = layer.Save(f.layer_path(f.layers + 1))) return ins;
+    f.layers++;
+    return Safe;
+  }
+
+  base.Apply(layer);
+  if (auto ins = base.Save(f.backup_path)) return ins;
+  RemoveLayers(f);
+  f.layers = 0;
+  return Safe;
+}
+
+Insidious<std::string> Bolo::CollectChunks(BackupLock &lock, const BackupFile &file) {
+  auto store_root = ChunkRoot(file);
+  auto collect = [&]() -> Insidious<std::string> {
+    // the other backups of the store are saved: they are written under the shared lock
+    std::vector<BackupFile> files;
+    {
+      std::lock_guard<std::recursive_mutex> list_lock(mutex_);
+      for (auto &it : backup_files_)
+        if (it.second.is_deduplicated && ChunkRoot(it.second) == store_root)
+          files.push_back(it.second);
+    }
+
+    std::unordered_set<std::string> live;
+    for (auto &f : files) {
+      if (!fs::exists(f.backup_path)) continue;
+      // a chunk is only removed when no manifest may refer to it
+      auto manifest = LoadSnapshot(f);
+      if (!manifest) return Danger(manifest.error());
+      manifest.value().Chunks(live);
+    }
+
+    auto removed = bolo_store::ChunkStore(store_root).CollectGarbage(live);
+    if (!removed) return Danger(removed.error());
+    return Safe;
+  };
+
+  // no backup of the store writes or reads chunks meanwhile
+  lock.store_lock.unlock();
+  Insidious<std::string> ins = Safe;
+  {
+    std::unique_lock<std::shared_mutex> exclusive(*lock.store);
+    ins = collect();
+  }
+  lock.store_lock.lock();
+  return ins;
+}
+
 // 删除一个备份文件
 Insidious<std::string> Bolo::Remove(BackupFileId id) try {
-  if (backup_files_.find(id) == backup_files_.end())
+  BackupFile file;
+  auto lock = LockBackup(id, file);
+  if (lock.mutex == nullptr)
     return Danger("No backup file with a BackupFileId of "s + std::to_string(id));
 
-  auto file = backup_files_[id];
-
   fs::remove_all(file.backup_path);
+  fs::remove(file.index_path());
+  RemoveLayers(file);
+
+  {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    backup_files_.erase(id);
+    UpdateRoots(file, false);
+    if (scheduler_) scheduler_->Cancel(id);
+    WatchRoot(file, false);
+    // those waiting for the lock still hold it, and find the backup gone
+    backup_locks_.erase(id);
+  }
 
-  backup_files_.erase(id);
+  if (file.is_deduplicated) {
+    if (auto ins = CollectChunks(lock, file))
+      Log(LogLevel::Warning, "failed to collect chunks: "s + ins.error());
+  }
 
+  std::lock_guard<std::recursive_mutex> config_lock(mutex_);
   return UpdateConfig();
 } catch (const fs::filesystem_error &e) {
   return Danger("filesystem error: "s + e.what());
@@ -251,26 +571,75 @@ Insidious<std::string> Bolo::Remove(BackupFileId id) try {
 
 // 更新一个备份文件
 Insidious<std::string> Bolo::Update(BackupFileId id, const std::string &key) try {
-  if (backup_files_.find(id) == backup_files_.end())
+  BackupFile file;
+  auto lock = LockBackup(id, file);
+  if (lock.mutex == nullptr)
     return Danger("No backup file with a BackupFileId of "s + std::to_string(id));
 
-  BackupFile &file = backup_files_[id];
+  return UpdateLocked(lock, file, key);
+} catch (const fs::filesystem_error &e) {
+  return Danger("filesystem error: "s + e.what());
+}
 
+Insidious<std::string> Bolo::UpdateLocked(BackupLock &lock, BackupFile &file,
+                                          const std::string &key) {
   if (file.is_encrypted && key == "") return Danger("the file is encrypted, but the key is empty"s);
 
+  auto layers = file.layers;
   if (auto ins = BackupImpl(file, key)) return ins;
 
-  if (auto ins = UpdateConfig()) return ins;
-
   // update timestamp
   file.timestamp = GetTimestamp();
+  if (auto ins = SaveBackupFile(file)) return ins;
+
+  // the layers were put together: the chunks they replaced can go
+  if (layers > 0 && file.layers == 0) {
+    if (auto ins = CollectChunks(lock, file))
+      Log(LogLevel::Warning, "failed to collect chunks: "s + ins.error());
+  }
+  return Safe;
+}
+
+Insidious<std::string> Bolo::Patch(BackupFileId id, const std::vector<fs::path> &changed) try {
+  BackupFile file;
+  auto lock = LockBackup(id, file);
+  if (lock.mutex == nullptr)
+    return Danger("No backup file with a BackupFileId of "s + std::to_string(id));
+
+  // a tar can not be patched, and there is nothing to patch before the first snapshot
+  if (!file.is_deduplicated || !fs::exists(file.backup_path)) return UpdateLocked(lock, file, "");
+
+  auto base = LoadSnapshot(file);
+  if (!base) return Danger(base.error());
+
+  // the paths of events are absolute, the one of the backup may not be
+  std::vector<fs::path> paths;
+  for (auto &p : changed) paths.push_back(fs::absolute(p));
+  auto layer = bolo_store::Patch(RootOf(file), paths, base.value(), ChunkStoreOf(file),
+                                 bolo_store::Chunker(), std::thread::hardware_concurrency());
+  if (!layer) {
+    // the paths may change again while being read; the whole backup is looked at then
+    Log(LogLevel::Warning, "patch error: "s + layer.error());
+    return UpdateLocked(lock, file, "");
+  }
+  auto layers = file.layers;
+  if (auto ins = AddLayer(file, std::move(base.value()), layer.value())) return ins;
+
+  file.timestamp = GetTimestamp();
+  if (auto ins = SaveBackupFile(file)) return ins;
+
+  if (layers > 0 && file.layers == 0) {
+    if (auto ins = CollectChunks(lock, file))
+      Log(LogLevel::Warning, "failed to collect chunks: "s + ins.error());
+  }
   return Safe;
 } catch (const fs::filesystem_error &e) {
   return Danger("filesystem error: "s + e.what());
 }
 
 Insidious<std::string> Bolo::Restore(BackupFileId id, const fs::path &restore_dir,
-                                     const std::string &key) try {
+                                     const std::string &key,
+                                     const std::vector<std::string> &patterns) try {
   using bolo_tar::Tar;
 
   // check if the restore dir exists
@@ -278,10 +647,11 @@ Insidious<std::string> Bolo::Restore(BackupFileId id, const fs::path &restore_di
   if (!fs::is_directory(restore_dir))
     return Danger("the restore_path should be a directory: "s + restore_dir.string());
 
-  // check if the file id is right
-  if (backup_files_.find(id) == backup_files_.end())
+  // check if the file id is right; the backup is not updated while it is restored
+  BackupFile file;
+  auto lock = LockBackup(id, file);
+  if (lock.mutex == nullptr)
     return Danger("No backup file with a BackupFileId of "s + std::to_string(id));
-  const BackupFile &file = backup_files_[id];
 
   // check if the backup file exists
   if (!fs::exists(file.backup_path))
@@ -289,51 +659,126 @@ Insidious<std::string> Bolo::Restore(BackupFileId id, const fs::path &restore_di
 
   // check is there is a conflict file in the restore_dir
   auto restore_path = restore_dir / file.filename;
-  if (fs::exists(restore_path))
+  if (patterns.empty() && fs::exists(restore_path))
     return Danger("file `"s + file.filename + "` already exists in `" + restore_dir.string() + "`");
 
   if (file.is_encrypted && key == "") return Danger("the file is encrypted, but the key is empty"s);
 
-  std::string temp = file.backup_path;
-
-  if (file.is_encrypted) {
-    auto t = MakeTemp();
+  if (patterns.empty() && !file.is_compressed && !file.is_encrypted && !file.is_deduplicated) {
+    fs::copy(file.backup_path, restore_path,
+             fs::copy_options::update_existing | fs::copy_options::recursive);
+    return Safe;
+  }
 
-    std::ifstream ifs(temp, std::ios_base::binary);
-    if (!ifs.good()) return Danger("failded to open "s + file.backup_path);
-    std::ofstream ofs(t, std::ios_base::binary | std::ios_base::trunc);
-    if (!ofs.good()) return Danger("failded to open "s + temp);
+  // selective restore: entries are named as in the tar, directories end with '/'
+  size_t matched = 0;
+  std::vector<std::string> existing;  // matched, but not restored
+  auto wanted = [&](const std::string &name, bool is_dir) {
+    if (!MatchPatterns(patterns, name)) return false;
+    matched++;
+    if (is_dir || !fs::exists(restore_dir / name)) return true;
+    existing.push_back(name);
+    return false;
+  };
+  auto result = [&]() -> Insidious<std::string> {
+    if (matched == 0) return Danger("no file of the backup matches the patterns"s);
+    if (!existing.empty())
+      return Danger("files already exist in `"s + restore_dir.string() + "`: " + existing[0] +
+                    (existing.size() > 1 ? " and " + std::to_string(existing.size() - 1) + " more"
+                                         : ""));
+    return Safe;
+  };
 
-    if (auto ins = bolo_crypto::Decrypt(ifs, ofs, key))
-      return Danger("decrypto error: "s + ins.error());
+  // entries of a manifest are named as in the tar too
+  if (file.is_deduplicated) {
+    auto manifest = LoadSnapshot(file);
+    if (!manifest) return Danger(manifest.error());
+    auto ins = bolo_store::Restore(
+        manifest.value(), ChunkStoreOf(file), restore_dir, [&](const bolo_store::Entry &e) {
+          return patterns.empty() || wanted(e.path, e.type == fs::file_type::directory);
+        });
+    if (ins || patterns.empty()) return ins;
+    return result();
+  }
 
-    temp = t;
+  if (!file.is_compressed && !file.is_encrypted) {
+    fs::path base = file.backup_path;
+    if (!fs::is_directory(base)) {
+      if (wanted(file.filename, false)) fs::copy_file(base, restore_path);
+      return result();
+    }
+    for (auto &e : fs::recursive_directory_iterator(base)) {
+      auto name = (fs::path(file.filename) / e.path().lexically_relative(base)).string();
+      if (e.is_directory()) {
+        if (wanted(name + "/", true)) fs::create_directories(restore_dir / name);
+      } else if (wanted(name, false)) {
+        fs::create_directories((restore_dir / name).parent_path());
+        fs::copy_file(e.path(), restore_dir / name);
+      }
+    }
+    return result();
   }
 
-  if (file.is_compressed) {
-    auto t = MakeTemp();
+  // with the index of the tar, the selected entries are known before reading the backup, and
+  // the blocks of the compressed stream holding none of them are not decoded
+  bool indexed = false;
+  std::vector<Tar::TarFile> entries;
+  bolo_compress::Options opts;
+  if (!patterns.empty()) {
+    std::ifstream idx(file.index_path(), std::ios_base::binary);
+    auto index = idx ? Tar::ReadIndex(idx) : Err("no index"s);
+    if (index) {
+      indexed = true;
+      for (auto &f : index.value())
+        if (wanted(f.filename, f.type == fs::file_type::directory)) entries.push_back(f);
+      for (auto &f : entries) opts.ranges.emplace_back(f.offset, f.end());
+      if (entries.empty()) return result();
+    }
+  }
 
-    std::ifstream ifs(temp, std::ios_base::binary);
-    if (!ifs.good()) return Danger("failded to open "s + file.backup_path);
-    std::ofstream ofs(t, std::ios_base::binary | std::ios_base::trunc);
-    if (!ofs.good()) return Danger("failded to open "s + temp);
+  // backup_path -> decrypt -> uncompress -> untar, connected by bounded pipes
+  std::vector<Stage> stages;
+  if (file.is_encrypted) {
+    stages.push_back([&key](std::istream &in, std::ostream &out) -> Insidious<std::string> {
+      if (auto ins = bolo_crypto::Decrypt(in, out, key))
+        return Danger("decrypto error: "s + ins.error());
+      return Safe;
+    });
+  }
 
-    if (auto ins = bolo_compress::Uncompress(ifs, ofs, bolo_compress::Scheme::DEFLATE))
+  // the codec is read from the stream header; streams without one are either the legacy
+  // format or a plain tar
+  auto scheme = file.is_compressed ? bolo_compress::Scheme::HUFFMAN_LEGACY
+                                   : bolo_compress::Scheme::STORE;
+  stages.push_back([scheme, &opts](std::istream &in, std::ostream &out) -> Insidious<std::string> {
+    if (auto ins = bolo_compress::Uncompress(in, out, scheme, opts))
       return Danger("compression error: "s + ins.error());
+    return Safe;
+  });
 
-    temp = t;
-  }
+  stages.push_back([&](std::istream &in, std::ostream &) -> Insidious<std::string> {
+    auto tar = Tar::Reader(in);
+    Insidious<std::string> res = Safe;
+    if (patterns.empty())
+      res = tar->Extract(restore_dir);
+    else if (indexed)
+      res = tar->Extract(restore_dir, entries);
+    else
+      res = tar->Extract(restore_dir, [&wanted](const Tar::TarFile &f) {
+        return wanted(f.filename, f.type == fs::file_type::directory);
+      });
+    if (res) return Danger("tar error: "s + res.error());
+    return Safe;
+  });
 
-  if (file.is_compressed || file.is_encrypted) {
-    if (auto tar = Tar::Open(temp)) {
-      if (auto res = tar.value()->Extract(restore_dir)) return Danger("tar error: "s + res.error());
-    } else {
-      return Danger("tar error: "s + tar.error());
-    }
-  } else {
-    fs::copy(temp, restore_path, fs::copy_options::update_existing | fs::copy_options::recursive);
-  }
-  return Safe;
+  std::ifstream ifs(file.backup_path, std::ios_base::binary);
+  if (!ifs.good()) return Danger("failded to open "s + file.backup_path);
+
+  std::ostream sink(nullptr);
+  if (auto ins = RunPipeline(ifs, stages, sink)) return ins;
+
+  if (patterns.empty()) return Safe;
+  return result();
 } catch (const fs::filesystem_error &e) {
   return Danger("filesystem error: "s + e.what());
 }
@@ -346,9 +791,6 @@ Insidious<std::string> Bolo::UpdateConfig() {
     return Danger("json type_error: "s + e.what());
   }
 
-  if (enable_auto_update_)
-    thread_ = std::make_shared<std::thread>([this](auto t) { this->UpdateMonitor(t); }, thread_);
-
   std::ofstream f(config_file_path_);
   if (!f.is_open()) return Danger("failed to open config file: "s + config_file_path_.string());
 
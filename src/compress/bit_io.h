@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace bolo_compress {
+
+// BitWriter: MSB-first bit writer built on a 64-bit accumulator.
+// Bits are emitted 32 at a time into a byte buffer, which is handed to the output stream in
+// large chunks (or kept in a std::string for in-memory encoding).
+class BitWriter {
+ public:
+  explicit BitWriter(std::ostream &out) : out_{&out}, buf_{&own_} { own_.reserve(kChunkSize); }
+  explicit BitWriter(std::string &out) : out_{nullptr}, buf_{&out} {}
+
+  BitWriter(const BitWriter &) = delete;
+  BitWriter &operator=(const BitWriter &) = delete;
+
+  // write the `len` (<= 64) low bits of `bits`, the most significant one first
+  void Write(uint64_t bits, int len) {
+    if (len > 32) {
+      Write(bits >> 32, len - 32);
+      len = 32;
+    }
+    bits &= len == 32 ? 0xffffffffu : (uint64_t{1} << len) - 1;
+
+    // cnt_ < 32 holds between calls, so the accumulator never overflows
+    acc_ = acc_ << len | bits;
+    cnt_ += len;
+    if (cnt_ >= 32) {
+      cnt_ -= 32;
+      auto word = static_cast<uint32_t>(acc_ >> cnt_);
+      char b[4] = {static_cast<char>(word >> 24), static_cast<char>(word >> 16),
+                   static_cast<char>(word >> 8), static_cast<char>(word)};
+      buf_->append(b, sizeof b);
+      if (out_ != nullptr && buf_->size() >= kChunkSize) Drain();
+    }
+  }
+
+  // pad the last byte with zero bits and pass all pending bytes to the output
+  void Flush() {
+    if (cnt_ % 8 != 0) Write(0, 8 - cnt_ % 8);
+    while (cnt_ > 0) {
+      cnt_ -= 8;
+      buf_->push_back(static_cast<char>(acc_ >> cnt_));
+    }
+    if (out_ != nullptr) Drain();
+  }
+
+ private:
+  static constexpr size_t kChunkSize = 64 << 10;
+
+  void Drain() {
+    out_->write(buf_->data(), buf_->size());
+    buf_->clear();
+  }
+
+  std::ostream *out_;
+  std::string own_;
+  std::string *buf_;
+  uint64_t acc_ = 0;
+  int cnt_ = 0;
+};
+
+// BitReader: MSB-first bit reader built on a 64-bit accumulator.
+// The next unread bits are the most significant bits of the accumulator, so `Peek` is a single
+// shift. Reading past the end yields zero bits; `available` tells how many bits are real.
+class BitReader {
+ public:
+  // read at most `limit` bytes from `in`
+  explicit BitReader(std::istream &in, uint64_t limit = UINT64_MAX) : in_{&in}, limit_{limit} {}
+  BitReader(const char *data, size_t size)
+      : in_{nullptr},
+        pos_{reinterpret_cast<const uint8_t *>(data)},
+        end_{reinterpret_cast<const uint8_t *>(data) + size} {}
+
+  BitReader(const BitReader &) = delete;
+  BitReader &operator=(const BitReader &) = delete;
+
+  // make at least 57 bits available, unless the input runs out
+  void Refill() {
+    while (cnt_ <= 56) {
+      if (pos_ == end_ && !Underflow()) return;
+      acc_ |= static_cast<uint64_t>(*pos_++) << (56 - cnt_);
+      cnt_ += 8;
+    }
+  }
+
+  // the next `len` (1 ~ 57) bits, valid after Refill
+  uint64_t Peek(int len) const { return acc_ >> (64 - len); }
+
+  void Consume(int len) {
+    acc_ = len == 64 ? 0 : acc_ << len;
+    cnt_ -= len;
+  }
+
+  // read `len` (<= 57) bits
+  uint64_t Read(int len) {
+    if (len == 0) return 0;
+    Refill();
+    auto v = Peek(len);
+    Consume(len);
+    return v;
+  }
+
+  // the number of real bits in the accumulator
+  int available() const { return cnt_; }
+
+ private:
+  bool Underflow() {
+    if (in_ == nullptr || limit_ == 0) return false;
+
+    buf_.resize(std::min<uint64_t>(kChunkSize, limit_));
+    in_->read(reinterpret_cast<char *>(buf_.data()), buf_.size());
+    auto n = static_cast<size_t>(in_->gcount());
+    limit_ -= n;
+    pos_ = buf_.data();
+    end_ = pos_ + n;
+    return n > 0;
+  }
+
+  static constexpr size_t kChunkSize = 64 << 10;
+
+  std::istream *in_;
+  uint64_t limit_ = 0;
+  std::vector<uint8_t> buf_;
+  const uint8_t *pos_ = nullptr;
+  const uint8_t *end_ = nullptr;
+  uint64_t acc_ = 0;
+  int cnt_ = 0;
+};
+
+};  // namespace bolo_compress
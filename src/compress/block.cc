@@ -0,0 +1,261 @@
+#include "block.h"
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "codec.h"
+#include "thread_pool.h"
+#include "varint.h"
+
+namespace bolo_compress {
+using namespace std::string_literals;
+
+namespace {
+// fill `buf` as much as possible; a short read only happens at the end of `in`
+size_t ReadFull(std::istream &in, std::vector<char> &buf) {
+  size_t n = 0;
+  while (n < buf.size() && in.good()) {
+    in.read(buf.data() + n, buf.size() - n);
+    n += in.gcount();
+  }
+  return n;
+}
+
+// encode one block, header included
+std::string EncodeBlock(const std::vector<char> &raw, const Codec &codec, const Options &opts) {
+  std::string payload;
+  codec.encode(raw.data(), raw.size(), opts, payload);
+
+  auto type = codec.type;
+  if (payload.size() >= raw.size() && type != BlockType::kStored) {
+    type = BlockType::kStored;
+    payload.assign(raw.data(), raw.size());
+  }
+
+  std::string block;
+  PutVarint(block, raw.size());
+  block.push_back(static_cast<char>(type));
+  PutVarint(block, payload.size());
+  return block + payload;
+}
+
+// BlockInfo: a block header; the sequence of headers is the index that lets the reader hand
+// whole blocks to the decoding workers
+struct BlockInfo {
+  uint64_t raw_size;
+  int type;
+  uint64_t payload_size;
+};
+
+// read the next block header; raw_size is 0 at the end of the stream
+Insidious<std::string> ReadBlockInfo(std::istream &in, BlockInfo &info) {
+  if (!ReadVarint(in, info.raw_size)) return Danger("unexpected end of block stream"s);
+  if (info.raw_size == 0) return Safe;
+
+  info.type = in.get();
+  if (!ReadVarint(in, info.payload_size)) return Danger("unexpected end of block stream"s);
+  if (info.raw_size > kMaxBlockSize || info.payload_size > kMaxBlockSize + 1024)
+    return Danger("broken block header"s);
+  return Safe;
+}
+
+Result<std::string, std::string> DecodeBlock(const BlockInfo &info,
+                                             const std::vector<char> &payload) {
+  auto codec = FindCodec(static_cast<BlockType>(info.type));
+  if (!codec) return Err("unknown block type: "s + std::to_string(info.type));
+
+  std::string raw(info.raw_size, '\0');
+  auto ins = codec->decode(payload.data(), payload.size(), raw.data(), raw.size());
+  if (ins) return Err(ins.error());
+  return Ok(std::move(raw));
+}
+
+// Wanted: which blocks the reader asked for in Options::ranges, visited in stream order
+class Wanted {
+ public:
+  explicit Wanted(const std::vector<std::pair<uint64_t, uint64_t>> &ranges) : ranges_(ranges) {}
+
+  // the block of `size` bytes at the current position is needed
+  bool Next(uint64_t size) {
+    auto begin = pos_, end = pos_ + size;
+    pos_ = end;
+    if (ranges_.empty()) return true;
+    while (i_ < ranges_.size() && ranges_[i_].second <= begin) i_++;
+    return i_ < ranges_.size() && ranges_[i_].first < end;
+  }
+
+  // no block after the current position is needed
+  bool Done() const {
+    return !ranges_.empty() && (i_ == ranges_.size() || ranges_.back().second <= pos_);
+  }
+
+ private:
+  const std::vector<std::pair<uint64_t, uint64_t>> &ranges_;
+  size_t i_ = 0;
+  uint64_t pos_ = 0;
+};
+
+// skip the payload of a block that is not needed
+Result<std::string, std::string> SkipBlock(std::istream &in, const BlockInfo &info) {
+  in.ignore(info.payload_size);
+  if (static_cast<uint64_t>(in.gcount()) != info.payload_size)
+    return Err("unexpected end of block stream"s);
+  return Ok(std::string(info.raw_size, '\0'));
+}
+
+size_t ThreadCount(const Options &opts) {
+  return opts.threads > 0 ? opts.threads : std::max(1u, std::thread::hardware_concurrency());
+}
+};  // namespace
+
+Insidious<std::string> CompressBlocks(std::istream &in, std::ostream &out, Scheme s,
+                                      const Options &opts) {
+  auto codec = FindCodec(s);
+  if (!codec) return Danger("no block codec for the scheme"s);
+
+  out.write(kMagic, sizeof kMagic);
+  out.put(static_cast<char>(kVersion));
+  out.put(static_cast<char>(codec->type));
+  out.put(static_cast<char>(std::clamp(opts.level, 0, 255)));
+
+  auto block_size = std::clamp<size_t>(opts.block_size, 1, kMaxBlockSize);
+  auto threads = ThreadCount(opts);
+
+  if (threads == 1) {
+    std::vector<char> buf(block_size);
+    while (out.good()) {
+      buf.resize(block_size);
+      buf.resize(ReadFull(in, buf));
+      if (buf.empty()) break;
+
+      auto block = EncodeBlock(buf, *codec, opts);
+      out.write(block.data(), block.size());
+    }
+  } else {
+    // reader thread -> worker pool -> ordered writer (this thread)
+    ThreadPool pool(threads);
+    OrderedQueue<std::string> queue(threads * 2);
+
+    std::thread reader([&] {
+      while (true) {
+        auto buf = std::make_shared<std::vector<char>>(block_size);
+        buf->resize(ReadFull(in, *buf));
+        if (buf->empty()) break;
+        auto f = pool.Submit([buf, codec, &opts] { return EncodeBlock(*buf, *codec, opts); });
+        if (!queue.Push(std::move(f))) break;
+      }
+      queue.Close();
+    });
+
+    std::future<std::string> f;
+    while (queue.Pop(f)) {
+      auto block = f.get();
+      out.write(block.data(), block.size());
+      if (!out.good()) break;
+    }
+    queue.Close();
+    reader.join();
+  }
+
+  // end of stream
+  out.put(0);
+
+  if (!out.good()) return Danger("out stream is not good"s);
+  if (!in.eof()) return Danger("not end of input stream"s);
+  return Safe;
+}
+
+Insidious<std::string> UncompressBlocks(std::istream &in, std::ostream &out, const Options &opts) {
+  if (in.get() != kVersion) return Danger("unsupported block stream version"s);
+  auto codec = in.get();
+  in.get();  // level
+  if (!in.good()) return Danger("unexpected end of block stream"s);
+  if (!FindCodec(static_cast<BlockType>(codec)))
+    return Danger("unknown codec: "s + std::to_string(codec));
+
+  auto threads = ThreadCount(opts);
+  Wanted wanted(opts.ranges);
+
+  if (threads == 1) {
+    std::vector<char> payload;
+    while (!wanted.Done()) {
+      BlockInfo info;
+      if (auto ins = ReadBlockInfo(in, info)) return ins;
+      if (info.raw_size == 0) break;
+
+      if (!wanted.Next(info.raw_size)) {
+        auto zeros = SkipBlock(in, info);
+        if (!zeros) return Danger(zeros.error());
+        out.write(zeros.value().data(), zeros.value().size());
+        continue;
+      }
+
+      payload.resize(info.payload_size);
+      in.read(payload.data(), payload.size());
+      if (static_cast<uint64_t>(in.gcount()) != info.payload_size)
+        return Danger("unexpected end of block stream"s);
+
+      auto raw = DecodeBlock(info, payload);
+      if (!raw) return Danger(raw.error());
+      out.write(raw.value().data(), raw.value().size());
+      if (!out.good()) return Danger("out stream is not good"s);
+    }
+    return Safe;
+  }
+
+  // reader thread (walks the block headers) -> worker pool -> ordered writer (this thread)
+  ThreadPool pool(threads);
+  OrderedQueue<Result<std::string, std::string>> queue(threads * 2);
+
+  Insidious<std::string> read_error = Safe;
+  std::thread reader([&] {
+    while (!wanted.Done()) {
+      BlockInfo info;
+      if ((read_error = ReadBlockInfo(in, info)) || info.raw_size == 0) break;
+
+      if (!wanted.Next(info.raw_size)) {
+        auto zeros = SkipBlock(in, info);
+        if (!zeros) {
+          read_error = Danger(zeros.error());
+          break;
+        }
+        std::promise<Result<std::string, std::string>> skipped;
+        skipped.set_value(std::move(zeros));
+        if (!queue.Push(skipped.get_future())) break;
+        continue;
+      }
+
+      auto payload = std::make_shared<std::vector<char>>(info.payload_size);
+      in.read(payload->data(), payload->size());
+      if (static_cast<uint64_t>(in.gcount()) != info.payload_size) {
+        read_error = Danger("unexpected end of block stream"s);
+        break;
+      }
+
+      auto f = pool.Submit([info, payload] { return DecodeBlock(info, *payload); });
+      if (!queue.Push(std::move(f))) break;
+    }
+    queue.Close();
+  });
+
+  Insidious<std::string> ins = Safe;
+  std::future<Result<std::string, std::string>> f;
+  while (!ins && queue.Pop(f)) {
+    auto raw = f.get();
+    if (!raw) {
+      ins = Danger(raw.error());
+    } else {
+      out.write(raw.value().data(), raw.value().size());
+      if (!out.good()) ins = Danger("out stream is not good"s);
+    }
+  }
+  queue.Close();
+  reader.join();
+
+  if (ins) return ins;
+  return read_error;
+}
+};  // namespace bolo_compress
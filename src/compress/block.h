@@ -0,0 +1,43 @@
+#pragma once
+
+#include <istream>
+#include <ostream>
+#include <string>
+
+#include "compress.h"
+#include "result.h"
+
+namespace bolo_compress {
+using namespace bolo;
+
+/*
+ * Block stream:
+ *   magic    8 bytes, "\x89BLZ\r\n\x1a\n"
+ *   version  1 byte
+ *   codec    1 byte, the block type of the codec that wrote the stream
+ *   level    1 byte, the level it was asked for
+ *   blocks   varint raw_size, uint8 type, varint payload_size, payload
+ *   end      varint 0
+ *
+ * Each block carries its own code table, so the input is read only once and every block can be
+ * decoded on its own. Blocks that do not shrink are stored as they are. The decoder follows the
+ * type of each block, the codec byte only tells what to expect.
+ */
+constexpr char kMagic[8] = {'\x89', 'B', 'L', 'Z', '\r', '\n', '\x1a', '\n'};
+constexpr uint8_t kVersion = 1;
+constexpr size_t kMaxBlockSize = 64 << 20;
+
+enum class BlockType : uint8_t {
+  kStored = 0,
+  kHuffman = 1,
+  kLz77 = 2,
+  kLz4 = 3,
+};
+
+// Both directions run on `opts.threads` workers: a reader thread slices the input into blocks,
+// the workers code them and the calling thread writes the results in their original order.
+Insidious<std::string> CompressBlocks(std::istream &in, std::ostream &out, Scheme s,
+                                      const Options &opts);
+// `in` is positioned right after the magic
+Insidious<std::string> UncompressBlocks(std::istream &in, std::ostream &out, const Options &opts);
+};  // namespace bolo_compress
@@ -0,0 +1,46 @@
+#include "codec.h"
+
+#include <cstring>
+
+#include "huffman.h"
+#include "lz4.h"
+#include "lz77.h"
+
+namespace bolo_compress {
+using namespace std::string_literals;
+
+namespace {
+void StoreEncode(const char *data, size_t size, const Options &, std::string &out) {
+  out.append(data, size);
+}
+
+Insidious<std::string> StoreDecode(const char *data, size_t data_size, char *out, size_t size) {
+  if (data_size != size) return Danger("broken stored block"s);
+  std::memcpy(out, data, size);
+  return Safe;
+}
+
+void HuffmanEncode(const char *data, size_t size, const Options &, std::string &out) {
+  Huffman::EncodeBlock(data, size, out);
+}
+
+const Codec kCodecs[] = {
+    {Scheme::STORE, BlockType::kStored, "store", StoreEncode, StoreDecode},
+    {Scheme::HUFFMAN, BlockType::kHuffman, "huffman", HuffmanEncode, Huffman::DecodeBlock},
+    {Scheme::DEFLATE, BlockType::kLz77, "deflate", Lz77::EncodeBlock, Lz77::DecodeBlock},
+    {Scheme::FAST, BlockType::kLz4, "fast", Lz4::EncodeBlock, Lz4::DecodeBlock},
+};
+};  // namespace
+
+const Codec *FindCodec(Scheme s) {
+  for (auto &c : kCodecs)
+    if (c.scheme == s) return &c;
+  return nullptr;
+}
+
+const Codec *FindCodec(BlockType type) {
+  for (auto &c : kCodecs)
+    if (c.type == type) return &c;
+  return nullptr;
+}
+};  // namespace bolo_compress
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+
+#include "block.h"
+#include "compress.h"
+#include "result.h"
+
+namespace bolo_compress {
+using namespace bolo;
+
+// Codec: a block coder of the block stream.
+// Its `type` is the id written to the frame header and to the header of every block it codes,
+// so streams are decoded by looking the ids up here. A new codec only needs an entry in the
+// registry of codec.cc and a new id.
+struct Codec {
+  Scheme scheme;
+  BlockType type;
+  const char *name;
+  // append the payload of a block to `out`
+  void (*encode)(const char *data, size_t size, const Options &opts, std::string &out);
+  // decode a payload into exactly `size` bytes
+  Insidious<std::string> (*decode)(const char *data, size_t data_size, char *out, size_t size);
+};
+
+// nullptr if no codec is registered
+const Codec *FindCodec(Scheme s);
+const Codec *FindCodec(BlockType type);
+};  // namespace bolo_compress
@@ -1,15 +1,48 @@
 #include "compress.h"
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "block.h"
 #include "huffman.h"
+#include "varint.h"
 
 namespace bolo_compress {
-bolo::Insidious<std::string> Compress(std::istream &in, std::ostream &out, Scheme s) {
-  auto huffman = Huffman(in, out);
-  return huffman.Compress();
+using namespace std::string_literals;
+
+bolo::Insidious<std::string> Compress(std::istream &in, std::ostream &out, Scheme s,
+                                      const Options &opts) {
+  if (s == Scheme::HUFFMAN_LEGACY) {
+    auto huffman = Huffman(in, out);
+    return huffman.Compress();
+  }
+  return CompressBlocks(in, out, s, opts);
 }
 
-bolo::Insidious<std::string> Uncompress(std::istream &in, std::ostream &out, Scheme s) {
+bolo::Insidious<std::string> Uncompress(std::istream &in, std::ostream &out, Scheme s,
+                                        const Options &opts) {
+  char head[sizeof kMagic];
+  in.read(head, sizeof head);
+  auto n = in.gcount();
+  if (n == sizeof head && std::memcmp(head, kMagic, sizeof kMagic) == 0)
+    return UncompressBlocks(in, out, opts);
+
+  if (s == Scheme::STORE) {
+    std::vector<char> buf(64 << 10);
+    for (std::copy(head, head + n, buf.begin()); n > 0; n = in.gcount()) {
+      out.write(buf.data(), n);
+      in.read(buf.data(), buf.size());
+    }
+    if (!out.good()) return bolo::Danger("out stream is not good"s);
+    return bolo::Safe;
+  }
+
+  if (n != sizeof head) return bolo::Danger("failed to read the stream header"s);
+
+  // legacy streams start with the int64 byte count. The magic can not be mistaken for one:
+  // its last byte would mean more than 2^59 bytes.
   auto huffman = Huffman(in, out);
-  return huffman.Uncompress();
+  return huffman.Uncompress(GetFixed<int64_t>(head));
 }
 };  // namespace bolo_compress
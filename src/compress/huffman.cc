@@ -1,9 +1,11 @@
 #include "huffman.h"
 
+#include <algorithm>
 #include <cassert>
-#include <queue>
 #include <sstream>
 
+#include "varint.h"
+
 #define log_msg(s) (__FILE__ ":"s + std::to_string(__LINE__) + ":" + __func__ + ":" + s)
 
 #define danger(s) Danger(log_msg(s))
@@ -14,30 +16,34 @@ using namespace std::string_literals;
 Insidious<std::string> Huffman::Compress() {
   in_.seekg(0);
 
-  if (auto weights_res = GetWeights())
-    GenCodewords(BuildTree(weights_res.value()));
-  else
-    return Danger(weights_res.error());
+  auto weights_res = GetWeights();
+  if (!weights_res) return Danger(weights_res.error());
+
+  auto lengths = GenCodeLengths(weights_res.value());
+  auto codewords_res = GenCodewords(lengths);
+  if (!codewords_res) return Danger(codewords_res.error());
+  codewords_ = codewords_res.value();
 
   WriteHeader();
 
   in_.clear();
   in_.seekg(0);
 
+  BitWriter writer(out_);
+  std::vector<char> buf(kChunkSize);
   while (in_.good() && out_.good()) {
-    uint8_t v;
-    in_.read(reinterpret_cast<char *>(&v), sizeof(v));
-    if (sizeof(v) != in_.gcount()) break;
-
-    assert(codewords_.find(v) != codewords_.end());
-
-    WriteBits(codewords_[v]);
-  }
-
-  if (bit_buffer_.size() > 0) {
-    // write 7 false (让buffer 中剩下的bits组成一个完整的 byte 然后写下文件)
-    WriteBits({false, false, false, false, false, false, false});
+    in_.read(buf.data(), buf.size());
+    auto n = static_cast<size_t>(in_.gcount());
+    if (n == 0) break;
+
+    for (size_t i = 0; i < n; i++) {
+      const auto &c = codewords_[static_cast<uint8_t>(buf[i])];
+      assert(c.len > 0);
+      writer.Write(c.bits, c.len);
+    }
   }
+  // pad the last byte with zero bits
+  writer.Flush();
 
   if (!out_.good()) return danger("out stream is not good"s);
   if (!in_.eof()) return danger("not end of input stream"s);
@@ -45,165 +51,357 @@ Insidious<std::string> Huffman::Compress() {
 }
 
 Insidious<std::string> Huffman::Uncompress() {
-  in_.seekg(0);
+  // read the number of bytes
+  char n[sizeof(int64_t)];
+  in_.read(n, sizeof n);
+  if (in_.gcount() != sizeof n) return danger("failed to read the number of bytes"s);
 
-  auto unmap_res = ReadHeader();
-  if (!unmap_res) return Danger(unmap_res.error());
+  return Uncompress(GetFixed<int64_t>(n));
+}
 
-  auto &unmap = unmap_res.value();
+Insidious<std::string> Huffman::Uncompress(int64_t n) {
+  byte_number = n;
 
-  while (byte_number > 0 && out_.good()) {
-    std::string bits;
-    while (bit_buffer_.size() > 0 || in_.good()) {
-      char c = ReadBit() ? '1' : '0';
-      bits.push_back(c);
-      if (unmap.find(bits) != unmap.end()) {
-        uint8_t u = unmap[bits];
-        out_.write(reinterpret_cast<const char *>(&u), sizeof(uint8_t));
-        byte_number--;
-        break;
-      }
-    }
-    if (!(bit_buffer_.size() > 0 || in_.good())) break;
+  auto codewords_res = ReadHeader();
+  if (!codewords_res) return Danger(codewords_res.error());
+
+  auto table_res = BuildDecodeTable(codewords_res.value());
+  if (!table_res) return Danger(table_res.error());
+
+  BitReader reader(in_);
+  std::vector<char> obuf(kChunkSize);
+
+  while (byte_number > 0) {
+    auto cnt = static_cast<size_t>(std::min<int64_t>(byte_number, obuf.size()));
+    if (auto ins = Decode(reader, table_res.value(), obuf.data(), cnt)) return ins;
+
+    out_.write(obuf.data(), cnt);
+    if (!out_.good()) return danger("out stream is not good"s);
+    byte_number -= cnt;
   }
 
-  if (!out_.good()) return danger("out stream is not good"s);
-  if (byte_number != 0) return danger("no more bytes can be extracted"s);
   return Safe;
 }
 
-bool Huffman::ReadBit() {
-  if (bit_buffer_.size() == 0) {
-    uint8_t v{0};
-    in_.read(reinterpret_cast<char *>(&v), sizeof v);
+void Huffman::EncodeBlock(const char *data, size_t size, std::string &out) {
+  Weights weights{};
+  for (size_t i = 0; i < size; i++) weights[static_cast<uint8_t>(data[i])]++;
+
+  auto lengths = GenCodeLengths(weights);
+  // the lengths are limited to kMaxCodeLength
+  auto codewords = GenCodewords(lengths).value();
+
+  PutTable(lengths, out);
 
-    for (int i = 7; i >= 0; i--) bit_buffer_.push(static_cast<bool>((v >> i) & 0x1));
+  BitWriter writer(out);
+  for (size_t i = 0; i < size; i++) {
+    const auto &c = codewords[static_cast<uint8_t>(data[i])];
+    writer.Write(c.bits, c.len);
   }
+  writer.Flush();
+}
+
+Insidious<std::string> Huffman::DecodeBlock(const char *data, size_t data_size, char *out,
+                                            size_t size) {
+  const char *pos = data, *end = data + data_size;
+
+  CodeLengths lengths{};
+  if (!GetTable(pos, end, lengths)) return danger("broken block table"s);
+
+  auto codewords_res = GenCodewords(lengths);
+  if (!codewords_res) return Danger(codewords_res.error());
 
-  bool t = bit_buffer_.front();
-  bit_buffer_.pop();
-  return t;
+  auto table_res = BuildDecodeTable(codewords_res.value());
+  if (!table_res) return Danger(table_res.error());
+
+  BitReader reader(pos, end - pos);
+  return Decode(reader, table_res.value(), out, size);
 }
 
-void Huffman::WriteBits(const std::vector<bool> &bits) {
-  for (bool b : bits) bit_buffer_.push(b);
+void Huffman::PutTable(const CodeLengths &lengths, std::string &out) {
+  size_t m = 0, n = 0;
+  for (size_t symbol = 0; symbol < lengths.size(); symbol++) {
+    if (lengths[symbol] == 0) continue;
+    m = symbol + 1;
+    n++;
+  }
 
-  while (bit_buffer_.size() >= 8) {
-    uint8_t v{0};
-    for (int i = 7; i >= 0; i--) {
-      v |= static_cast<uint8_t>(bit_buffer_.front() << i);
-      bit_buffer_.pop();
+  auto put_nibbles = [&out](auto &&length_at, size_t cnt) {
+    for (size_t i = 0; i < cnt; i += 2) {
+      uint8_t hi = i + 1 < cnt ? length_at(i + 1) : 0;
+      out.push_back(static_cast<char>(length_at(i) | hi << 4));
     }
-
-    out_.write(reinterpret_cast<const char *>(&v), sizeof v);
+  };
+
+  // the dense table wins unless few bytes are in use (m/2 against 3n/2 bytes)
+  if (m <= n * 3) {
+    out.push_back(kDense);
+    PutVarint(out, m);
+    put_nibbles([&](size_t i) { return lengths[i]; }, m);
+    return;
   }
+
+  out.push_back(kSparse);
+  PutVarint(out, n);
+  std::array<uint8_t, 256> used;
+  for (size_t symbol = 0, i = 0; symbol < lengths.size(); symbol++)
+    if (lengths[symbol] > 0) used[i++] = static_cast<uint8_t>(symbol);
+  out.append(reinterpret_cast<const char *>(used.data()), n);
+  put_nibbles([&](size_t i) { return lengths[used[i]]; }, n);
 }
 
-Result<Huffman::Weights, std::string> Huffman::GetWeights() {
-  auto res = Weights();
-  while (in_.good()) {
-    uint8_t v;
-    in_.read(reinterpret_cast<char *>(&v), sizeof v);
-    if (in_.gcount() == 0) break;
-    if (res.find(v) == res.end()) res[v] = 0;
-    res[v]++;
-    byte_number++;
+bool Huffman::GetTable(const char *&pos, const char *end, CodeLengths &lengths) {
+  uint64_t n;
+  if (pos == end) return false;
+  auto kind = static_cast<uint8_t>(*pos++);
+  if ((kind != kDense && kind != kSparse) || !GetVarint(pos, end, n) || n > 256) return false;
+
+  const char *symbols = pos;
+  auto packed = (n + 1) / 2;
+  if (static_cast<uint64_t>(end - pos) < (kind == kSparse ? n : 0) + packed) return false;
+  if (kind == kSparse) pos += n;
+
+  for (uint64_t i = 0; i < n; i++) {
+    auto len = static_cast<uint8_t>(pos[i / 2]) >> (i % 2 * 4) & 0xf;
+    lengths[kind == kSparse ? static_cast<uint8_t>(symbols[i]) : i] = static_cast<uint8_t>(len);
   }
+  pos += packed;
+  return true;
+}
 
-  if (!in_.eof()) return err("not end of input stream"s);
+Insidious<std::string> Huffman::Decode(BitReader &reader, const DecodeTable &table, char *out,
+                                       size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    reader.Refill();
 
-  return Ok(std::move(res));
+    // one probe per table level: at most two for codewords of up to 16 bits
+    size_t base = 0;
+    int bits = kRootTableBits;
+    while (true) {
+      const auto &e = table[base + reader.Peek(bits)];
+
+      int consumed = e.kind == DecodeEntry::kLink ? bits : e.bits;
+      if (e.kind == DecodeEntry::kInvalid || consumed > reader.available())
+        return danger("no more bytes can be extracted"s);
+      reader.Consume(consumed);
+
+      if (e.kind == DecodeEntry::kSymbol) {
+        out[i] = static_cast<char>(e.value);
+        break;
+      }
+
+      reader.Refill();
+      base = e.value;
+      bits = e.bits;
+    }
+  }
+  return Safe;
 }
 
-std::shared_ptr<Huffman::Node> Huffman::BuildTree(const Weights &w) {
-  if (w.empty()) return nullptr;
+Result<Huffman::DecodeTable, std::string> Huffman::BuildDecodeTable(const Codewords &codewords) {
+  DecodeTable table(size_t{1} << kRootTableBits);
+
+  for (size_t symbol = 0; symbol < codewords.size(); symbol++) {
+    const auto &code = codewords[symbol];
+    if (code.len == 0) continue;
+
+    size_t base = 0;
+    size_t bits = kRootTableBits;
+    size_t rest = code.len;  // bits of `code` not consumed by the upper levels
+
+    // walk down (and create) the sub-tables of a long codeword
+    while (rest > bits) {
+      rest -= bits;
+      size_t idx = (code.bits >> rest) & ((size_t{1} << bits) - 1);
+
+      auto &e = table[base + idx];
+      if (e.kind == DecodeEntry::kSymbol) return err("codewords are not prefix-free"s);
+      if (e.kind == DecodeEntry::kInvalid) {
+        e.kind = DecodeEntry::kLink;
+        e.bits = kSubTableBits;
+        e.value = static_cast<uint32_t>(table.size());
+        table.resize(table.size() + (size_t{1} << kSubTableBits));
+      }
 
-  auto pq =
-      std::priority_queue<std::shared_ptr<Node>, std::vector<std::shared_ptr<Node>>, NodeCmp>{};
-  for (auto const &it : w) pq.push(std::make_shared<Node>(it.first, it.second));
+      // `table` may have been reallocated
+      base = table[base + idx].value;
+      bits = kSubTableBits;
+    }
 
-  while (pq.size() > 1) {
-    auto l = pq.top();
-    pq.pop();
-    auto r = pq.top();
-    pq.pop();
+    // fill every slot whose index starts with the rest of the codeword
+    size_t prefix = code.bits & ((size_t{1} << rest) - 1);
+    size_t first = prefix << (bits - rest);
+    for (size_t i = first; i < first + (size_t{1} << (bits - rest)); i++) {
+      auto &e = table[base + i];
+      if (e.kind != DecodeEntry::kInvalid) return err("codewords are not prefix-free"s);
+      e.kind = DecodeEntry::kSymbol;
+      e.bits = static_cast<uint8_t>(rest);
+      e.value = static_cast<uint32_t>(symbol);
+    }
+  }
 
-    pq.push(std::make_shared<Node>(l->cnt + r->cnt, l, r));
+  return Ok(std::move(table));
+}
+
+Result<Huffman::Weights, std::string> Huffman::GetWeights() {
+  Weights res{};
+  std::vector<char> buf(kChunkSize);
+  while (in_.good()) {
+    in_.read(buf.data(), buf.size());
+    auto n = static_cast<size_t>(in_.gcount());
+    if (n == 0) break;
+
+    for (size_t i = 0; i < n; i++) res[static_cast<uint8_t>(buf[i])]++;
+    byte_number += n;
   }
 
-  std::shared_ptr<Node> tree = pq.top();
-  pq.pop();
-  return tree;
+  if (!in_.eof()) return err("not end of input stream"s);
+
+  return Ok(std::move(res));
 }
 
-void Huffman::GenCodewords(std::shared_ptr<Node> tree, std::vector<bool> bits) {
-  if (tree->left != nullptr) {
-    std::vector<bool> copy = bits;
-    copy.push_back(false);
-    GenCodewords(tree->left, copy);
+Huffman::CodeLengths Huffman::GenCodeLengths(const Weights &w) {
+  CodeLengths lengths{};
+
+  // the used symbols by increasing weight, ties broken by byte value
+  std::array<std::pair<uint64_t, uint16_t>, 256> leaves;
+  size_t n = 0;
+  for (size_t i = 0; i < w.size(); i++)
+    if (w[i] > 0) leaves[n++] = {w[i], static_cast<uint16_t>(i)};
+  if (n == 0) return lengths;
+  if (n == 1) {
+    // a lone byte still needs a one-bit codeword
+    lengths[leaves[0].second] = 1;
+    return lengths;
+  }
+  std::sort(leaves.begin(), leaves.begin() + n);
+
+  // nodes 0..n-1 are the leaves, n..2n-2 the internal nodes in the order they are created.
+  // Internal nodes are created with nondecreasing weights, so the two lightest nodes are always
+  // at the heads of the leaf queue and the internal node queue: no heap is needed.
+  std::array<uint64_t, 512> weight;
+  std::array<uint16_t, 512> parent;
+  for (size_t i = 0; i < n; i++) weight[i] = leaves[i].first;
+
+  size_t leaf = 0, node = n;
+  auto lightest = [&](size_t created) {
+    if (leaf < n && (node == created || weight[leaf] <= weight[node])) return leaf++;
+    return node++;
+  };
+  for (size_t created = n; created < 2 * n - 1; created++) {
+    auto a = lightest(created);
+    auto b = lightest(created);
+    weight[created] = weight[a] + weight[b];
+    parent[a] = parent[b] = static_cast<uint16_t>(created);
   }
 
-  if (tree->right != nullptr) {
-    std::vector<bool> copy = bits;
-    copy.push_back(true);
-    GenCodewords(tree->right, copy);
+  // depths from the root (the last node) down; `weight` is reused to hold them
+  auto &depth = weight;
+  depth[2 * n - 2] = 0;
+  for (size_t i = 2 * n - 2; i-- > 0;) depth[i] = depth[parent[i]] + 1;
+
+  // count the leaves at each depth, folding everything deeper than kMaxCodeLength into it
+  std::array<uint32_t, kMaxCodeLength + 1> count{};
+  for (size_t i = 0; i < n; i++) count[std::min<uint64_t>(depth[i], kMaxCodeLength)]++;
+
+  // folding overfills the code space (Kraft sum > 1): move leaves from the deepest level to
+  // split a shorter codeword into two longer ones until the code is complete again
+  uint64_t total = 0;
+  for (int len = 1; len <= kMaxCodeLength; len++)
+    total += static_cast<uint64_t>(count[len]) << (kMaxCodeLength - len);
+  for (; total > (uint64_t{1} << kMaxCodeLength); total--) {
+    count[kMaxCodeLength]--;
+    for (int len = kMaxCodeLength - 1; len > 0; len--) {
+      if (count[len] == 0) continue;
+      count[len]--;
+      count[len + 1] += 2;
+      break;
+    }
   }
 
-  if (tree->left == nullptr && tree->right == nullptr) codewords_[tree->val] = bits;
+  // the lightest symbols get the longest codewords
+  size_t i = 0;
+  for (int len = kMaxCodeLength; len > 0; len--)
+    for (uint32_t k = 0; k < count[len]; k++)
+      lengths[leaves[i++].second] = static_cast<uint8_t>(len);
+  return lengths;
+}
+
+Result<Huffman::Codewords, std::string> Huffman::GenCodewords(const CodeLengths &lengths) {
+  // canonical code: the next codeword is the previous one plus one, padded with zeros
+  Codewords codewords{};
+  uint64_t code = 0;
+  int prev = 0;
+  for (int len = 1; len <= UINT8_MAX; len++) {
+    for (size_t symbol = 0; symbol < lengths.size(); symbol++) {
+      if (lengths[symbol] != len) continue;
+      if (len > 64) return err("codeword is longer than 64 bits"s);
+
+      code <<= len - prev;
+      prev = len;
+      codewords[symbol] = Codeword{code, static_cast<uint8_t>(len)};
+      code++;
+    }
+  }
+  return Ok(std::move(codewords));
 }
 
 void Huffman::WriteHeader() {
-  // write the total number of bytes
-  out_.write(reinterpret_cast<const char *>(&byte_number), sizeof(byte_number));
+  // the total number of bytes and the number of tuples, both little endian
+  std::string head;
+  PutFixed<int64_t>(head, byte_number);
+  PutFixed<int32_t>(head, std::count_if(codewords_.begin(), codewords_.end(),
+                                        [](const Codeword &c) { return c.len > 0; }));
+  out_.write(head.data(), head.size());
 
-  // write length of tuples
-  int size = codewords_.size();
-  out_.write(reinterpret_cast<const char *>(&size), sizeof(size));
+  for (size_t symbol = 0; symbol < codewords_.size(); symbol++) {
+    const auto &c = codewords_[symbol];
+    if (c.len == 0) continue;
 
-  for (auto const &it : codewords_) {
     // uint8_t(bin): ""(string end with a '$')
-    out_.write(reinterpret_cast<const char *>(&it.first), sizeof(uint8_t));
+    auto v = static_cast<uint8_t>(symbol);
+    out_.write(reinterpret_cast<const char *>(&v), sizeof(uint8_t));
 
-    std::stringstream ss;
-    for (bool b : it.second) ss << b;
-    ss << '$';
-    auto s = ss.str();
+    std::string s;
+    for (int i = c.len - 1; i >= 0; i--) s.push_back((c.bits >> i & 1) ? '1' : '0');
+    s.push_back('$');
 
     out_.write(s.c_str(), s.size());
   }
 }
 
-Result<Huffman::BitStringUnMap, std::string> Huffman::ReadHeader() {
-  // read the number of bytes
-  in_.read(reinterpret_cast<char *>(&byte_number), sizeof(byte_number));
-
+Result<Huffman::Codewords, std::string> Huffman::ReadHeader() {
   // read the unmap size
-  int size;
-  in_.read(reinterpret_cast<char *>(&size), sizeof(size));
-  if (in_.gcount() != sizeof(size)) return err("failed to read the size"s);
+  char buf[sizeof(int32_t)];
+  in_.read(buf, sizeof buf);
+  if (in_.gcount() != sizeof buf) return err("failed to read the size"s);
+  auto size = GetFixed<int32_t>(buf);
+  if (size < 0 || size > 256) return err("broken header"s);
 
-  BitStringUnMap unmap;
+  Codewords codewords{};
 
   for (int i = 0; i < size; i++) {
     uint8_t v;
     in_.read(reinterpret_cast<char *>(&v), sizeof v);
 
-    std::stringstream ss;
+    Codeword code;
     while (true && in_.good()) {
       char c;
       in_.read(&c, sizeof c);
       if (c == '$') break;
 
-      ss << c;
+      if (code.len == 64) return err("codeword is longer than 64 bits"s);
+      code.bits = code.bits << 1 | (c == '1');
+      code.len++;
     }
     if (!in_.good()) return err("failed to read unmap"s);
 
-    unmap[ss.str()] = v;
+    codewords[v] = code;
   }
 
   if (!in_.good()) return err("failed to read compression information"s);
 
-  return Ok(unmap);
+  return Ok(std::move(codewords));
 }
 
 };  // namespace bolo_compress
@@ -1,11 +1,10 @@
 #pragma once
 
-#include <memory>
-#include <queue>
+#include <array>
 #include <string>
-#include <unordered_map>
 #include <vector>
 
+#include "bit_io.h"
 #include "result.h"
 
 namespace bolo_compress {
@@ -16,50 +15,80 @@ class Huffman {
  public:
   Huffman(std::istream &in, std::ostream &out) : in_{in}, out_{out} {}
 
+  // legacy two-pass format: a single code table for the whole (seekable) input stream.
+  // Its integers are little endian, as they were on the hosts that wrote it.
   Insidious<std::string> Compress();
   Insidious<std::string> Uncompress();
+  // the same as Uncompress, but the leading byte count has already been read
+  Insidious<std::string> Uncompress(int64_t byte_number);
 
- private:
-  using Weights = std::unordered_map<uint8_t, uint64_t>;
-  using Codewords = std::unordered_map<uint8_t, std::vector<bool>>;
-  using BitStringUnMap = std::unordered_map<std::string, uint8_t>;
-
-  struct Node {
-    uint8_t val;
-    uint64_t cnt;
-    std::shared_ptr<Node> left;
-    std::shared_ptr<Node> right;
+  // block format: encode `size` bytes with their own code table, appending to `out`
+  static void EncodeBlock(const char *data, size_t size, std::string &out);
+  // decode a block produced by EncodeBlock into exactly `size` bytes
+  static Insidious<std::string> DecodeBlock(const char *data, size_t data_size, char *out,
+                                            size_t size);
 
-    Node(uint8_t v, uint64_t c) : val{v}, cnt{c} {}
-    Node(uint64_t c, std::shared_ptr<Node> l, std::shared_ptr<Node> r)
-        : cnt{c}, left{l}, right{r} {}
+ private:
+  // Codeword: the `len` low bits of `bits`; `len` is 0 for bytes that do not occur
+  struct Codeword {
+    uint64_t bits = 0;
+    uint8_t len = 0;
   };
-  struct NodeCmp {
-    bool operator()(std::shared_ptr<Node> a, std::shared_ptr<Node> b) { return a->cnt > b->cnt; }
+  using Weights = std::array<uint64_t, 256>;
+  using Codewords = std::array<Codeword, 256>;
+  using CodeLengths = std::array<uint8_t, 256>;
+
+  // DecodeEntry: one slot of a multi-level decoding table.
+  // A table indexed by the next `bits` input bits either yields a symbol (consuming only
+  // `bits` of them) or links to a sub-table for the following bits of a longer codeword.
+  struct DecodeEntry {
+    enum Kind : uint8_t { kInvalid, kSymbol, kLink };
+    Kind kind = kInvalid;
+    uint8_t bits = 0;    // kSymbol: codeword bits left at this level; kLink: sub-table index bits
+    uint32_t value = 0;  // kSymbol: the decoded byte; kLink: offset of the sub-table
   };
+  using DecodeTable = std::vector<DecodeEntry>;
+  static constexpr uint8_t kRootTableBits = 10;
+  static constexpr uint8_t kSubTableBits = 6;
+  static constexpr int kMaxCodeLength = 15;
 
   // get weight of every byte in the input stream
   Result<Weights, std::string> GetWeights();
-  // build huffman tree from the weights
-  std::shared_ptr<Node> BuildTree(const Weights &w);
-  // travel huffman tree, and generate codewords for input bytes
-  void GenCodewords(std::shared_ptr<Node> tree, std::vector<bool> bits = {});
+  // the huffman codeword length of every byte, limited to kMaxCodeLength bits.
+  // The tree is built in fixed arrays, without allocation.
+  static CodeLengths GenCodeLengths(const Weights &w);
+  // assign canonical codewords: shorter codes first, ties broken by byte value
+  static Result<Codewords, std::string> GenCodewords(const CodeLengths &lengths);
+
+  /*
+   * block table: uint8 kind, then
+   *   kDense:  varint m, the lengths of bytes 0 to m-1
+   *   kSparse: varint n, n bytes in use, their lengths
+   * with the 4-bit lengths packed two per byte, the first in the low nibble.
+   */
+  enum TableKind : uint8_t { kDense = 0, kSparse = 1 };
+  static void PutTable(const CodeLengths &lengths, std::string &out);
+  // parse a table from [pos, end) and advance `pos`; returns false on a broken table
+  static bool GetTable(const char *&pos, const char *end, CodeLengths &lengths);
 
   // write tuples (bits in string, uint8)
   void WriteHeader();
   // read tuples (bits in string, uint8)
-  Result<BitStringUnMap, std::string> ReadHeader();
+  Result<Codewords, std::string> ReadHeader();
+
+  // build the multi-level decoding table of a prefix code
+  static Result<DecodeTable, std::string> BuildDecodeTable(const Codewords &codewords);
+  // decode exactly `size` bytes into `out`
+  static Insidious<std::string> Decode(BitReader &reader, const DecodeTable &table, char *out,
+                                       size_t size);
 
-  // bit reads and writes
-  bool ReadBit();
-  void WriteBits(const std::vector<bool> &bits);
+  static constexpr size_t kChunkSize = 64 << 10;
 
  private:
   std::istream &in_;
   std::ostream &out_;
   int64_t byte_number = 0;  // the number of bytes of original file
 
-  std::queue<bool> bit_buffer_;
   Codewords codewords_;
 };
 };  // namespace bolo_compress
@@ -0,0 +1,161 @@
+#include "lz4.h"
+
+#include <cstring>
+#include <vector>
+
+namespace bolo_compress {
+using namespace std::string_literals;
+
+namespace {
+constexpr size_t kMinMatch = 4;
+constexpr size_t kMaxOffset = 65535;
+constexpr int kHashBits = 14;
+// the last 5 bytes are always literals, and no match starts in the last 12 bytes
+constexpr size_t kLastLiterals = 5;
+constexpr size_t kMatchStartLimit = 12;
+
+inline uint32_t Load32(const char *p) {
+  uint32_t v;
+  std::memcpy(&v, p, sizeof v);
+  return v;
+}
+
+inline uint32_t Hash(uint32_t v) { return (v * 2654435761u) >> (32 - kHashBits); }
+
+// `n` as a run of 255 bytes and a final smaller byte
+inline char *PutLength(char *op, size_t n) {
+  for (; n >= 255; n -= 255) *op++ = '\xff';
+  *op++ = static_cast<char>(n);
+  return op;
+}
+
+// an offset of 0 marks the last sequence, which has literals only
+char *PutSequence(char *op, const char *literals, size_t literal_len, size_t offset,
+                  size_t match_len) {
+  char *token = op++;
+  uint8_t t = literal_len >= 15 ? 0xf0 : static_cast<uint8_t>(literal_len << 4);
+  if (literal_len >= 15) op = PutLength(op, literal_len - 15);
+  std::memcpy(op, literals, literal_len);
+  op += literal_len;
+
+  if (offset != 0) {
+    *op++ = static_cast<char>(offset & 0xff);
+    *op++ = static_cast<char>(offset >> 8);
+    auto m = match_len - kMinMatch;
+    t |= m >= 15 ? 15 : static_cast<uint8_t>(m);
+    if (m >= 15) op = PutLength(op, m - 15);
+  }
+  *token = static_cast<char>(t);
+  return op;
+}
+
+// add the 255-extended part of a length to `n`; returns false on truncated input
+inline bool GetLength(const uint8_t *&ip, const uint8_t *iend, size_t &n) {
+  uint8_t b;
+  do {
+    if (ip == iend) return false;
+    b = *ip++;
+    n += b;
+  } while (b == 255);
+  return true;
+}
+};  // namespace
+
+void Lz4::EncodeBlock(const char *data, size_t size, const Options &, std::string &out) {
+  auto base = out.size();
+  out.resize(base + size + size / 255 + 16);
+  char *op = out.data() + base;
+
+  size_t anchor = 0;
+  if (size > kMatchStartLimit) {
+    // positions are verified before use, so the zeroed table needs no empty marker
+    std::vector<uint32_t> table(size_t{1} << kHashBits);
+    size_t match_start_limit = size - kMatchStartLimit;
+    size_t match_limit = size - kLastLiterals;
+    size_t misses = 0;
+
+    for (size_t ip = 0; ip < match_start_limit;) {
+      auto v = Load32(data + ip);
+      auto &slot = table[Hash(v)];
+      size_t cand = slot;
+      slot = static_cast<uint32_t>(ip);
+      if (cand >= ip || ip - cand > kMaxOffset || Load32(data + cand) != v) {
+        // skip ahead faster the longer nothing matches
+        ip += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+
+      while (ip > anchor && cand > 0 && data[ip - 1] == data[cand - 1]) ip--, cand--;
+
+      size_t len = kMinMatch;
+      while (ip + len + 8 <= match_limit &&
+             std::memcmp(data + cand + len, data + ip + len, 8) == 0)
+        len += 8;
+      while (ip + len < match_limit && data[cand + len] == data[ip + len]) len++;
+
+      op = PutSequence(op, data + anchor, ip - anchor, ip - cand, len);
+      ip += len;
+      anchor = ip;
+      if (ip < match_start_limit)
+        table[Hash(Load32(data + ip - 2))] = static_cast<uint32_t>(ip - 2);
+    }
+  }
+
+  op = PutSequence(op, data + anchor, size - anchor, 0, 0);
+  out.resize(op - out.data());
+}
+
+Insidious<std::string> Lz4::DecodeBlock(const char *data, size_t data_size, char *out,
+                                        size_t size) {
+  const auto *ip = reinterpret_cast<const uint8_t *>(data);
+  const auto *iend = ip + data_size;
+  char *op = out, *oend = out + size;
+
+  while (true) {
+    if (ip == iend) return Danger("broken lz4 block"s);
+    auto token = *ip++;
+
+    size_t literal_len = token >> 4;
+    if (literal_len == 15 && !GetLength(ip, iend, literal_len))
+      return Danger("broken lz4 literal length"s);
+    if (literal_len > static_cast<size_t>(iend - ip) ||
+        literal_len > static_cast<size_t>(oend - op))
+      return Danger("broken lz4 literals"s);
+    if (literal_len <= 16 && iend - ip >= 16 && oend - op >= 16)
+      std::memcpy(op, ip, 16);  // a fixed-size copy is much cheaper for the usual short runs
+    else
+      std::memcpy(op, ip, literal_len);
+    op += literal_len;
+    ip += literal_len;
+
+    if (ip == iend) break;
+
+    if (iend - ip < 2) return Danger("broken lz4 offset"s);
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > static_cast<size_t>(op - out))
+      return Danger("broken lz4 offset"s);
+
+    size_t len = token & 15;
+    if (len == 15 && !GetLength(ip, iend, len)) return Danger("broken lz4 match length"s);
+    len += kMinMatch;
+    if (len > static_cast<size_t>(oend - op)) return Danger("broken lz4 match length"s);
+
+    const char *match = op - offset;
+    if (offset >= 16 && static_cast<size_t>(oend - op) >= len + 16) {
+      // 16 bytes at a time, each copy reading only bytes that are already written;
+      // the last one may spill into the space of the following bytes
+      for (size_t k = 0; k < len; k += 16) std::memcpy(op + k, match + k, 16);
+    } else if (offset >= 8 && static_cast<size_t>(oend - op) >= len + 8) {
+      for (size_t k = 0; k < len; k += 8) std::memcpy(op + k, match + k, 8);
+    } else {
+      for (size_t k = 0; k < len; k++) op[k] = match[k];
+    }
+    op += len;
+  }
+
+  if (op != oend) return Danger("broken lz4 block size"s);
+  return Safe;
+}
+};  // namespace bolo_compress
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+
+#include "compress.h"
+#include "result.h"
+
+namespace bolo_compress {
+using namespace bolo;
+
+/*
+ * Lz4: a byte-aligned LZ77 coder without entropy coding, laid out like an LZ4 block.
+ *
+ * Each sequence is
+ *   token     uint8, literal count in the high 4 bits, match length - 4 in the low 4 bits
+ *   literals  (count >= 15: followed by bytes of 255 and a final smaller byte to add)
+ *   offset    uint16 little endian, 1 to 65535
+ *   length    (match length - 4 >= 15: extended like the literal count)
+ * and the last sequence has literals only. The encoder probes a single hash slot per position
+ * and skips ahead faster through input that does not match, trading ratio for speed.
+ */
+class Lz4 {
+ public:
+  static void EncodeBlock(const char *data, size_t size, const Options &opts, std::string &out);
+  static Insidious<std::string> DecodeBlock(const char *data, size_t data_size, char *out,
+                                            size_t size);
+};
+};  // namespace bolo_compress
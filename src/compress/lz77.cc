@@ -0,0 +1,241 @@
+#include "lz77.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "bit_io.h"
+#include "huffman.h"
+#include "varint.h"
+
+namespace bolo_compress {
+using namespace std::string_literals;
+
+namespace {
+constexpr size_t kMinMatch = 4;
+constexpr size_t kMaxMatch = 1 << 16;
+constexpr int kHashBits = 16;
+
+// Level: how hard the match finder tries
+struct Level {
+  int chain;    // candidates visited per position
+  bool lazy;    // prefer a longer match starting one byte later
+  size_t nice;  // stop searching once a match is this long
+};
+// levels 1 to 9
+constexpr Level kLevels[] = {
+    {4, false, 16},  {8, false, 32},    {16, false, 64},   {16, true, 64},
+    {32, true, 128}, {64, true, 258},   {128, true, 1024}, {512, true, 4096},
+    {4096, true, kMaxMatch},
+};
+
+/*
+ * Values (literal runs, match lengths, distances) are coded as a byte-sized bucket code plus
+ * extra bits: v < 8 is its own code; otherwise the code holds the position of the highest set
+ * bit and the two bits below it, and the remaining low bits follow as extra bits.
+ */
+inline void SplitValue(uint32_t v, uint8_t &code, int &nbits, uint32_t &extra) {
+  if (v < 8) {
+    code = static_cast<uint8_t>(v);
+    nbits = 0;
+    extra = 0;
+    return;
+  }
+  int h = 31 - __builtin_clz(v);
+  nbits = h - 2;
+  code = static_cast<uint8_t>(8 + (h - 3) * 4 + ((v >> nbits) & 3));
+  extra = v & ((1u << nbits) - 1);
+}
+
+inline bool JoinValue(uint8_t code, BitReader &reader, uint32_t &v) {
+  if (code < 8) {
+    v = code;
+    return true;
+  }
+  int h = (code - 8) / 4 + 3;
+  if (h > 31) return false;
+
+  int nbits = h - 2;
+  reader.Refill();
+  if (reader.available() < nbits) return false;
+  v = (static_cast<uint32_t>(4 | ((code - 8) & 3)) << nbits) | reader.Read(nbits);
+  return true;
+}
+
+// MatchFinder: hash chains over the 4-byte prefixes of a block
+class MatchFinder {
+ public:
+  MatchFinder(const uint8_t *data, size_t size, size_t window, const Level &level)
+      : data_{data},
+        size_{size},
+        window_{window},
+        level_{level},
+        head_(size_t{1} << kHashBits, -1),
+        prev_(size) {}
+
+  // add every position before `end` to the chains
+  void InsertUpTo(size_t end) {
+    for (; next_ < end && next_ + kMinMatch <= size_; next_++) {
+      auto h = Hash(next_);
+      prev_[next_] = head_[h];
+      head_[h] = static_cast<int32_t>(next_);
+    }
+  }
+
+  // the longest match for `pos` among the inserted positions, 0 if there is none
+  size_t Find(size_t pos, size_t &dist) const {
+    size_t best = 0;
+    size_t limit = std::min(kMaxMatch, size_ - pos);
+    if (limit < kMinMatch) return 0;
+
+    int chain = level_.chain;
+    for (int32_t cand = head_[Hash(pos)]; cand >= 0 && chain-- > 0; cand = prev_[cand]) {
+      if (pos - cand > window_) break;
+
+      const uint8_t *a = data_ + cand, *b = data_ + pos;
+      if (a[best] != b[best] || std::memcmp(a, b, kMinMatch) != 0) continue;
+
+      size_t len = kMinMatch;
+      while (len < limit && a[len] == b[len]) len++;
+      if (len > best) {
+        best = len;
+        dist = pos - cand;
+        if (len >= level_.nice || len == limit) break;
+      }
+    }
+    return best >= kMinMatch ? best : 0;
+  }
+
+ private:
+  uint32_t Hash(size_t pos) const {
+    uint32_t v;
+    std::memcpy(&v, data_ + pos, sizeof v);
+    return (v * 2654435761u) >> (32 - kHashBits);
+  }
+
+  const uint8_t *data_;
+  size_t size_;
+  size_t window_;
+  Level level_;
+  std::vector<int32_t> head_;
+  std::vector<int32_t> prev_;
+  size_t next_ = 0;
+};
+
+void PutStream(std::string &out, const std::string &symbols) {
+  std::string coded;
+  Huffman::EncodeBlock(symbols.data(), symbols.size(), coded);
+  PutVarint(out, coded.size());
+  out += coded;
+}
+
+Insidious<std::string> GetStream(const char *&pos, const char *end, std::string &symbols) {
+  uint64_t size;
+  if (!GetVarint(pos, end, size) || size > static_cast<uint64_t>(end - pos))
+    return Danger("broken lz77 block"s);
+  auto ins = Huffman::DecodeBlock(pos, size, symbols.data(), symbols.size());
+  pos += size;
+  return ins;
+}
+};  // namespace
+
+void Lz77::EncodeBlock(const char *data, size_t size, const Options &opts, std::string &out) {
+  const auto &level = kLevels[std::clamp(opts.level, 1, 9) - 1];
+  const auto *p = reinterpret_cast<const uint8_t *>(data);
+  MatchFinder finder(p, size, std::max<size_t>(opts.window, 1), level);
+
+  std::string literals, runs, lengths, dists, extras;
+  BitWriter extra_writer(extras);
+  size_t sequences = 0;
+
+  auto put = [&](std::string &codes, uint32_t v) {
+    uint8_t code;
+    int nbits;
+    uint32_t extra;
+    SplitValue(v, code, nbits, extra);
+    codes.push_back(static_cast<char>(code));
+    extra_writer.Write(extra, nbits);
+  };
+
+  size_t pos = 0, lit_start = 0;
+  while (pos + kMinMatch <= size) {
+    size_t dist = 0;
+    finder.InsertUpTo(pos);
+    size_t len = finder.Find(pos, dist);
+    if (len == 0) {
+      pos++;
+      continue;
+    }
+
+    // lazy matching: emit a literal instead if the next position matches longer
+    while (level.lazy && len < level.nice && pos + 1 + kMinMatch <= size) {
+      size_t dist2 = 0;
+      finder.InsertUpTo(pos + 1);
+      size_t len2 = finder.Find(pos + 1, dist2);
+      if (len2 <= len) break;
+      pos++;
+      len = len2;
+      dist = dist2;
+    }
+
+    literals.append(data + lit_start, pos - lit_start);
+    put(runs, static_cast<uint32_t>(pos - lit_start));
+    put(lengths, static_cast<uint32_t>(len - kMinMatch));
+    put(dists, static_cast<uint32_t>(dist - 1));
+    sequences++;
+
+    pos += len;
+    lit_start = pos;
+  }
+  literals.append(data + lit_start, size - lit_start);
+  extra_writer.Flush();
+
+  PutVarint(out, sequences);
+  PutVarint(out, literals.size());
+  PutStream(out, literals);
+  PutStream(out, runs);
+  PutStream(out, lengths);
+  PutStream(out, dists);
+  out += extras;
+}
+
+Insidious<std::string> Lz77::DecodeBlock(const char *data, size_t data_size, char *out,
+                                         size_t size) {
+  const char *pos = data, *end = data + data_size;
+
+  uint64_t sequences, literal_cnt;
+  if (!GetVarint(pos, end, sequences) || !GetVarint(pos, end, literal_cnt) ||
+      sequences > size || literal_cnt > size)
+    return Danger("broken lz77 block"s);
+
+  std::string literals(literal_cnt, '\0'), runs(sequences, '\0'), lengths(sequences, '\0'),
+      dists(sequences, '\0');
+  for (auto s : {&literals, &runs, &lengths, &dists})
+    if (auto ins = GetStream(pos, end, *s)) return ins;
+
+  BitReader extras(pos, end - pos);
+  size_t o = 0, l = 0;
+  for (size_t i = 0; i < sequences; i++) {
+    uint32_t run, len, dist;
+    if (!JoinValue(static_cast<uint8_t>(runs[i]), extras, run) ||
+        !JoinValue(static_cast<uint8_t>(lengths[i]), extras, len) ||
+        !JoinValue(static_cast<uint8_t>(dists[i]), extras, dist))
+      return Danger("broken lz77 extra bits"s);
+
+    len += kMinMatch;
+    dist += 1;
+    if (run > literal_cnt - l || run > size - o) return Danger("broken lz77 literal run"s);
+    std::memcpy(out + o, literals.data() + l, run);
+    o += run;
+    l += run;
+
+    if (dist > o || len > size - o) return Danger("broken lz77 match"s);
+    // the source may overlap the destination, so copy byte by byte
+    for (size_t k = 0; k < len; k++, o++) out[o] = out[o - dist];
+  }
+
+  if (literal_cnt - l != size - o) return Danger("broken lz77 block size"s);
+  std::memcpy(out + o, literals.data() + l, literal_cnt - l);
+  return Safe;
+}
+};  // namespace bolo_compress
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+
+#include "compress.h"
+#include "result.h"
+
+namespace bolo_compress {
+using namespace bolo;
+
+/*
+ * Lz77: a dictionary coder in the spirit of DEFLATE.
+ *
+ * A hash-chain match finder turns a block into sequences of
+ * (literal run, match length, match distance). The literals and the three kinds of sequence
+ * codes go into four streams that are Huffman coded separately; the low bits of long values
+ * follow as raw extra bits.
+ *
+ * Block payload:
+ *   varint sequences, varint literals
+ *   4 * (varint size, Huffman block): literals, run codes, length codes, distance codes
+ *   extra bits
+ *
+ * Matches never reach outside their block, so blocks can still be decoded on their own.
+ */
+class Lz77 {
+ public:
+  static void EncodeBlock(const char *data, size_t size, const Options &opts, std::string &out);
+  static Insidious<std::string> DecodeBlock(const char *data, size_t data_size, char *out,
+                                            size_t size);
+};
+};  // namespace bolo_compress
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <type_traits>
+
+namespace bolo_compress {
+
+// LEB128 varints: 7 bits per byte, least significant group first, endian independent.
+
+inline void PutVarint(std::string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<char>(v));
+}
+
+// parse a varint from [pos, end) and advance `pos`; returns false on truncated input
+inline bool GetVarint(const char *&pos, const char *end, uint64_t &v) {
+  v = 0;
+  for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+    auto b = static_cast<uint8_t>(*pos++);
+    v |= static_cast<uint64_t>(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+inline void WriteVarint(std::ostream &out, uint64_t v) {
+  std::string s;
+  PutVarint(s, v);
+  out.write(s.data(), s.size());
+}
+
+// returns false on EOF or a malformed varint
+inline bool ReadVarint(std::istream &in, uint64_t &v) {
+  v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    auto c = in.get();
+    if (c == std::istream::traits_type::eof()) return false;
+    v |= static_cast<uint64_t>(c & 0x7f) << shift;
+    if ((c & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+// fixed-width little-endian integers, for the fields of the legacy format
+
+template <typename T>
+inline void PutFixed(std::string &out, T v) {
+  for (size_t i = 0; i < sizeof(T); i++) out.push_back(static_cast<char>(v >> (8 * i)));
+}
+
+template <typename T>
+inline T GetFixed(const char *p) {
+  std::make_unsigned_t<T> v = 0;
+  for (size_t i = 0; i < sizeof(T); i++)
+    v |= static_cast<std::make_unsigned_t<T>>(static_cast<uint8_t>(p[i])) << (8 * i);
+  return static_cast<T>(v);
+}
+
+};  // namespace bolo_compress
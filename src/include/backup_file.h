@@ -2,9 +2,20 @@
 
 #include <string>
 
+#include "compress.h"
 #include "lib/jsonlib.h"
 #include "types.h"
 
+namespace bolo_compress {
+NLOHMANN_JSON_SERIALIZE_ENUM(Scheme, {
+                                         {Scheme::DEFLATE, "deflate"},
+                                         {Scheme::HUFFMAN, "huffman"},
+                                         {Scheme::FAST, "fast"},
+                                         {Scheme::STORE, "store"},
+                                         {Scheme::HUFFMAN_LEGACY, "huffman_legacy"},
+                                     });
+};  // namespace bolo_compress
+
 namespace bolo {
 struct BackupFile {
   BackupFileId id;
@@ -15,14 +26,58 @@ struct BackupFile {
   bool is_compressed;       // 是否压缩
   bool is_encrypted;        // 是否加密
   bool is_in_cloud;         // 是否云备份
+  // 压缩方式, 仅在 is_compressed 时有效
+  bolo_compress::Scheme scheme = bolo_compress::Scheme::DEFLATE;
+  int level = 6;
+  // 去重备份: backup_path 是清单, 文件内容按块存在同目录的 chunks/ 下,
+  // 与其他去重备份共享
+  bool is_deduplicated = false;
+  // 去重备份的增量层数: 每次更新只把变化的文件记在一层新的清单里,
+  // 恢复时逐层叠加
+  int layers = 0;
+
+  // tar 索引, 记录每个文件在 tar 中的偏移
+  // 加密的备份没有索引 (会泄露文件名)
+  std::string index_path() const { return backup_path + ".idx"; }
+  // 第 i 层 (从 1 开始) 的清单
+  std::string layer_path(int i) const { return backup_path + "." + std::to_string(i); }
 
   bool operator==(const BackupFile &f) const {
     return id == f.id;
   }
 };
 
-NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(BackupFile, id, filename, path, backup_path, timestamp,
-                                   is_compressed, is_encrypted, is_in_cloud);
+inline void to_json(json &j, const BackupFile &f) {
+  j = json{{"id", f.id},
+           {"filename", f.filename},
+           {"path", f.path},
+           {"backup_path", f.backup_path},
+           {"timestamp", f.timestamp},
+           {"is_compressed", f.is_compressed},
+           {"is_encrypted", f.is_encrypted},
+           {"is_in_cloud", f.is_in_cloud},
+           {"scheme", f.scheme},
+           {"level", f.level},
+           {"is_deduplicated", f.is_deduplicated},
+           {"layers", f.layers}};
+}
+
+// scheme, level, is_deduplicated and layers are optional: configs written before they existed
+// get the defaults
+inline void from_json(const json &j, BackupFile &f) {
+  j.at("id").get_to(f.id);
+  j.at("filename").get_to(f.filename);
+  j.at("path").get_to(f.path);
+  j.at("backup_path").get_to(f.backup_path);
+  j.at("timestamp").get_to(f.timestamp);
+  j.at("is_compressed").get_to(f.is_compressed);
+  j.at("is_encrypted").get_to(f.is_encrypted);
+  j.at("is_in_cloud").get_to(f.is_in_cloud);
+  f.scheme = j.value("scheme", bolo_compress::Scheme::DEFLATE);
+  f.level = j.value("level", 6);
+  f.is_deduplicated = j.value("is_deduplicated", false);
+  f.layers = j.value("layers", 0);
+}
 
 using BackupList = std::unordered_map<std::uint64_t, BackupFile>;
 
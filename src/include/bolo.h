@@ -1,13 +1,21 @@
 #pragma once
 #include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "backup_file.h"
 #include "libfswatch/c++/monitor.hpp"
+#include "path_trie.h"
 #include "result.h"
+#include "scheduler.h"
+#include "store.h"
 #include "types.h"
 #include "util.h"
 
@@ -16,16 +24,28 @@ namespace fs = std::filesystem;
 
 class Bolo {
  public:
+  // 创建监控备份路径的 monitor; 为空时使用系统默认的 monitor
+  using MonitorFactory = std::function<fsw::monitor *(
+      const std::vector<std::string> &paths, fsw::FSW_EVENT_CALLBACK *callback, void *context)>;
+
   // Input:
   //   path: json config 配置路径
+  //   create_monitor: 开启自动更新时用来创建 monitor
   // Returns bolo: Result<Bolo> on success;
   // Return error massage: Result<std::string> on error
-  static Result<std::unique_ptr<Bolo>, std::string> LoadFromJsonFile(const fs::path &path);
+  static Result<std::unique_ptr<Bolo>, std::string> LoadFromJsonFile(
+      const fs::path &path, MonitorFactory create_monitor = nullptr);
+
+  // 停止监控; 等待中的更新会先执行完
+  ~Bolo();
 
   // 添加一个备份文件
-  Result<BackupFile, std::string> Backup(const fs::path &path, bool is_compressed,
-                                         bool is_encrypted, bool enable_cloud = false,
-                                         const std::string &key = "");
+  // scheme, level: 压缩方式; 常更新的路径可用 FAST, 冷归档可用 DEFLATE 的 9 级
+  // deduplicate: 按内容切块存储, 相同的块只存一份; 不支持加密
+  Result<BackupFile, std::string> Backup(
+      const fs::path &path, bool is_compressed, bool is_encrypted, bool enable_cloud = false,
+      const std::string &key = "", bolo_compress::Scheme scheme = bolo_compress::Scheme::DEFLATE,
+      int level = 6, bool deduplicate = false);
 
   // 删除一个备份文件
   Insidious<std::string> Remove(BackupFileId id);
@@ -33,30 +53,68 @@ class Bolo {
   // 更新一个备份文件
   Insidious<std::string> Update(BackupFileId id, const std::string &key = "");
 
+  // 只更新备份中 changed 这些路径 (及其下的文件), 其余文件不会被读取
+  // 仅对去重备份有效, 其他备份会整个更新
+  Insidious<std::string> Patch(BackupFileId id, const std::vector<fs::path> &changed);
+
   // 恢复一个备份文件
   // restore_path 是恢复位置的文件夹路径
+  // patterns: 只恢复匹配的文件 (glob, 例如 "foo/src" 或 "foo/*.txt"),
+  //   路径以备份的文件名开头; 匹配的文件夹会连同其内容一起恢复,
+  //   已经存在的文件不会被覆盖. 为空时恢复整个备份
   Insidious<std::string> Restore(BackupFileId id, const fs::path &restore_path,
-                                 const std::string &key = "");
+                                 const std::string &key = "",
+                                 const std::vector<std::string> &patterns = {});
 
   Maybe<BackupFile> GetBackupFile(BackupFileId id) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
     if (backup_files_.find(id) != backup_files_.end()) return Just(backup_files_[id]);
     return Nothing;
   }
 
   void SetMonitor(std::shared_ptr<fsw::monitor> monitor) { fs_monitor_ = monitor; }
 
+  // 监控触发的更新的队列长度和延迟; 没有开启自动更新时全为 0
+  SchedulerMetrics UpdateMetrics() const {
+    return scheduler_ ? scheduler_->Metrics() : SchedulerMetrics{};
+  }
+
  private:
   Bolo(const fs::path &config_path, json &&config, BackupList &&m, BackupFileId next_id,
        const fs::path &backup_dir, const fs::path &cloud_path,
-       bool enable_auto_update);
+       bool enable_auto_update, const SchedulerOptions &update_opts,
+       MonitorFactory create_monitor);
 
   // 更新配置文件:
   //     备份文件列表更新, 或者其他配置信息更新; 配置更新后, 必须将配置持久化成功后才返回 true
   Insidious<std::string> UpdateConfig();
   Insidious<std::string> BackupImpl(BackupFile &file, const std::string &key);
+  Insidious<std::string> BackupChunks(BackupFile &file);
+  Insidious<std::string> AddLayer(BackupFile &file, bolo_store::Manifest base,
+                                  const bolo_store::Manifest &layer);
   BackupFileId NextId() { return next_id_++; }
   void MonitorCallback(const std::vector<fsw::event> &events);
-  void UpdateMonitor(std::shared_ptr<std::thread> join);
+  void RunMonitor();
+  void WatchRoot(const BackupFile &file, bool watch);
+  // 在监控线程使用的快照中加入或删除 file 的路径, 调用者持有 mutex_
+  void UpdateRoots(const BackupFile &file, bool insert);
+
+  // 一个备份的锁: 备份, 更新, 恢复和删除时持有, 不同的备份可以同时更新.
+  // 去重备份还共享地持有块存储的锁, 回收块时独占它
+  struct BackupLock {
+    std::shared_ptr<std::mutex> mutex;
+    std::unique_lock<std::mutex> lock;
+    std::shared_ptr<std::shared_mutex> store;  // 非去重备份为空
+    std::shared_lock<std::shared_mutex> store_lock;
+  };
+  BackupLock LockBackup(const BackupFile &file);
+  // 锁住之后再把备份读到 file, 等锁时它可能已经被更新或者删除; 没有这个备份时 mutex 为空
+  BackupLock LockBackup(BackupFileId id, BackupFile &file);
+  // 删除 file 的块存储中不再被任何去重备份引用的块; 等待时暂时放开 lock 共享的块存储
+  Insidious<std::string> CollectChunks(BackupLock &lock, const BackupFile &file);
+  Insidious<std::string> UpdateLocked(BackupLock &lock, BackupFile &file, const std::string &key);
+  // 写回更新后的备份
+  Insidious<std::string> SaveBackupFile(const BackupFile &file);
 
   PropertyWithGetter(fs::path, config_file_path);  // 配置文件路径
   PropertyWithGetter(json, config);                // 配置
@@ -65,8 +123,22 @@ class Bolo {
   PropertyWithGetter(fs::path, backup_dir);        // 备份文件夹路径
   PropertyWithGetter(fs::path, cloud_path);        // cloud backup path
 
+  // 自动更新的 (未加密的) 备份: 路径 -> 备份文件 id, 用来找到事件所属的备份.
+  // 监控线程使用快照, 不需要等待 mutex_; 修改时复制一份再换上, 只复制改动的节点
+  std::shared_ptr<const PathTrie<BackupFileId>> roots_;
+  std::mutex roots_mutex_;
   std::shared_ptr<fsw::monitor> fs_monitor_;
+  MonitorFactory create_monitor_;
   std::shared_ptr<std::thread> thread_;
   bool enable_auto_update_;
+  bool closing_ = false;          // 析构中, 不再创建 monitor
+  bool restart_monitor_ = false;  // monitor 不支持增删路径, 要重新创建
+  // 保护备份列表和配置, 只在读写它们时短暂持有; 备份本身由 BackupLock 保护
+  // 接口之间会互相调用, 所以是 recursive
+  std::recursive_mutex mutex_;
+  std::unordered_map<BackupFileId, std::shared_ptr<std::mutex>> backup_locks_;
+  std::unordered_map<std::string, std::shared_ptr<std::shared_mutex>> store_locks_;  // 块存储路径
+  // 最先析构 (declared last): pending updates stop before the members they use are destroyed
+  std::unique_ptr<UpdateScheduler> scheduler_;
 };
 };  // namespace bolo
@@ -1,16 +1,52 @@
 #pragma once
 
+#include <cstdint>
 #include <istream>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "result.h"
 
 namespace bolo_compress {
+// Every scheme but HUFFMAN_LEGACY is a codec of the block stream, whose header names the codec
+// and level, so Uncompress picks the decoder by itself.
 enum class Scheme {
+  // LZ77 matching followed by Huffman coding of literals and matches; level 9 with large blocks
+  // suits archives that are rarely read
   DEFLATE,
+  // order-0 Huffman coding of every block
+  HUFFMAN,
+  // byte-aligned LZ77 without entropy coding: much faster on both ends, for data that changes
+  // often
+  FAST,
+  // blocks are stored as they are
+  STORE,
+  // the original format: one code table for the whole input, which is read twice and
+  // therefore has to be seekable
+  HUFFMAN_LEGACY,
+};
+
+struct Options {
+  // the input is compressed in independent blocks of `block_size` bytes
+  size_t block_size = 256 << 10;
+  // blocks are coded by `threads` workers, 0 means one per hardware thread
+  size_t threads = 0;
+  // DEFLATE: 1 (fastest) to 9 (smallest)
+  int level = 6;
+  // DEFLATE: the farthest a match may reach back, in bytes
+  size_t window = 256 << 10;
+  // Uncompress: if not empty, only these sorted [begin, end) ranges of the output are needed.
+  // Blocks outside all of them are not decoded but come out as zeros, and the output ends with
+  // the last block needed. Streams without a block header ignore them.
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
 };
 
 // `in` and `out` should both be binary stream
-bolo::Insidious<std::string> Compress(std::istream &in, std::ostream &out, Scheme s);
-bolo::Insidious<std::string> Uncompress(std::istream &in, std::ostream &out, Scheme s);
+bolo::Insidious<std::string> Compress(std::istream &in, std::ostream &out, Scheme s,
+                                      const Options &opts = Options{});
+// the codec is detected from the stream header. `s` only matters for streams without one:
+// STORE copies them through unchanged, any other scheme reads them as HUFFMAN_LEGACY.
+bolo::Insidious<std::string> Uncompress(std::istream &in, std::ostream &out, Scheme s,
+                                        const Options &opts = Options{});
 };  // namespace bolo_compress
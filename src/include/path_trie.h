@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace bolo {
+
+// PathTrie: values keyed by paths, split into their components.
+// `Match` finds the values of a path and of all its parent directories by walking the path once,
+// so the cost of a lookup does not depend on how many paths are stored. Paths are compared as
+// given (after lexically_normal): absolute and relative paths never match each other.
+// Copies share their nodes, and `Insert` and `Erase` only copy the nodes on the path they change,
+// so a copy can be changed and swapped in while readers keep the old one.
+template <typename T>
+class PathTrie {
+ public:
+  void Insert(const std::filesystem::path &path, const T &value) {
+    auto components = Components(path);
+    InsertAt(root_, components.begin(), components.end(), value);
+    size_++;
+  }
+
+  // removes one `value` of `path`; returns false if there is none
+  bool Erase(const std::filesystem::path &path, const T &value) {
+    auto components = Components(path);
+    if (!EraseAt(root_, components.begin(), components.end(), value)) return false;
+    size_--;
+    return true;
+  }
+
+  // the values of `path` and of its parents, the shortest paths first
+  std::vector<T> Match(const std::filesystem::path &path) const {
+    std::vector<T> res(root_.values);
+    const Node *node = &root_;
+    for (auto &c : Components(path)) {
+      auto it = node->children.find(c);
+      if (it == node->children.end()) break;
+      node = it->second.get();
+      res.insert(res.end(), node->values.begin(), node->values.end());
+    }
+    return res;
+  }
+
+  // all values, in no particular order
+  std::vector<T> Values() const {
+    std::vector<T> res;
+    Collect(root_, res);
+    return res;
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+ private:
+  struct Node {
+    std::unordered_map<std::string, std::shared_ptr<const Node>> children;
+    std::vector<T> values;
+  };
+  using Iter = std::vector<std::string>::const_iterator;
+
+  static void InsertAt(Node &node, Iter c, Iter end, const T &value) {
+    if (c == end) {
+      node.values.push_back(value);
+      return;
+    }
+    // the child may be shared with other copies
+    auto &child = node.children[*c];
+    auto copy = child ? std::make_shared<Node>(*child) : std::make_shared<Node>();
+    InsertAt(*copy, c + 1, end, value);
+    child = std::move(copy);
+  }
+
+  static bool EraseAt(Node &node, Iter c, Iter end, const T &value) {
+    if (c == end) {
+      auto it = std::find(node.values.begin(), node.values.end(), value);
+      if (it == node.values.end()) return false;
+      node.values.erase(it);
+      return true;
+    }
+    auto it = node.children.find(*c);
+    if (it == node.children.end()) return false;
+    auto copy = std::make_shared<Node>(*it->second);
+    if (!EraseAt(*copy, c + 1, end, value)) return false;
+
+    // nodes left without values or children go
+    if (copy->values.empty() && copy->children.empty())
+      node.children.erase(it);
+    else
+      it->second = std::move(copy);
+    return true;
+  }
+
+  static void Collect(const Node &node, std::vector<T> &res) {
+    res.insert(res.end(), node.values.begin(), node.values.end());
+    for (auto &it : node.children) Collect(*it.second, res);
+  }
+
+  // "/a/b/" -> {"/", "a", "b"}
+  static std::vector<std::string> Components(const std::filesystem::path &path) {
+    std::vector<std::string> res;
+    for (auto &c : path.lexically_normal()) {
+      auto s = c.string();
+      if (!s.empty() && s != ".") res.push_back(std::move(s));
+    }
+    return res;
+  }
+
+  Node root_;
+  size_t size_ = 0;
+};
+};  // namespace bolo
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "result.h"
+
+namespace bolo {
+
+// Pipe: a bounded in-memory byte channel between two threads.
+// One thread writes to `writer()` while another one reads from `reader()`. The writer blocks when
+// `capacity` bytes are pending, the reader blocks when the pipe is empty.
+class Pipe {
+ public:
+  static constexpr size_t kDefaultCapacity = 1 << 20;
+
+  explicit Pipe(size_t capacity = kDefaultCapacity)
+      : ring_(capacity), rbuf_{this}, wbuf_{this}, reader_{&rbuf_}, writer_{&wbuf_} {}
+
+  Pipe(const Pipe &) = delete;
+  Pipe &operator=(const Pipe &) = delete;
+
+  std::istream &reader() { return reader_; }
+  std::ostream &writer() { return writer_; }
+
+  // flush the pending bytes; the reader gets EOF once the pipe is drained
+  void CloseWrite() {
+    writer_.flush();
+    std::lock_guard<std::mutex> lock(mutex_);
+    write_closed_ = true;
+    cv_.notify_all();
+  }
+
+  // the reader is gone; subsequent writes fail
+  void CloseRead() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    read_closed_ = true;
+    cv_.notify_all();
+  }
+
+ private:
+  // blocks until all `n` bytes are queued; returns false if the read side is closed
+  bool Put(const char *s, size_t n) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (n > 0) {
+      cv_.wait(lock, [this] { return read_closed_ || size_ < ring_.size(); });
+      if (read_closed_) return false;
+
+      size_t tail = (head_ + size_) % ring_.size();
+      size_t cnt = std::min({n, ring_.size() - size_, ring_.size() - tail});
+      std::copy(s, s + cnt, ring_.begin() + tail);
+      size_ += cnt;
+      s += cnt;
+      n -= cnt;
+      cv_.notify_all();
+    }
+    return true;
+  }
+
+  // blocks until some bytes are available; returns 0 on EOF
+  size_t Get(char *s, size_t n) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return write_closed_ || size_ > 0; });
+
+    size_t res = 0;
+    while (n > 0 && size_ > 0) {
+      size_t cnt = std::min({n, size_, ring_.size() - head_});
+      std::copy(ring_.begin() + head_, ring_.begin() + head_ + cnt, s);
+      head_ = (head_ + cnt) % ring_.size();
+      size_ -= cnt;
+      s += cnt;
+      n -= cnt;
+      res += cnt;
+    }
+    cv_.notify_all();
+    return res;
+  }
+
+  class ReadBuf : public std::streambuf {
+   public:
+    explicit ReadBuf(Pipe *pipe) : pipe_{pipe} {}
+
+   protected:
+    int_type underflow() override {
+      size_t n = pipe_->Get(buf_, sizeof buf_);
+      if (n == 0) return traits_type::eof();
+      setg(buf_, buf_, buf_ + n);
+      return traits_type::to_int_type(*gptr());
+    }
+
+    std::streamsize xsgetn(char *s, std::streamsize n) override {
+      std::streamsize res = std::min<std::streamsize>(n, egptr() - gptr());
+      std::copy(gptr(), gptr() + res, s);
+      gbump(static_cast<int>(res));
+
+      // large reads bypass the local buffer
+      while (res < n) {
+        size_t cnt = pipe_->Get(s + res, n - res);
+        if (cnt == 0) break;
+        res += cnt;
+      }
+      return res;
+    }
+
+   private:
+    Pipe *pipe_;
+    char buf_[64 << 10];
+  };
+
+  class WriteBuf : public std::streambuf {
+   public:
+    explicit WriteBuf(Pipe *pipe) : pipe_{pipe} { setp(buf_, buf_ + sizeof buf_); }
+
+   protected:
+    int_type overflow(int_type c) override {
+      if (sync() != 0) return traits_type::eof();
+      if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+      }
+      return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+      bool ok = pipe_->Put(pbase(), pptr() - pbase());
+      setp(buf_, buf_ + sizeof buf_);
+      return ok ? 0 : -1;
+    }
+
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+      if (n < epptr() - pptr()) {
+        std::copy(s, s + n, pptr());
+        pbump(static_cast<int>(n));
+        return n;
+      }
+      // large writes bypass the local buffer
+      if (sync() != 0 || !pipe_->Put(s, n)) return 0;
+      return n;
+    }
+
+   private:
+    Pipe *pipe_;
+    char buf_[64 << 10];
+  };
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<char> ring_;
+  size_t head_ = 0;
+  size_t size_ = 0;
+  bool write_closed_ = false;
+  bool read_closed_ = false;
+
+  ReadBuf rbuf_;
+  WriteBuf wbuf_;
+  std::istream reader_;
+  std::ostream writer_;
+};
+
+// Stage: one step of a pipeline, reads from `in` and writes to `out`
+using Stage = std::function<Insidious<std::string>(std::istream &in, std::ostream &out)>;
+
+// RunPipeline runs every stage on its own thread: in -> stages[0] -> ... -> stages[n-1] -> out.
+// Adjacent stages are connected by bounded Pipes, so no stage ever holds the whole stream.
+// Returns the error of the stage that failed first.
+inline Insidious<std::string> RunPipeline(std::istream &in, const std::vector<Stage> &stages,
+                                          std::ostream &out) {
+  using namespace std::string_literals;
+  if (stages.empty()) return Danger("empty pipeline"s);
+
+  std::vector<std::unique_ptr<Pipe>> pipes;
+  for (size_t i = 1; i < stages.size(); i++) pipes.push_back(std::make_unique<Pipe>());
+
+  std::mutex mutex;
+  Insidious<std::string> first_error = Safe;
+
+  auto run = [&](size_t i) {
+    std::istream &is = i == 0 ? in : pipes[i - 1]->reader();
+    std::ostream &os = i + 1 == stages.size() ? out : pipes[i]->writer();
+
+    Insidious<std::string> res = Safe;
+    try {
+      res = stages[i](is, os);
+    } catch (const std::exception &e) {
+      res = Danger("pipeline stage "s + std::to_string(i) + ": " + e.what());
+    }
+
+    if (res) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!first_error) first_error = res;
+    }
+
+    // wake up the neighbours: the next stage sees EOF, the previous one sees a closed reader.
+    // A stage that succeeded without reading all of its input (e.g. trailing padding) drains
+    // it, so the upstream stage does not fail on a closed pipe.
+    if (i > 0) {
+      if (!res) is.ignore(std::numeric_limits<std::streamsize>::max());
+      pipes[i - 1]->CloseRead();
+    }
+    if (i + 1 < stages.size()) pipes[i]->CloseWrite();
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i + 1 < stages.size(); i++) threads.emplace_back(run, i);
+  run(stages.size() - 1);
+  for (auto &t : threads) t.join();
+
+  return first_error;
+}
+
+};  // namespace bolo
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "types.h"
+
+namespace bolo {
+
+struct SchedulerOptions {
+  std::chrono::milliseconds quiet{2000};       // 等到这么久没有新的事件再更新
+  std::chrono::milliseconds max_delay{30000};  // 第一个事件之后最多等待这么久
+  size_t workers = 1;
+  size_t max_paths = 4096;  // 路径再多就整个更新
+};
+
+struct SchedulerMetrics {
+  size_t pending = 0;  // 等待中的备份 (queue depth)
+  size_t running = 0;
+  uint64_t scheduled = 0;   // Schedule 的次数
+  uint64_t dispatched = 0;  // 执行更新的次数
+  // lag: 从第一个事件到开始更新
+  std::chrono::milliseconds last_lag{0};
+  std::chrono::milliseconds max_lag{0};
+  std::chrono::milliseconds oldest{0};  // 等待最久的备份已经等了多久
+};
+
+// UpdateScheduler: debounces the updates of backups.
+// The changed paths of a backup are merged until no more come for `quiet`, or the first one is
+// `max_delay` old, and are then handed to `task` on one of `workers` threads. The updates of
+// one backup never run at the same time: what comes in meanwhile waits for the next one.
+class UpdateScheduler {
+ public:
+  using Clock = std::chrono::steady_clock;
+  // full: the whole backup is updated, `paths` is empty
+  using Task =
+      std::function<void(BackupFileId id, std::vector<std::filesystem::path> paths, bool full)>;
+
+  explicit UpdateScheduler(Task task, const SchedulerOptions &opts = {})
+      : task_{std::move(task)}, opts_{opts} {
+    for (size_t i = 0; i < std::max<size_t>(opts_.workers, 1); i++)
+      workers_.emplace_back([this] { Work(); });
+  }
+
+  UpdateScheduler(const UpdateScheduler &) = delete;
+  UpdateScheduler &operator=(const UpdateScheduler &) = delete;
+
+  // the pending updates are run at once, none is lost
+  ~UpdateScheduler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    cv_.notify_all();
+    for (auto &t : workers_) t.join();
+  }
+
+  void Schedule(BackupFileId id, std::vector<std::filesystem::path> paths, bool full = false) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto now = Clock::now();
+      auto [it, added] = pending_.try_emplace(id);
+      auto &p = it->second;
+      if (added) p.first = now;
+      p.last = now;
+      p.full |= full;
+      if (!p.full) p.paths.insert(p.paths.end(), paths.begin(), paths.end());
+      if (p.full || p.paths.size() > opts_.max_paths) {
+        p.full = true;
+        p.paths.clear();
+      }
+      metrics_.scheduled++;
+    }
+    cv_.notify_all();
+  }
+
+  // drop the pending update of `id`; one already running is not stopped
+  void Cancel(BackupFileId id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.erase(id);
+  }
+
+  // run the pending updates without waiting, and return once all are done
+  void Flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    flushing_++;
+    cv_.notify_all();
+    cv_.wait(lock, [this] { return pending_.empty() && running_.empty(); });
+    flushing_--;
+  }
+
+  SchedulerMetrics Metrics() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto m = metrics_;
+    m.pending = pending_.size();
+    m.running = running_.size();
+    auto now = Clock::now();
+    for (auto &it : pending_)
+      m.oldest = std::max(m.oldest, std::chrono::duration_cast<std::chrono::milliseconds>(
+                                        now - it.second.first));
+    return m;
+  }
+
+ private:
+  struct Pending {
+    Clock::time_point first, last;  // of the events
+    std::vector<std::filesystem::path> paths;
+    bool full = false;
+  };
+
+  Clock::time_point Due(const Pending &p) const {
+    if (stopped_ || flushing_ > 0) return p.first;
+    return std::min(p.last + opts_.quiet, p.first + opts_.max_delay);
+  }
+
+  void Work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      // the update that is due first, of a backup that is not being updated
+      auto now = Clock::now();
+      auto next = pending_.end();
+      for (auto it = pending_.begin(); it != pending_.end(); it++)
+        if (running_.count(it->first) == 0 &&
+            (next == pending_.end() || Due(it->second) < Due(next->second)))
+          next = it;
+
+      if (next == pending_.end()) {
+        if (stopped_ && pending_.empty()) return;
+        cv_.wait(lock);
+        continue;
+      }
+      if (auto due = Due(next->second); due > now) {
+        cv_.wait_until(lock, due);
+        continue;
+      }
+
+      auto id = next->first;
+      auto p = std::move(next->second);
+      pending_.erase(next);
+      running_.insert(id);
+
+      auto lag = std::chrono::duration_cast<std::chrono::milliseconds>(now - p.first);
+      metrics_.dispatched++;
+      metrics_.last_lag = lag;
+      metrics_.max_lag = std::max(metrics_.max_lag, lag);
+
+      lock.unlock();
+      std::sort(p.paths.begin(), p.paths.end());
+      p.paths.erase(std::unique(p.paths.begin(), p.paths.end()), p.paths.end());
+      task_(id, std::move(p.paths), p.full);
+      lock.lock();
+
+      running_.erase(id);
+      cv_.notify_all();
+    }
+  }
+
+  Task task_;
+  SchedulerOptions opts_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::unordered_map<BackupFileId, Pending> pending_;
+  std::unordered_set<BackupFileId> running_;
+  SchedulerMetrics metrics_;
+  int flushing_ = 0;
+  bool stopped_ = false;
+  std::vector<std::thread> workers_;
+};
+};  // namespace bolo
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "compress.h"
+#include "result.h"
+
+namespace bolo_store {
+
+struct ChunkerOptions {
+  size_t min_size = 16 << 10;
+  size_t avg_size = 64 << 10;  // a power of 2
+  size_t max_size = 256 << 10;
+};
+
+/*
+ * Chunker: content-defined chunking (FastCDC).
+ *
+ * A gear hash rolls over the data and a chunk ends where the hash has its masked bits all zero,
+ * so the cut points move with the content: an insertion only changes the chunks around it.
+ * The mask has more bits before `avg_size` than after it, which keeps most chunks close to the
+ * average size.
+ */
+class Chunker {
+ public:
+  explicit Chunker(const ChunkerOptions &opts = {});
+
+  // the length of the chunk at the start of `data`. Unless `data` is the end of the input,
+  // it should hold at least `max_size` bytes.
+  size_t Next(const char *data, size_t size) const;
+
+  const ChunkerOptions &options() const { return opts_; }
+
+ private:
+  ChunkerOptions opts_;
+  uint64_t mask_small_;  // before avg_size
+  uint64_t mask_large_;  // after avg_size
+};
+
+// lower case hex SHA-256 of `data`
+std::string Sha256(const char *data, size_t size);
+
+/*
+ * ChunkStore: chunks kept in files named by the SHA-256 of their contents,
+ *   root/ab/abcdef...
+ * so a chunk is stored once however many files and backups hold it. A file is a block stream
+ * of bolo_compress, and is checked against its name when read.
+ */
+class ChunkStore {
+ public:
+  explicit ChunkStore(std::filesystem::path root,
+                      bolo_compress::Scheme scheme = bolo_compress::Scheme::STORE,
+                      const bolo_compress::Options &opts = {});
+
+  // store `data` unless it is stored already; returns its hash. Safe to call from many threads.
+  bolo::Result<std::string, std::string> Put(const char *data, size_t size) const;
+  bolo::Result<std::string, std::string> Get(const std::string &hash) const;
+  bool Has(const std::string &hash) const;
+
+  // remove the chunks that are not `live`; returns how many were removed
+  bolo::Result<size_t, std::string> CollectGarbage(const std::unordered_set<std::string> &live);
+
+  const std::filesystem::path &root() const { return root_; }
+
+ private:
+  std::filesystem::path Path(const std::string &hash) const;
+
+  std::filesystem::path root_;
+  bolo_compress::Scheme scheme_;
+  bolo_compress::Options opts_;
+};
+
+// Entry: a file or directory of a snapshot
+struct Entry {
+  std::string path;  // relative to the parent of the backed up path; directories end with '/'
+  std::filesystem::file_type type = std::filesystem::file_type::none;
+  std::filesystem::perms perms = std::filesystem::perms::none;
+  uint64_t size = 0;
+  int64_t mtime = 0;  // unix time
+  int64_t mtime_nsec = 0;
+  uint64_t inode = 0;
+  std::vector<std::string> chunks;  // of a regular file, in order
+
+  // the file is taken as unchanged when these are, and its chunks are not read again
+  bool Unchanged(const Entry &e) const {
+    return type == e.type && size == e.size && mtime == e.mtime && mtime_nsec == e.mtime_nsec &&
+           inode == e.inode;
+  }
+  bool operator==(const Entry &e) const {
+    return Unchanged(e) && path == e.path && perms == e.perms && chunks == e.chunks;
+  }
+};
+
+/*
+ * Manifest: the entries of one snapshot, sorted by path.
+ *
+ * A manifest can also be a layer on top of another one: its entries are added or replace the
+ * ones of the same path, and the `removed` paths are deleted.
+ */
+struct Manifest {
+  std::vector<Entry> entries;
+  std::vector<std::string> removed;  // of a layer, sorted
+
+  // every chunk the snapshot refers to
+  void Chunks(std::unordered_set<std::string> &out) const;
+  const Entry *Find(const std::string &path) const;
+
+  // the layer that turns `from` into `to`
+  static Manifest Delta(const Manifest &from, const Manifest &to);
+  // put `layer` on top of this one
+  void Apply(const Manifest &layer);
+
+  static bolo::Result<Manifest, std::string> Load(const std::filesystem::path &);
+  // written next to `path` first, and renamed over it once complete
+  bolo::Insidious<std::string> Save(const std::filesystem::path &path) const;
+};
+
+// Snapshot: chunk every file under `path` into `store` on `threads` workers.
+// The files that are unchanged since the `base` snapshot keep their chunks without being read.
+bolo::Result<Manifest, std::string> Snapshot(const std::filesystem::path &path,
+                                             const ChunkStore &store, const Chunker &chunker,
+                                             size_t threads, const Manifest *base = nullptr);
+
+// Patch: the layer on top of `base` for the `changed` paths under `path` only. A changed path
+// is added or replaced when it exists, with everything under it, and removed when it does not;
+// the directories holding the changed paths are refreshed as well.
+bolo::Result<Manifest, std::string> Patch(const std::filesystem::path &path,
+                                          const std::vector<std::filesystem::path> &changed,
+                                          const Manifest &base, const ChunkStore &store,
+                                          const Chunker &chunker, size_t threads);
+
+// Restore: write the entries of `manifest` that `filter` accepts into `dir`
+bolo::Insidious<std::string> Restore(const Manifest &manifest, const ChunkStore &store,
+                                     const std::filesystem::path &dir,
+                                     const std::function<bool(const Entry &)> &filter);
+};  // namespace bolo_store
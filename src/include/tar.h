@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstdint>
+#include <cstdlib>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -10,44 +13,120 @@
 
 namespace bolo_tar {
 
+struct AppendOptions {
+  // directories are listed and small files read ahead by `threads` workers while one writer
+  // emits the records in order, so the archive is the same as with 1 (serial) thread
+  size_t threads = 1;
+  // visit directory entries by name instead of in the order the file system lists them, which
+  // makes the archive depend on the contents only
+  bool sorted = false;
+};
+
 /*
  * Tar:
  *   目前仅支持普通文件和文件夹
+ *   写入 POSIX ustar 格式 (过长的文件名, 大文件等写在 PAX 扩展头里),
+ *   也能读取旧版本 bolo 写的 tar
  */
 class Tar {
  public:
   struct TarFile {
-    std::string filename;
-    int size;
-    std::filesystem::perms perms;
-    std::filesystem::file_type type;
-    // TODO: last modification time
+    std::string filename;  // directories end with '/'
+    uint64_t size = 0;
+    std::filesystem::perms perms = std::filesystem::perms::none;
+    std::filesystem::file_type type = std::filesystem::file_type::none;
+    int64_t mtime = 0;  // unix time
+    uint32_t uid = 0;
+    uint32_t gid = 0;
+    // offsets in the (uncompressed) tar stream: of the first header of the entry, and of its data
+    uint64_t offset = 0;
+    uint64_t data_offset = 0;
+
+    // the offset just past the (padded) data of the entry
+    uint64_t end() const;
   };
 
   static bolo::Result<std::shared_ptr<Tar>, std::string> Open(const std::filesystem::path &);
+  // 直接在流上(例如 bolo::Pipe)写入或读取 tar, 流只会被顺序访问
+  static std::shared_ptr<Tar> Writer(std::ostream &);
+  static std::shared_ptr<Tar> Reader(std::istream &);
 
-  Tar(Tar &&t) : fs_(std::move(t.fs_)) {}
+  Tar(Tar &&t)
+      : file_(std::move(t.file_)),
+        in_(t.in_),
+        out_(t.out_),
+        offset_(t.offset_),
+        index_(std::move(t.index_)),
+        buf_(std::move(t.buf_)) {}
   Tar(const Tar &) = delete;
 
+  // ends the archive and flushes the output
   bolo::Insidious<std::string> Write();
-  bolo::Insidious<std::string> Append(const std::filesystem::path &);
+  bolo::Insidious<std::string> Append(const std::filesystem::path &,
+                                      const AppendOptions &opts = {});
   bolo::Result<std::vector<TarFile>, std::string> List();
 
   // input path should be a directory
   bolo::Insidious<std::string> Extract(const std::filesystem::path &);
+  // extract only the entries `filter` accepts, reading past the others; the parent directories
+  // of an accepted entry are created if they were not
+  bolo::Insidious<std::string> Extract(const std::filesystem::path &,
+                                       const std::function<bool(const TarFile &)> &filter);
+  // extract only `entries` (with offsets as given by List or index), seeking to each of them if
+  // the tar is a file and skipping forward otherwise
+  bolo::Insidious<std::string> Extract(const std::filesystem::path &, std::vector<TarFile> entries);
+
+  // entries written by Append so far
+  const std::vector<TarFile> &index() const { return index_; }
+
+  // Index: a sidecar of a tar holding the offset of every entry, so that a single file can be
+  // restored without reading the archive up to it
+  static bolo::Insidious<std::string> WriteIndex(std::ostream &, const std::vector<TarFile> &);
+  static bolo::Result<std::vector<TarFile>, std::string> ReadIndex(std::istream &);
 
  private:
-  explicit Tar(std::fstream &&fs) : fs_(std::move(fs)) {}
+  Tar(std::unique_ptr<std::fstream> file, std::istream *in, std::ostream *out)
+      : file_(std::move(file)), in_(in), out_(out) {}
+  // Record: a file or directory of the parallel archiver, stat'ed (and read if small) by a worker
+  struct Record;
+
   bolo::Insidious<std::string> AppendImpl(const std::filesystem::path &,
-                                          const std::filesystem::path &);
-  bolo::Insidious<std::string> AppendFile(const std::filesystem::path &,
-                                          const std::filesystem::path &);
+                                          const std::filesystem::path &, bool sorted);
+  bolo::Insidious<std::string> AppendFile(const std::filesystem::path &, const TarFile &);
   bolo::Insidious<std::string> AppendDirectory(const std::filesystem::path &,
-                                               const std::filesystem::path &);
-  bolo::Insidious<std::string> ExtractFile(const std::filesystem::path &, int);
+                                               const std::filesystem::path &, const TarFile &,
+                                               bool sorted);
+  bolo::Insidious<std::string> AppendParallel(const std::filesystem::path &,
+                                              const std::filesystem::path &,
+                                              const AppendOptions &opts);
+  bolo::Insidious<std::string> WriteRecord(const Record &, const std::filesystem::path &);
+  bolo::Insidious<std::string> ExtractEntry(const std::filesystem::path &, const TarFile &);
+  bolo::Insidious<std::string> ExtractFile(const std::filesystem::path &, uint64_t);
+  // read the headers of the entry at `f.offset` into `f`; `end` is set at the end of the tar
+  bolo::Insidious<std::string> ReadHeader(TarFile &f, bool &end);
+  // write to the output, counting the offset
+  void Put(const char *, size_t);
+  // write the headers of `f` and add it to the index
+  bolo::Insidious<std::string> PutHeader(TarFile f);
+  // skip `n` bytes of the input
+  void Skip(std::streamoff n);
+  // the data buffer, allocated on first use
+  char *Buffer();
 
  private:
-  std::fstream fs_;
+  std::unique_ptr<std::fstream> file_;  // only set by Open
+  std::istream *in_;                    // nullptr for Writer
+  std::ostream *out_;                   // nullptr for Reader
+  uint64_t offset_ = 0;                 // of the output
+  std::vector<TarFile> index_;
+
+  // file data moves in large chunks, one read and one write call per kBufferSize bytes
+  static constexpr size_t kBufferSize = 4 << 20;
+  static constexpr size_t kBufferAlignment = 4096;
+  struct Free {
+    void operator()(char *p) const { std::free(p); }
+  };
+  std::unique_ptr<char, Free> buf_;
 };
 
 };  // namespace bolo_tar
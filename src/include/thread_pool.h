@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace bolo {
+
+// ThreadPool: a fixed number of workers sharing one FIFO task queue.
+// The destructor runs the queued tasks to completion before joining the workers.
+class ThreadPool {
+ public:
+  // 0 threads means one per hardware thread
+  explicit ThreadPool(size_t threads = 0) {
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < threads; i++) workers_.emplace_back([this] { Work(); });
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    cv_.notify_all();
+    for (auto &t : workers_) t.join();
+  }
+
+  size_t size() const { return workers_.size(); }
+
+  template <typename F, typename R = std::invoke_result_t<std::decay_t<F>>>
+  std::future<R> Submit(F &&f) {
+    auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+    auto res = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.emplace_back([task] { (*task)(); });
+    }
+    cv_.notify_one();
+    return res;
+  }
+
+ private:
+  void Work() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return stopped_ || !tasks_.empty(); });
+        if (tasks_.empty()) return;
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> tasks_;
+  bool stopped_ = false;
+  std::vector<std::thread> workers_;
+};
+
+// OrderedQueue: a bounded FIFO of pending results.
+// A producer pushes futures in input order and a consumer pops them in the same order, which
+// keeps the output ordered no matter which worker finishes first. Either side may `Close` it.
+template <typename T>
+class OrderedQueue {
+ public:
+  explicit OrderedQueue(size_t capacity) : capacity_{std::max<size_t>(capacity, 1)} {}
+
+  // blocks while the queue is full; returns false once closed
+  bool Push(std::future<T> f) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return closed_ || queue_.size() < capacity_; });
+    if (closed_) return false;
+    queue_.push_back(std::move(f));
+    cv_.notify_all();
+    return true;
+  }
+
+  // blocks while the queue is empty; returns false once closed and drained
+  bool Pop(std::future<T> &f) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return closed_ || !queue_.empty(); });
+    if (queue_.empty()) return false;
+    f = std::move(queue_.front());
+    queue_.pop_front();
+    cv_.notify_all();
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    cv_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::future<T>> queue_;
+  size_t capacity_;
+  bool closed_ = false;
+};
+
+};  // namespace bolo
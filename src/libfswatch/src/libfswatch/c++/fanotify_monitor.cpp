@@ -0,0 +1,636 @@
+/*
+ * Copyright (c) 2014-2015 Enrico M. Crisostomo
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#  include "libfswatch_config.h"
+#endif
+
+#include "gettext_defs.h"
+#include "fanotify_monitor.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+#include <algorithm>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include "inotify_monitor.hpp"
+#include "libfswatch_exception.hpp"
+#include "../c/libfswatch_log.h"
+#include "libfswatch_map.hpp"
+#include "path_utils.hpp"
+
+namespace fsw
+{
+  /*
+   * A marked filesystem.  Any descriptor on it is needed to open the handles
+   * of its events.
+   */
+  struct fanotify_filesystem
+  {
+    int mount_handle = -1;
+    size_t roots = 0;
+  };
+
+  /*
+   * A marked root path.  The paths of the events are resolved by the kernel,
+   * so they are matched against the resolved root path and then reported
+   * below the root path as given.
+   */
+  struct fanotify_root
+  {
+    uint64_t fsid;
+    std::string real_path;
+    bool fallback = false;  // Watched by the inotify monitor.
+  };
+
+  struct fanotify_monitor_impl
+  {
+    int fanotify_handle = -1;
+    int wake_handle = -1;
+    std::vector<char> buffer;
+    std::vector<event> events;
+    fsw_hash_map<uint64_t, fanotify_filesystem> filesystems;
+    fsw_hash_map<std::string, fanotify_root> roots;
+    time_t curr_time;
+    /*
+     * The inotify monitor of the root paths which cannot be marked.  It runs
+     * on its own thread and hands its events over to the monitor loop.
+     */
+    std::unique_ptr<inotify_monitor> fallback;
+    std::thread fallback_thread;
+    std::mutex fallback_mutex;
+    std::vector<event> fallback_events;
+    std::string fallback_error;
+  };
+
+  static const uint64_t FANOTIFY_EVENTS = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM |
+    FAN_MOVED_TO | FAN_MODIFY | FAN_ATTRIB | FAN_CLOSE_WRITE | FAN_DELETE_SELF |
+    FAN_MOVE_SELF | FAN_ONDIR;
+
+  static const unsigned int BUFFER_SIZE = 64 * 1024;
+
+  static uint64_t fsid_key(const int val[2])
+  {
+    return ((uint64_t) (uint32_t) val[0] << 32) | (uint32_t) val[1];
+  }
+
+  /*
+   * Filesystem marks require CAP_SYS_ADMIN, and opening the handles of the
+   * events CAP_DAC_READ_SEARCH: both are tried on the root filesystem, so that
+   * a monitor is not created if it could not work.
+   */
+  static bool fanotify_available(int fanotify_handle)
+  {
+    int root = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root == -1) return false;
+
+    alignas(struct file_handle) char buffer[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+    struct file_handle *handle = reinterpret_cast<struct file_handle *>(buffer);
+    handle->handle_bytes = MAX_HANDLE_SZ;
+    int mount_id;
+    int opened = -1;
+
+    bool available =
+      fanotify_mark(fanotify_handle, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                    FANOTIFY_EVENTS, root, nullptr) == 0 &&
+      fanotify_mark(fanotify_handle, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM,
+                    FANOTIFY_EVENTS, root, nullptr) == 0 &&
+      name_to_handle_at(root, "", handle, &mount_id, AT_EMPTY_PATH) == 0 &&
+      (opened = open_by_handle_at(root, handle, O_PATH | O_CLOEXEC)) != -1;
+
+    int error = errno;
+    if (opened != -1) close(opened);
+    close(root);
+    errno = error;
+
+    return available;
+  }
+
+  fanotify_monitor::fanotify_monitor(std::vector<std::string> paths_to_monitor,
+                                     FSW_EVENT_CALLBACK *callback,
+                                     void *context) :
+    monitor(paths_to_monitor, callback, context),
+    impl(new fanotify_monitor_impl())
+  {
+    /*
+     * The queue stays bounded: a whole filesystem may produce events faster
+     * than they are read, and a full queue is reported as an overflow
+     * (FAN_Q_OVERFLOW), after which the listener rescans.
+     */
+    impl->fanotify_handle = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+                                          FAN_CLOEXEC | FAN_NONBLOCK,
+                                          O_RDONLY | O_LARGEFILE);
+
+    if (impl->fanotify_handle == -1)
+    {
+      std::string msg = std::string(_("Cannot initialize fanotify: ")) + strerror(errno);
+      delete impl;
+      throw libfsw_exception(msg);
+    }
+
+    if (!fanotify_available(impl->fanotify_handle))
+    {
+      std::string msg = std::string(_("Cannot mark filesystems with fanotify: ")) + strerror(errno);
+      close(impl->fanotify_handle);
+      delete impl;
+      throw libfsw_exception(msg);
+    }
+
+    impl->wake_handle = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (impl->wake_handle == -1)
+    {
+      perror("eventfd");
+      close(impl->fanotify_handle);
+      delete impl;
+      throw libfsw_exception(_("Cannot initialize the fanotify event loop."));
+    }
+
+    impl->buffer.resize(BUFFER_SIZE);
+  }
+
+  fanotify_monitor::~fanotify_monitor()
+  {
+    stop_fallback();
+
+    // Closing the fanotify descriptor removes its marks.
+    for (const auto& fs : impl->filesystems)
+    {
+      close(fs.second.mount_handle);
+    }
+
+    close(impl->fanotify_handle);
+    close(impl->wake_handle);
+
+    delete impl;
+  }
+
+  bool fanotify_monitor::supports_path_changes() const
+  {
+    return true;
+  }
+
+  bool fanotify_monitor::mark_root_paths()
+  {
+    bool all_marked = true;
+
+    for (const std::string& path : paths)
+    {
+      if (impl->roots.find(path) != impl->roots.end()) continue;
+
+      // The path may not exist yet.
+      struct statfs fs_stat;
+      char real_path[PATH_MAX];
+
+      if (statfs(path.c_str(), &fs_stat) != 0 || !realpath(path.c_str(), real_path))
+      {
+        all_marked = false;
+        continue;
+      }
+
+      uint64_t fsid = fsid_key(fs_stat.f_fsid.__val);
+      fanotify_filesystem& fs = impl->filesystems[fsid];
+
+      if (fs.mount_handle == -1)
+      {
+        int handle = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (handle == -1)
+        {
+          fsw_log_perror("open");
+          impl->filesystems.erase(fsid);
+          all_marked = false;
+          continue;
+        }
+
+        if (fanotify_mark(impl->fanotify_handle, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                          FANOTIFY_EVENTS, handle, nullptr) != 0)
+        {
+          int error = errno;
+          fsw_log_perror("fanotify_mark");
+          close(handle);
+          impl->filesystems.erase(fsid);
+
+          if (error == EINTR || error == ENOMEM)
+          {
+            all_marked = false;
+            continue;
+          }
+
+          // The filesystem cannot be marked: retrying would not help.
+          watch_with_inotify(path);
+          impl->roots[path] = {0, real_path, true};
+          continue;
+        }
+
+        fs.mount_handle = handle;
+
+        std::ostringstream log;
+        log << _("Marked the filesystem of: ") << path << "\n";
+        FSW_ELOG(log.str().c_str());
+      }
+
+      ++fs.roots;
+      impl->roots[path] = {fsid, real_path};
+    }
+
+    return all_marked;
+  }
+
+  void fanotify_monitor::process_path_changes()
+  {
+    std::vector<std::string> added;
+    std::vector<std::string> removed;
+
+    if (!take_path_changes(added, removed)) return;
+
+    /*
+     * The added paths are marked by mark_root_paths().  A filesystem is
+     * unmarked when no root path is left on it.
+     */
+    for (const std::string& path : removed)
+    {
+      auto root = impl->roots.find(path);
+      if (root == impl->roots.end()) continue;
+
+      uint64_t fsid = root->second.fsid;
+      bool fallback = root->second.fallback;
+      impl->roots.erase(root);
+
+      if (fallback)
+      {
+        impl->fallback->remove_root_path(path);
+        continue;
+      }
+
+      fanotify_filesystem& fs = impl->filesystems[fsid];
+      if (--fs.roots > 0) continue;
+
+      if (fanotify_mark(impl->fanotify_handle, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM,
+                        FANOTIFY_EVENTS, fs.mount_handle, nullptr) != 0)
+      {
+        fsw_log_perror("fanotify_mark");
+      }
+
+      close(fs.mount_handle);
+      impl->filesystems.erase(fsid);
+    }
+  }
+
+  void fanotify_monitor::fallback_callback(const std::vector<event>& events, void *context)
+  {
+    auto *self = static_cast<fanotify_monitor *>(context);
+
+    {
+      std::lock_guard<std::mutex> lock(self->impl->fallback_mutex);
+      self->impl->fallback_events.insert(self->impl->fallback_events.end(),
+                                         events.begin(),
+                                         events.end());
+    }
+
+    self->wake_up();
+  }
+
+  void fanotify_monitor::watch_with_inotify(const std::string& path)
+  {
+    std::ostringstream log;
+    log << _("Watching with inotify: ") << path << "\n";
+    FSW_ELOG(log.str().c_str());
+
+    if (impl->fallback)
+    {
+      impl->fallback->add_root_path(path);
+      return;
+    }
+
+    // The events are filtered when they are delivered by this monitor.
+    impl->fallback.reset(new inotify_monitor({path}, fallback_callback, this));
+    impl->fallback->set_properties(properties);
+    impl->fallback->set_latency(latency);
+    impl->fallback->set_recursive(recursive);
+    impl->fallback->set_follow_symlinks(follow_symlinks);
+    impl->fallback->set_directory_only(directory_only);
+    impl->fallback->set_watch_access(watch_access);
+    // Overflows are reported, or not, by this monitor.
+    impl->fallback->set_allow_overflow(true);
+
+    impl->fallback_thread = std::thread([this]
+    {
+      try
+      {
+        impl->fallback->start();
+      }
+      catch (const libfsw_exception& ex)
+      {
+        std::lock_guard<std::mutex> lock(impl->fallback_mutex);
+        impl->fallback_error = ex.what();
+      }
+
+      wake_up();
+    });
+  }
+
+  void fanotify_monitor::take_fallback_events()
+  {
+    std::vector<event> events;
+    std::string error;
+
+    {
+      std::lock_guard<std::mutex> lock(impl->fallback_mutex);
+      events.swap(impl->fallback_events);
+      error.swap(impl->fallback_error);
+    }
+
+    if (!error.empty()) throw libfsw_exception(error);
+
+    for (event& evt : events)
+    {
+      const std::vector<fsw_event_flag>& flags = evt.get_flags();
+
+      if (std::find(flags.begin(), flags.end(), fsw_event_flag::Overflow) != flags.end())
+        notify_overflow(evt.get_path());
+      else
+        impl->events.push_back(std::move(evt));
+    }
+  }
+
+  void fanotify_monitor::stop_fallback()
+  {
+    if (!impl->fallback) return;
+
+    impl->fallback->stop();
+    impl->fallback_thread.join();
+    impl->fallback.reset();
+
+    // The root paths are looked at again if the monitor is restarted.
+    for (auto root = impl->roots.begin(); root != impl->roots.end();)
+    {
+      if (root->second.fallback)
+        root = impl->roots.erase(root);
+      else
+        ++root;
+    }
+  }
+
+  std::string fanotify_monitor::path_of(const void *info)
+  {
+    auto *fid = static_cast<const struct fanotify_event_info_fid *>(info);
+    auto fs = impl->filesystems.find(fsid_key(fid->fsid.val));
+    if (fs == impl->filesystems.end()) return std::string();
+
+    // open_by_handle_at() does not modify the handle.
+    auto *handle = reinterpret_cast<struct file_handle *>(const_cast<unsigned char *>(fid->handle));
+    int fd = open_by_handle_at(fs->second.mount_handle, handle, O_PATH | O_CLOEXEC);
+
+    // The directory may have been removed in the meantime.
+    if (fd == -1) return std::string();
+
+    char link[PATH_MAX];
+    std::string proc_path = "/proc/self/fd/" + std::to_string(fd);
+    ssize_t len = readlink(proc_path.c_str(), link, sizeof(link));
+    close(fd);
+
+    if (len <= 0 || len == sizeof(link)) return std::string();
+
+    std::string path(link, len);
+    static const std::string deleted = " (deleted)";
+
+    if (path.size() > deleted.size() &&
+        path.compare(path.size() - deleted.size(), deleted.size(), deleted) == 0)
+    {
+      return std::string();
+    }
+
+    return path;
+  }
+
+  bool fanotify_monitor::translate_path(std::string& path) const
+  {
+    for (const auto& root : impl->roots)
+    {
+      if (root.second.fallback) continue;
+
+      const std::string& real_path = root.second.real_path;
+
+      if (!is_path_below(path, real_path)) continue;
+
+      // Without recursion, only the root path and its children are reported.
+      if (!recursive && path.size() > real_path.size() &&
+          path.find('/', real_path.size() + 1) != std::string::npos)
+      {
+        continue;
+      }
+
+      path = root.first + path.substr(real_path.size());
+      return true;
+    }
+
+    return false;
+  }
+
+  void fanotify_monitor::preprocess_event(const void *data)
+  {
+    auto *metadata = static_cast<const struct fanotify_event_metadata *>(data);
+    const char *info = reinterpret_cast<const char *>(metadata) + metadata->metadata_len;
+    const char *end = reinterpret_cast<const char *>(metadata) + metadata->event_len;
+    std::string path;
+
+    // The first record identifies the object: its directory and its name.
+    while (info + sizeof(struct fanotify_event_info_header) <= end)
+    {
+      auto *header = reinterpret_cast<const struct fanotify_event_info_header *>(info);
+      if (header->len == 0) break;
+
+      if (header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME ||
+          header->info_type == FAN_EVENT_INFO_TYPE_DFID ||
+          header->info_type == FAN_EVENT_INFO_TYPE_FID)
+      {
+        auto *fid = reinterpret_cast<const struct fanotify_event_info_fid *>(info);
+        auto *handle = reinterpret_cast<const struct file_handle *>(fid->handle);
+        path = path_of(fid);
+
+        if (header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME && !path.empty())
+        {
+          const char *name = reinterpret_cast<const char *>(handle->f_handle + handle->handle_bytes);
+
+          if (strcmp(name, ".") != 0)
+          {
+            if (path.back() != '/') path += "/";
+            path += name;
+          }
+        }
+
+        break;
+      }
+
+      info += header->len;
+    }
+
+    if (path.empty() || !translate_path(path) || !accept_path(path)) return;
+
+    std::vector<fsw_event_flag> flags;
+    uint64_t mask = metadata->mask;
+
+    if (mask & FAN_ONDIR) flags.push_back(fsw_event_flag::IsDir);
+    if (mask & FAN_ATTRIB) flags.push_back(fsw_event_flag::AttributeModified);
+    if (mask & FAN_CLOSE_WRITE) flags.push_back(fsw_event_flag::Updated);
+    if (mask & FAN_CREATE) flags.push_back(fsw_event_flag::Created);
+    if (mask & FAN_DELETE) flags.push_back(fsw_event_flag::Removed);
+    if (mask & FAN_DELETE_SELF) flags.push_back(fsw_event_flag::Removed);
+    if (mask & FAN_MODIFY) flags.push_back(fsw_event_flag::Updated);
+    if (mask & FAN_MOVED_FROM)
+    {
+      flags.push_back(fsw_event_flag::Removed);
+      flags.push_back(fsw_event_flag::MovedFrom);
+    }
+    if (mask & FAN_MOVED_TO)
+    {
+      flags.push_back(fsw_event_flag::Created);
+      flags.push_back(fsw_event_flag::MovedTo);
+    }
+    if (mask & FAN_MOVE_SELF) flags.push_back(fsw_event_flag::Updated);
+
+    if (flags.size())
+    {
+      impl->events.push_back({path, impl->curr_time, flags});
+    }
+  }
+
+  void fanotify_monitor::read_events()
+  {
+    // The descriptor is drained until it would block.
+    for (;;)
+    {
+      ssize_t len = read(impl->fanotify_handle,
+                         impl->buffer.data(),
+                         impl->buffer.size());
+
+      if (len == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        if (errno == EINTR) continue;
+
+        perror("read()");
+        throw libfsw_exception(_("read() on fanotify descriptor returned -1."));
+      }
+
+      time(&impl->curr_time);
+
+      auto *metadata = reinterpret_cast<struct fanotify_event_metadata *>(impl->buffer.data());
+
+      for (; FAN_EVENT_OK(metadata, len); metadata = FAN_EVENT_NEXT(metadata, len))
+      {
+        if (metadata->vers != FANOTIFY_METADATA_VERSION)
+        {
+          throw libfsw_exception(_("Unsupported fanotify metadata version."));
+        }
+
+        if (metadata->mask & FAN_Q_OVERFLOW)
+        {
+          notify_overflow("");
+          continue;
+        }
+
+        preprocess_event(metadata);
+      }
+    }
+  }
+
+  void fanotify_monitor::wake_up()
+  {
+    uint64_t one = 1;
+
+    // The counter only saturates when the loop is already due to wake up.
+    if (write(impl->wake_handle, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    {
+      fsw_log_perror("write");
+    }
+  }
+
+  void fanotify_monitor::on_stop()
+  {
+    wake_up();
+  }
+
+  void fanotify_monitor::on_paths_changed()
+  {
+    wake_up();
+  }
+
+  void fanotify_monitor::run()
+  {
+    for(;;)
+    {
+#ifdef HAVE_CXX_MUTEX
+      std::unique_lock<std::mutex> run_guard(run_mutex);
+      if (should_stop) break;
+      run_guard.unlock();
+#endif
+
+      process_path_changes();
+
+      /*
+       * Once every root path is marked, nothing is done until an event comes
+       * or the monitor is woken up.  Otherwise, the missing root paths are
+       * looked for again after the latency.
+       */
+      int timeout = mark_root_paths() ? -1 : (int) (latency * 1000);
+
+      struct pollfd fds[2] = {};
+      fds[0].fd = impl->fanotify_handle;
+      fds[0].events = POLLIN;
+      fds[1].fd = impl->wake_handle;
+      fds[1].events = POLLIN;
+
+      if (poll(fds, 2, timeout) == -1)
+      {
+        if (errno != EINTR) fsw_log_perror("poll");
+        continue;
+      }
+
+      if (fds[1].revents & POLLIN)
+      {
+        uint64_t count;
+        if (read(impl->wake_handle, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        {
+          fsw_log_perror("read");
+        }
+      }
+
+      if (fds[0].revents & POLLIN) read_events();
+      take_fallback_events();
+
+      // The events read at once are delivered in a single batch.
+      if (impl->events.size())
+      {
+        notify_events(impl->events);
+        impl->events.clear();
+      }
+    }
+
+    stop_fallback();
+  }
+}
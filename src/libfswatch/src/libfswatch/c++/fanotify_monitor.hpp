@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2014-2015 Enrico M. Crisostomo
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file
+ * @brief Linux `fanotify` monitor.
+ *
+ * @copyright Copyright (c) 2014-2016 Enrico M. Crisostomo
+ * @license GNU General Public License v. 3.0
+ * @author Enrico M. Crisostomo
+ * @version 1.8.0
+ */
+
+#ifndef FSW_FANOTIFY_MONITOR_H
+#  define FSW_FANOTIFY_MONITOR_H
+
+#  include "monitor.hpp"
+#  include <string>
+#  include <vector>
+
+namespace fsw
+{
+  /**
+   * @brief Opaque structure containing implementation specific details of the
+   * `fanotify` monitor.
+   */
+  struct fanotify_monitor_impl;
+
+  /**
+   * @brief Linux `fanotify` monitor.
+   *
+   * This monitor marks the whole filesystems the paths are on
+   * (`FAN_MARK_FILESYSTEM`), and receives the directory and the name of each
+   * changed object (`FAN_REPORT_DFID_NAME`).  Hence, it needs no watch per
+   * directory and does not scan the paths when it starts.  The events are
+   * filtered by path, and the filesystems mounted below a path are not
+   * watched.
+   *
+   * Some filesystems cannot be marked, or do not report file handles (NFS,
+   * FUSE, overlayfs, btrfs subvolumes...): the paths on them are watched by an
+   * `inotify` monitor running alongside, whose events are delivered with the
+   * others.
+   *
+   * The monitor requires the `CAP_SYS_ADMIN` and `CAP_DAC_READ_SEARCH`
+   * capabilities and Linux 5.9 or later: otherwise, it cannot be constructed
+   * and monitor_factory creates an `inotify` monitor instead.
+   */
+  class fanotify_monitor : public monitor
+  {
+  public:
+    /**
+     * @brief Constructs an instance of this class.
+     *
+     * @throws libfsw_exception if `fanotify` is not available.
+     */
+    fanotify_monitor(std::vector<std::string> paths,
+                     FSW_EVENT_CALLBACK *callback,
+                     void *context = nullptr);
+
+    /**
+     * @brief Destroys an instance of this class.
+     */
+    virtual ~fanotify_monitor();
+
+    /**
+     * @brief Paths can be added and removed while the monitor is running.
+     *
+     * Filesystems are marked and unmarked as the paths on them come and go.
+     */
+    bool supports_path_changes() const override;
+
+  protected:
+    /**
+     * @brief Executes the monitor loop.
+     *
+     * This call does not return until the monitor is stopped.
+     *
+     * @see stop()
+     */
+    void run();
+
+    /**
+     * @brief Wakes up the monitor loop, which then checks whether it should
+     * stop.
+     */
+    void on_stop() override;
+
+    /**
+     * @brief Wakes up the monitor loop, which then applies the path changes.
+     */
+    void on_paths_changed() override;
+
+  private:
+    fanotify_monitor(const fanotify_monitor& orig) = delete;
+    fanotify_monitor& operator=(const fanotify_monitor& that) = delete;
+
+    static void fallback_callback(const std::vector<event>& events, void *context);
+
+    bool mark_root_paths();
+    void watch_with_inotify(const std::string& path);
+    void take_fallback_events();
+    void stop_fallback();
+    void process_path_changes();
+    void read_events();
+    void preprocess_event(const void *metadata);
+    std::string path_of(const void *fid);
+    bool translate_path(std::string& path) const;
+    void wake_up();
+
+    fanotify_monitor_impl *impl;
+  };
+}
+
+#endif  /* FSW_FANOTIFY_MONITOR_H */
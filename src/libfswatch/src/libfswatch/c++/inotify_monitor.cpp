@@ -26,11 +26,18 @@
 #endif
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
 #include <sstream>
+#include <deque>
+#include <string_view>
 #include <ctime>
-#include <cmath>
-#include <sys/select.h>
+#include <chrono>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "libfswatch_exception.hpp"
+#include "libfswatch_flat_map.hpp"
 #include "../c/libfswatch_log.h"
 #include "libfswatch_map.hpp"
 #include "libfswatch_set.hpp"
@@ -39,18 +46,95 @@
 namespace fsw
 {
 
+  /*
+   * A watch is stored as its name and the watch of its parent directory,
+   * rather than as a full path: the path of an event is built walking up to a
+   * root path, whose name is the path itself.  The children of a directory are
+   * linked, so that a subtree can be dropped when it is removed or moved.
+   */
+  struct inotify_watch
+  {
+    int parent = -1;
+    int first_child = -1;
+    int prev_sibling = -1;
+    int next_sibling = -1;
+    uint32_t name = 0;
+  };
+
+  /*
+   * Names are interned: a name found under many directories (src, include,
+   * .git, ...) is stored once.  Identifiers are reference counted and reused.
+   */
+  class inotify_name_pool
+  {
+  public:
+    uint32_t intern(const std::string& name)
+    {
+      if (uint32_t *id = ids.find(name))
+      {
+        ++entries[*id].refs;
+        return *id;
+      }
+
+      uint32_t id;
+      if (free_ids.empty())
+      {
+        id = entries.size();
+        entries.emplace_back();
+      }
+      else
+      {
+        id = free_ids.back();
+        free_ids.pop_back();
+      }
+
+      // The keys of the table point into the entries, which never move.
+      entries[id].name = name;
+      entries[id].refs = 1;
+      ids[entries[id].name] = id;
+
+      return id;
+    }
+
+    void release(uint32_t id)
+    {
+      if (--entries[id].refs > 0) return;
+
+      ids.erase(entries[id].name);
+      std::string().swap(entries[id].name);
+      free_ids.push_back(id);
+    }
+
+    const std::string& get(uint32_t id) const
+    {
+      return entries[id].name;
+    }
+
+  private:
+    struct entry
+    {
+      std::string name;
+      uint32_t refs = 0;
+    };
+
+    std::deque<entry> entries;
+    std::vector<uint32_t> free_ids;
+    fsw_flat_map<std::string_view, uint32_t> ids;
+  };
+
+  /*
+   * A directory waiting to be scanned, below the watch of its parent.
+   */
+  struct inotify_scan_item
+  {
+    int parent;
+    std::string path;
+  };
+
   struct inotify_monitor_impl
   {
     int inotify_monitor_handle = -1;
     std::vector<event> events;
-    /*
-     * A map of file names by descriptor is kept in sync because the name field
-     * of the inotify_event structure is present only when it identifies a
-     * child of a watched directory.  In all the other cases, we store the path
-     * for easy retrieval.
-     */
-    fsw_hash_set<int> watched_descriptors;
-    fsw_hash_map<std::string, int> path_to_wd;
     /*
      * Since the inotify API maintains only works with watch
      * descriptors a cache maintaining a relationship between a watch
@@ -62,14 +146,42 @@ namespace fsw
      *   between watch descriptors and pathnames.  Be aware that directory
      *   renamings may affect multiple cached pathnames.
      */
-    fsw_hash_map<int, std::string> wd_to_path;
+    fsw_flat_map<int, inotify_watch> watches;
+    inotify_name_pool names;
+    // The watch of each root path which is being watched.
+    fsw_hash_map<std::string, int> root_watches;
     fsw_hash_set<int> descriptors_to_remove;
     fsw_hash_set<int> watches_to_remove;
-    std::vector<std::string> paths_to_rescan;
+    /*
+     * A directory moved within the watched tree keeps its watches: the watch
+     * is found by the IN_MOVED_FROM event and renamed in place by the
+     * IN_MOVED_TO event with the same cookie.  Its IN_MOVE_SELF event is then
+     * ignored.
+     */
+    fsw_hash_map<uint32_t, int> moves;
+    fsw_hash_set<int> moved_watches;
+    /*
+     * Directories are scanned a step at a time between the reads of the
+     * events, so that scanning a large tree does not hold back their delivery.
+     */
+    std::vector<inotify_scan_item> scan_queue;
     time_t curr_time;
+    /*
+     * The monitor loop waits on epoll for the inotify descriptor and for an
+     * eventfd written by stop() and by path changes, so that it never sleeps
+     * while there is something to do.
+     */
+    int epoll_handle = -1;
+    int wake_handle = -1;
+    std::vector<char> buffer;
+    std::chrono::steady_clock::time_point batch_start;
+    std::chrono::milliseconds batch_ms{10};
+    size_t batch_events = 1024;
   };
 
-  static const unsigned int BUFFER_SIZE = (10 * ((sizeof(struct inotify_event)) + NAME_MAX + 1));
+  static const unsigned int BUFFER_SIZE = (256 * ((sizeof(struct inotify_event)) + NAME_MAX + 1));
+  // Number of directories scanned between two reads of the events.
+  static const size_t SCAN_STEP = 512;
 
   inotify_monitor::inotify_monitor(std::vector<std::string> paths_to_monitor,
                                    FSW_EVENT_CALLBACK *callback,
@@ -77,29 +189,53 @@ namespace fsw
     monitor(paths_to_monitor, callback, context),
     impl(new inotify_monitor_impl())
   {
-    impl->inotify_monitor_handle = inotify_init();
+    impl->inotify_monitor_handle = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 
     if (impl->inotify_monitor_handle == -1)
     {
       perror("inotify_init");
+      delete impl;
       throw libfsw_exception(_("Cannot initialize inotify."));
     }
+
+    impl->wake_handle = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    impl->epoll_handle = epoll_create1(EPOLL_CLOEXEC);
+
+    for (int fd : {impl->inotify_monitor_handle, impl->wake_handle})
+    {
+      struct epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+
+      if (impl->wake_handle == -1 || impl->epoll_handle == -1 ||
+          epoll_ctl(impl->epoll_handle, EPOLL_CTL_ADD, fd, &ev) == -1)
+      {
+        perror("epoll");
+        if (impl->wake_handle != -1) close(impl->wake_handle);
+        if (impl->epoll_handle != -1) close(impl->epoll_handle);
+        close(impl->inotify_monitor_handle);
+        delete impl;
+        throw libfsw_exception(_("Cannot initialize the inotify event loop."));
+      }
+    }
+
+    impl->buffer.resize(BUFFER_SIZE);
   }
 
   inotify_monitor::~inotify_monitor()
   {
     // close inotify watchers
-    for (auto inotify_desc_pair : impl->watched_descriptors)
+    impl->watches.for_each([this](int wd, const inotify_watch&)
     {
       std::ostringstream log;
-      log << _("Removing: ") << inotify_desc_pair << "\n";
+      log << _("Removing: ") << wd << "\n";
       FSW_ELOG(log.str().c_str());
 
-      if (inotify_rm_watch(impl->inotify_monitor_handle, inotify_desc_pair))
+      if (inotify_rm_watch(impl->inotify_monitor_handle, wd))
       {
         perror("inotify_rm_watch");
       }
-    }
+    });
 
     // close inotify
     if (impl->inotify_monitor_handle > 0)
@@ -107,11 +243,96 @@ namespace fsw
       close(impl->inotify_monitor_handle);
     }
 
+    close(impl->wake_handle);
+    close(impl->epoll_handle);
+
     delete impl;
   }
 
-  bool inotify_monitor::add_watch(const std::string& path,
-                                  const struct stat& fd_stat)
+  void inotify_monitor::link_watch(int wd)
+  {
+    inotify_watch *w = impl->watches.find(wd);
+    if (w->parent == -1) return;
+
+    inotify_watch *parent = impl->watches.find(w->parent);
+    w->prev_sibling = -1;
+    w->next_sibling = parent->first_child;
+    if (parent->first_child != -1)
+      impl->watches.find(parent->first_child)->prev_sibling = wd;
+    parent->first_child = wd;
+  }
+
+  void inotify_monitor::unlink_watch(int wd)
+  {
+    inotify_watch *w = impl->watches.find(wd);
+
+    if (w->prev_sibling != -1)
+    {
+      impl->watches.find(w->prev_sibling)->next_sibling = w->next_sibling;
+    }
+    else if (w->parent != -1)
+    {
+      inotify_watch *parent = impl->watches.find(w->parent);
+      if (parent && parent->first_child == wd) parent->first_child = w->next_sibling;
+    }
+
+    if (w->next_sibling != -1)
+      impl->watches.find(w->next_sibling)->prev_sibling = w->prev_sibling;
+
+    w->prev_sibling = w->next_sibling = -1;
+  }
+
+  int inotify_monitor::find_child_watch(int parent, const std::string& name) const
+  {
+    const inotify_watch *w = impl->watches.find(parent);
+    if (w == nullptr) return -1;
+
+    for (int child = w->first_child; child != -1;
+         child = impl->watches.find(child)->next_sibling)
+    {
+      if (impl->names.get(impl->watches.find(child)->name) == name) return child;
+    }
+
+    return -1;
+  }
+
+  void inotify_monitor::move_watch(int wd, int parent, const std::string& name)
+  {
+    unlink_watch(wd);
+
+    inotify_watch *w = impl->watches.find(wd);
+    impl->names.release(w->name);
+    w->name = impl->names.intern(name);
+    w->parent = parent;
+
+    link_watch(wd);
+  }
+
+  std::string inotify_monitor::path_of(int wd) const
+  {
+    std::vector<uint32_t> names;
+
+    for (const inotify_watch *w = impl->watches.find(wd); w != nullptr;
+         w = (w->parent == -1) ? nullptr : impl->watches.find(w->parent))
+    {
+      names.push_back(w->name);
+
+      // A subtree which is being removed has no path any more.
+      if (w->parent != -1 && !impl->watches.find(w->parent)) return std::string();
+    }
+
+    std::string path;
+
+    for (auto name = names.rbegin(); name != names.rend(); ++name)
+    {
+      if (name != names.rbegin()) path += "/";
+      path += impl->names.get(*name);
+    }
+
+    return path;
+  }
+
+  int inotify_monitor::add_watch(const std::string& path, int parent)
   {
     // TODO: Consider optionally adding the IN_EXCL_UNLINK flag.
     int inotify_desc = inotify_add_watch(impl->inotify_monitor_handle,
@@ -121,33 +342,90 @@ namespace fsw
     if (inotify_desc == -1)
     {
       perror("inotify_add_watch");
+      return -1;
     }
-    else
+
+    /*
+     * inotify returns the existing watch of an inode which is already watched,
+     * such as a root path below another one: it is kept where it is.
+     */
+    if (impl->watches.find(inotify_desc)) return inotify_desc;
+
+    // Root paths and the targets of symbolic links are named by their path.
+    std::string name = (parent == -1) ? path : path.substr(path.rfind('/') + 1);
+
+    inotify_watch& w = impl->watches[inotify_desc];
+    w.parent = parent;
+    w.name = impl->names.intern(name);
+    link_watch(inotify_desc);
+
+    std::ostringstream log;
+    log << _("Added: ") << path << "\n";
+    FSW_ELOG(log.str().c_str());
+
+    return inotify_desc;
+  }
+
+  void inotify_monitor::forget_watch(int wd)
+  {
+    if (!impl->watches.find(wd)) return;
+
+    unlink_watch(wd);
+
+    std::vector<int> subtree = {wd};
+    size_t removed = 0;
+
+    while (!subtree.empty())
     {
-      impl->watched_descriptors.insert(inotify_desc);
-      impl->wd_to_path[inotify_desc] = path;
-      impl->path_to_wd[path] = inotify_desc;
+      /*
+       * Every removed watch queues an IN_IGNORED event: the queue is drained
+       * on the way, or removing a large tree would overflow it.
+       */
+      if (++removed % SCAN_STEP == 0) read_events();
 
-      std::ostringstream log;
-      log << _("Added: ") << path << "\n";
-      FSW_ELOG(log.str().c_str());
+      int curr = subtree.back();
+      subtree.pop_back();
+
+      inotify_watch *w = impl->watches.find(curr);
+
+      for (int child = w->first_child; child != -1;
+           child = impl->watches.find(child)->next_sibling)
+      {
+        subtree.push_back(child);
+      }
+
+      // The watches below are still active, unless they have been deleted.
+      if (curr != wd) inotify_rm_watch(impl->inotify_monitor_handle, curr);
+
+      impl->names.release(w->name);
+      impl->watches.erase(curr);
+      impl->moved_watches.erase(curr);
     }
 
-    return (inotify_desc != -1);
+    // Root paths whose watch is gone are scanned again.
+    for (auto root = impl->root_watches.begin(); root != impl->root_watches.end();)
+    {
+      if (impl->watches.find(root->second))
+        ++root;
+      else
+        root = impl->root_watches.erase(root);
+    }
   }
 
-  void inotify_monitor::scan(const std::string& path, const bool accept_non_dirs)
+  int inotify_monitor::scan(const std::string& path,
+                            int parent,
+                            const bool accept_non_dirs)
   {
     struct stat fd_stat;
-    if (!lstat_path(path, fd_stat)) return;
+    if (!lstat_path(path, fd_stat)) return -1;
 
     if (follow_symlinks && S_ISLNK(fd_stat.st_mode))
     {
       std::string link_path;
       if (read_link_path(path, link_path))
-        scan(link_path, accept_non_dirs);
+        return scan(link_path, -1, accept_non_dirs);
 
-      return;
+      return -1;
     }
 
     bool is_dir = S_ISDIR(fd_stat.st_mode);
@@ -161,11 +439,12 @@ namespace fsw
      * For the same reason, the directory_only flag is ignored and treated as if
      * it were always set to true.
      */
-    if (!is_dir && !accept_non_dirs) return;
-    if (!is_dir && directory_only) return;
-    if (!accept_path(path)) return;
-    if (!add_watch(path, fd_stat)) return;
-    if (!recursive || !is_dir) return;
+    if (!is_dir && !accept_non_dirs) return -1;
+    if (!is_dir && directory_only) return -1;
+    if (!accept_path(path)) return -1;
+
+    int inotify_desc = add_watch(path, parent);
+    if (inotify_desc == -1 || !recursive || !is_dir) return inotify_desc;
 
     std::vector<std::string> children = get_directory_children(path);
 
@@ -174,26 +453,47 @@ namespace fsw
       if (child == "." || child == "..") continue;
 
       /*
-       * Scan children but only watch directories.
+       * Scan children but only watch directories.  They are scanned later by
+       * scan_step().
        */
-      scan(path + "/" + child, false);
+      impl->scan_queue.push_back({inotify_desc, path + "/" + child});
+    }
+
+    return inotify_desc;
+  }
+
+  void inotify_monitor::scan_step()
+  {
+    for (size_t i = 0; i < SCAN_STEP && !impl->scan_queue.empty(); ++i)
+    {
+      inotify_scan_item item = std::move(impl->scan_queue.back());
+      impl->scan_queue.pop_back();
+
+      // The parent may have been removed in the meantime.
+      if (!impl->watches.find(item.parent)) continue;
+
+      scan(item.path, item.parent, false);
     }
   }
 
   bool inotify_monitor::is_watched(const std::string& path) const
   {
-    return (impl->path_to_wd.find(path) != impl->path_to_wd.end());
+    return (impl->root_watches.find(path) != impl->root_watches.end());
   }
 
   void inotify_monitor::scan_root_paths()
   {
     for (std::string& path : paths)
     {
-      if (!is_watched(path)) scan(path);
+      if (is_watched(path)) continue;
+
+      int inotify_desc = scan(path, -1);
+      if (inotify_desc != -1) impl->root_watches[path] = inotify_desc;
     }
   }
 
-  void inotify_monitor::preprocess_dir_event(struct inotify_event *event)
+  void inotify_monitor::preprocess_dir_event(struct inotify_event *event,
+                                             const std::string& path)
   {
     std::vector<fsw_event_flag> flags;
 
@@ -203,17 +503,44 @@ namespace fsw
 
     if (flags.size())
     {
-      impl->events.push_back({impl->wd_to_path[event->wd], impl->curr_time, flags});
+      impl->events.push_back({path, impl->curr_time, flags});
+    }
+
+    if (!(event->mask & IN_ISDIR) || event->len <= 1) return;
+
+    // If a new directory has been created, it should be scanned.
+    if (event->mask & IN_CREATE)
+    {
+      impl->scan_queue.push_back({event->wd, path + "/" + event->name});
+    }
+
+    if (event->mask & IN_MOVED_FROM)
+    {
+      int child = find_child_watch(event->wd, event->name);
+      if (child != -1) impl->moves[event->cookie] = child;
     }
 
-    // If a new directory has been created, it should be rescanned if the
-    if ((event->mask & IN_ISDIR) && (event->mask & IN_CREATE))
+    if (event->mask & IN_MOVED_TO)
     {
-      impl->paths_to_rescan.push_back(impl->wd_to_path[event->wd]);
+      auto move = impl->moves.find(event->cookie);
+
+      // A directory moved in from outside the watched tree is scanned.
+      if (move == impl->moves.end() || !impl->watches.find(move->second))
+      {
+        impl->scan_queue.push_back({event->wd, path + "/" + event->name});
+      }
+      else
+      {
+        move_watch(move->second, event->wd, event->name);
+        impl->moved_watches.insert(move->second);
+      }
+
+      if (move != impl->moves.end()) impl->moves.erase(move);
     }
   }
 
-  void inotify_monitor::preprocess_node_event(struct inotify_event *event)
+  void inotify_monitor::preprocess_node_event(struct inotify_event *event,
+                                              const std::string& path)
   {
     std::vector<fsw_event_flag> flags;
 
@@ -238,7 +565,7 @@ namespace fsw
 
     // Build the file name.
     std::ostringstream filename_stream;
-    filename_stream << impl->wd_to_path[event->wd];
+    filename_stream << path;
 
     if (event->len > 1)
     {
@@ -288,6 +615,18 @@ namespace fsw
       log << "IN_MOVE_SELF: " << event->wd << "::" << filename_stream.str() << "\n";
       FSW_ELOG(log.str().c_str());
 
+      // Already renamed in place.
+      if (impl->moved_watches.erase(event->wd)) return;
+
+      // Moved out of the watched tree.
+      for (auto move = impl->moves.begin(); move != impl->moves.end();)
+      {
+        if (move->second == event->wd)
+          move = impl->moves.erase(move);
+        else
+          ++move;
+      }
+
       impl->watches_to_remove.insert(event->wd);
       impl->descriptors_to_remove.insert(event->wd);
     }
@@ -315,127 +654,185 @@ namespace fsw
   {
     if (event->mask & IN_Q_OVERFLOW)
     {
-      notify_overflow(impl->wd_to_path[event->wd]);
+      notify_overflow(path_of(event->wd));
     }
 
-    preprocess_dir_event(event);
-    preprocess_node_event(event);
+    // Events may still be queued for the watches of a removed path.
+    if (!impl->watches.find(event->wd)) return;
+
+    std::string path = path_of(event->wd);
+    if (path.empty()) return;
+
+    preprocess_dir_event(event, path);
+    preprocess_node_event(event, path);
   }
 
-  void inotify_monitor::remove_watch(int wd)
+  bool inotify_monitor::supports_path_changes() const
   {
+    return true;
+  }
+
+  void inotify_monitor::process_path_changes()
+  {
+    std::vector<std::string> added;
+    std::vector<std::string> removed;
+
+    if (!take_path_changes(added, removed)) return;
+
     /*
-     * No need to remove the inotify watch because it is removed automatically
-     * when a watched element is deleted.
+     * The added paths are watched by scan_root_paths().  The watches of a
+     * removed path go, unless it is still below another watched path; the
+     * watched paths below it keep their watches as roots of their own.
      */
-    impl->wd_to_path.erase(wd);
+    for (const std::string& path : removed)
+    {
+      auto root = impl->root_watches.find(path);
+      if (root == impl->root_watches.end()) continue;
+
+      int inotify_desc = root->second;
+      impl->root_watches.erase(root);
+
+      if (is_path_below_any(path, paths)) continue;
+
+      // The same directory may be watched under another root path.
+      bool shared = std::any_of(impl->root_watches.begin(),
+                                impl->root_watches.end(),
+                                [inotify_desc] (const std::pair<const std::string, int>& other)
+                                {
+                                  return other.second == inotify_desc;
+                                });
+      if (shared) continue;
+
+      for (const auto& other : impl->root_watches)
+      {
+        if (!is_path_below(other.first, path)) continue;
+
+        inotify_watch *w = impl->watches.find(other.second);
+        if (w->parent == -1) continue;
+
+        unlink_watch(other.second);
+        impl->names.release(w->name);
+        w->name = impl->names.intern(other.first);
+        w->parent = -1;
+      }
+
+      if (inotify_rm_watch(impl->inotify_monitor_handle, inotify_desc) != 0)
+      {
+        fsw_log_perror("inotify_rm_watch");
+      }
+
+      forget_watch(inotify_desc);
+    }
   }
 
   void inotify_monitor::process_pending_events()
   {
-    // Remove watches.
-    auto wtd = impl->watches_to_remove.begin();
+    /*
+     * forget_watch() reads the events while it removes a large tree, which may
+     * add to the sets: they are taken before being iterated, and what is added
+     * in the meantime is processed next time.
+     */
+    fsw_hash_set<int> watches_to_remove;
+    fsw_hash_set<int> descriptors_to_remove;
+    watches_to_remove.swap(impl->watches_to_remove);
+    descriptors_to_remove.swap(impl->descriptors_to_remove);
 
-    while (wtd != impl->watches_to_remove.end())
+    // Remove watches.
+    for (int wd : watches_to_remove)
     {
-      if (inotify_rm_watch(impl->inotify_monitor_handle, *wtd) != 0)
+      if (inotify_rm_watch(impl->inotify_monitor_handle, wd) != 0)
       {
         perror("inotify_rm_watch");
       }
       else
       {
         std::ostringstream log;
-        log << _("Removed: ") << *wtd << "\n";
+        log << _("Removed: ") << wd << "\n";
         FSW_ELOG(log.str().c_str());
       }
+    }
 
-      impl->watches_to_remove.erase(wtd++);
+    // Clean up descriptors, and the watches below them.
+    for (int wd : descriptors_to_remove)
+    {
+      forget_watch(wd);
     }
+  }
 
-    // Clean up descriptors.
-    auto fd = impl->descriptors_to_remove.begin();
+  void inotify_monitor::wake_up()
+  {
+    uint64_t one = 1;
 
-    while (fd != impl->descriptors_to_remove.end())
+    // The counter only saturates when the loop is already due to wake up.
+    if (write(impl->wake_handle, &one, sizeof(one)) == -1 && errno != EAGAIN)
     {
-      const std::string& curr_path = impl->wd_to_path[*fd];
-      impl->path_to_wd.erase(curr_path);
-      impl->wd_to_path.erase(*fd);
-      impl->watched_descriptors.erase(*fd);
-
-      impl->descriptors_to_remove.erase(fd++);
+      fsw_log_perror("write");
     }
+  }
 
-    // Process paths to be rescanned
-    std::for_each(impl->paths_to_rescan.begin(),
-		  impl->paths_to_rescan.end(),
-		  [this] (const std::string& p)
-		  {
-		    this->scan(p);
-		  }
-		  );
+  void inotify_monitor::on_stop()
+  {
+    wake_up();
+  }
 
-    impl->paths_to_rescan.clear();
+  void inotify_monitor::on_paths_changed()
+  {
+    wake_up();
   }
 
-  void inotify_monitor::run()
+  static long parse_property(const std::string& value, long min_value)
   {
-    char buffer[BUFFER_SIZE];
-    double sec;
-    double frac = modf(this->latency, &sec);
+    char *end = nullptr;
+    long parsed_value = strtol(value.c_str(), &end, 0);
 
-    for(;;)
+    if (*end != '\0' || parsed_value < min_value)
     {
-#ifdef HAVE_CXX_MUTEX
-      std::unique_lock<std::mutex> run_guard(run_mutex);
-      if (should_stop) break;
-      run_guard.unlock();
-#endif
-
-      process_pending_events();
-
-      scan_root_paths();
+      std::string msg = std::string(_("Invalid value: ")) + value;
+      throw libfsw_exception(msg.c_str());
+    }
 
-      // If no files can be watched, sleep and repeat the loop.
-      if (!impl->watched_descriptors.size())
-      {
-        sleep(latency);
-        continue;
-      }
+    return parsed_value;
+  }
 
-      // Use select to timeout on file descriptor read the amount specified by
-      // the monitor latency.  This way, the monitor has a chance to update its
-      // watches with at least the periodicity expected by the user.
-      fd_set set;
-      struct timeval timeout;
+  void inotify_monitor::configure_batching()
+  {
+    std::string batch_ms = get_property(INOTIFY_BATCH_MS);
+    std::string batch_events = get_property(INOTIFY_BATCH_EVENTS);
 
-      FD_ZERO(&set);
-      FD_SET(impl->inotify_monitor_handle, &set);
-      timeout.tv_sec = sec;
-      timeout.tv_usec = 1000 * 1000 * frac;
+    if (!batch_ms.empty())
+      impl->batch_ms = std::chrono::milliseconds(parse_property(batch_ms, 0));
 
-      int rv = select(impl->inotify_monitor_handle + 1,
-                      &set,
-                      nullptr,
-                      nullptr,
-                      &timeout);
+    if (!batch_events.empty())
+      impl->batch_events = parse_property(batch_events, 1);
+  }
 
-      if (rv == -1)
-      {
-	fsw_log_perror("select");
-	continue;
-      }
+  void inotify_monitor::notify_batch()
+  {
+    if (impl->events.empty()) return;
 
-      // In case of read timeout just repeat the loop.
-      if (rv == 0) continue;
+    notify_events(impl->events);
+    impl->events.clear();
+  }
 
+  void inotify_monitor::read_events()
+  {
+    /*
+     * The descriptor is drained until it would block, so that the kernel queue
+     * does not fill up during bursts.  Full batches are delivered on the way.
+     */
+    for (;;)
+    {
       ssize_t record_num = read(impl->inotify_monitor_handle,
-                                buffer,
-                                BUFFER_SIZE);
+                                impl->buffer.data(),
+                                impl->buffer.size());
 
+      if (record_num == -1)
       {
-        std::ostringstream log;
-        log << _("Number of records: ") << record_num << "\n";
-        FSW_ELOG(log.str().c_str());
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        if (errno == EINTR) continue;
+
+        perror("read()");
+        throw libfsw_exception(_("read() on inotify descriptor returned -1."));
       }
 
       if (!record_num)
@@ -443,15 +840,16 @@ namespace fsw
         throw libfsw_exception(_("read() on inotify descriptor read 0 records."));
       }
 
-      if (record_num == -1)
       {
-        perror("read()");
-        throw libfsw_exception(_("read() on inotify descriptor returned -1."));
+        std::ostringstream log;
+        log << _("Number of records: ") << record_num << "\n";
+        FSW_ELOG(log.str().c_str());
       }
 
+      bool batch_empty = impl->events.empty();
       time(&impl->curr_time);
 
-      for (char *p = buffer; p < buffer + record_num;)
+      for (char *p = impl->buffer.data(); p < impl->buffer.data() + record_num;)
       {
         struct inotify_event *event = reinterpret_cast<struct inotify_event *> (p);
 
@@ -460,13 +858,95 @@ namespace fsw
         p += (sizeof(struct inotify_event)) + event->len;
       }
 
-      if (impl->events.size())
+      if (batch_empty && !impl->events.empty())
+      {
+        impl->batch_start = std::chrono::steady_clock::now();
+      }
+
+      if (impl->events.size() >= impl->batch_events) notify_batch();
+    }
+  }
+
+  void inotify_monitor::run()
+  {
+    using std::chrono::milliseconds;
+    using std::chrono::steady_clock;
+
+    configure_batching();
+
+    for(;;)
+    {
+#ifdef HAVE_CXX_MUTEX
+      std::unique_lock<std::mutex> run_guard(run_mutex);
+      if (should_stop) break;
+      run_guard.unlock();
+#endif
+
+      process_pending_events();
+      process_path_changes();
+
+      scan_root_paths();
+      scan_step();
+
+      // Deliver the batch when it is full or old enough.
+      auto now = steady_clock::now();
+
+      if (impl->events.size() >= impl->batch_events ||
+          (!impl->events.empty() && now >= impl->batch_start + impl->batch_ms))
+      {
+        notify_batch();
+      }
+
+      /*
+       * Wait for the end of the current batch, and do not wait while scanning or
+       * removing watches.
+       * Otherwise, wait for the latency at most: root paths which do not exist
+       * yet are looked for again at every iteration.
+       */
+      long long timeout = (long long) (latency * 1000);
+
+      if (!impl->scan_queue.empty() ||
+          !impl->watches_to_remove.empty() ||
+          !impl->descriptors_to_remove.empty())
+      {
+        timeout = 0;
+      }
+      else if (!impl->events.empty())
+      {
+        auto due = impl->batch_start + impl->batch_ms;
+        timeout = std::chrono::duration_cast<milliseconds>(due - now).count();
+        if (timeout < 0) timeout = 0;
+        // Round up, or the batch would be waited for in a busy loop.
+        if (due > now + milliseconds(timeout)) ++timeout;
+      }
+
+      struct epoll_event ready[2];
+      int rv = epoll_wait(impl->epoll_handle, ready, 2, (int) timeout);
+
+      if (rv == -1)
       {
-        notify_events(impl->events);
-        impl->events.clear();
+        if (errno != EINTR) fsw_log_perror("epoll_wait");
+        continue;
       }
 
-      sleep(latency);
+      for (int i = 0; i < rv; ++i)
+      {
+        if (ready[i].data.fd == impl->wake_handle)
+        {
+          uint64_t count;
+          if (read(impl->wake_handle, &count, sizeof(count)) == -1 && errno != EAGAIN)
+          {
+            fsw_log_perror("read");
+          }
+        }
+        else
+        {
+          read_events();
+        }
+      }
     }
+
+    // Events already read are not lost.
+    notify_batch();
   }
 }
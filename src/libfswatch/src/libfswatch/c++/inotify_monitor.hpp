@@ -49,6 +49,24 @@ namespace fsw
   class inotify_monitor : public monitor
   {
   public:
+    /**
+     * @brief Maximum time in milliseconds events are held to be delivered in a
+     * single batch, counted from the first event of the batch.  The default
+     * value is 10.
+     *
+     * The monitor wakes up as soon as events are available, so this property,
+     * and not the latency, bounds the time between a change and its
+     * notification.  The latency only sets how often the root paths which do
+     * not exist are looked for.
+     */
+    static constexpr const char *INOTIFY_BATCH_MS = "inotify.batch.ms";
+
+    /**
+     * @brief Maximum number of events delivered in a single batch.  The
+     * default value is 1024.
+     */
+    static constexpr const char *INOTIFY_BATCH_EVENTS = "inotify.batch.events";
+
     /**
      * @brief Constructs an instance of this class.
      */
@@ -61,6 +79,13 @@ namespace fsw
      */
     virtual ~inotify_monitor();
 
+    /**
+     * @brief Paths can be added and removed while the monitor is running.
+     *
+     * Only the watches of the changed paths are added or removed.
+     */
+    bool supports_path_changes() const override;
+
   protected:
     /**
      * @brief Executes the monitor loop.
@@ -71,20 +96,45 @@ namespace fsw
      */
     void run();
 
+    /**
+     * @brief Wakes up the monitor loop, which then checks whether it should
+     * stop.
+     */
+    void on_stop() override;
+
+    /**
+     * @brief Wakes up the monitor loop, which then applies the path changes.
+     */
+    void on_paths_changed() override;
+
   private:
     inotify_monitor(const inotify_monitor& orig) = delete;
     inotify_monitor& operator=(const inotify_monitor& that) = delete;
 
     void scan_root_paths();
     bool is_watched(const std::string& path) const;
-    void preprocess_dir_event(struct inotify_event *event);
+    void preprocess_dir_event(struct inotify_event *event,
+                              const std::string& path);
     void preprocess_event(struct inotify_event *event);
-    void preprocess_node_event(struct inotify_event *event);
-    void scan(const std::string& path, const bool accept_non_dirs = true);
-    bool add_watch(const std::string& path,
-                   const struct stat& fd_stat);
+    void preprocess_node_event(struct inotify_event *event,
+                               const std::string& path);
+    int scan(const std::string& path,
+             int parent,
+             const bool accept_non_dirs = true);
+    void scan_step();
+    int add_watch(const std::string& path, int parent);
+    void forget_watch(int wd);
+    void link_watch(int wd);
+    void unlink_watch(int wd);
+    int find_child_watch(int parent, const std::string& name) const;
+    void move_watch(int wd, int parent, const std::string& name);
+    std::string path_of(int wd) const;
     void process_pending_events();
-    void remove_watch(int fd);
+    void process_path_changes();
+    void configure_batching();
+    void read_events();
+    void notify_batch();
+    void wake_up();
 
     inotify_monitor_impl *impl;
   };
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2014-2016 Enrico M. Crisostomo
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file
+ * @brief Header defining the open-addressing hash map used by the library.
+ *
+ * @copyright Copyright (c) 2014-2016 Enrico M. Crisostomo
+ * @license GNU General Public License v. 3.0
+ * @author Enrico M. Crisostomo
+ * @version 1.8.0
+ */
+
+#ifndef LIBFSW_FLAT_MAP_H
+#  define LIBFSW_FLAT_MAP_H
+
+#  include <cstddef>
+#  include <cstdint>
+#  include <functional>
+#  include <utility>
+#  include <vector>
+
+namespace fsw
+{
+  /**
+   * @brief Open-addressing hash map.
+   *
+   * Entries are stored in a single array and collisions are resolved by linear
+   * probing, so that a lookup touches a few contiguous slots and an entry costs
+   * no allocation of its own.  This container is meant for the large tables of
+   * the monitors, such as the watches of the `inotify` monitor: it is much more
+   * compact than ::fsw_hash_map but, unlike it, any insertion or removal
+   * invalidates the pointers to its values.
+   *
+   * @tparam K The key type.
+   * @tparam V The value type.
+   * @tparam H The hash function of the keys.
+   */
+  template<typename K, typename V, typename H = std::hash<K>>
+  class fsw_flat_map
+  {
+  public:
+    /**
+     * @brief Finds the value of a key.
+     *
+     * @param key The key to look for.
+     * @return A pointer to the value, or @c nullptr if @p key is not in the
+     * map.
+     */
+    V *find(const K& key)
+    {
+      if (slots.empty()) return nullptr;
+
+      for (size_t i = index_of(key);; i = next(i))
+      {
+        if (!slots[i].used) return nullptr;
+        if (slots[i].key == key) return &slots[i].value;
+      }
+    }
+
+    /**
+     * @copydoc find()
+     */
+    const V *find(const K& key) const
+    {
+      return const_cast<fsw_flat_map *>(this)->find(key);
+    }
+
+    /**
+     * @brief Returns the value of a key, inserting a default one if @p key is
+     * not in the map.
+     */
+    V& operator[](const K& key)
+    {
+      if (V *value = find(key)) return *value;
+
+      // Keep the load factor below 3/4.
+      if (4 * (count + 1) > 3 * slots.size()) grow();
+
+      size_t i = index_of(key);
+      while (slots[i].used) i = next(i);
+
+      slots[i].used = true;
+      slots[i].key = key;
+      slots[i].value = V();
+      ++count;
+
+      return slots[i].value;
+    }
+
+    /**
+     * @brief Removes a key.
+     *
+     * @return @c true if @p key was in the map.
+     */
+    bool erase(const K& key)
+    {
+      if (slots.empty()) return false;
+
+      size_t i = index_of(key);
+      while (slots[i].used && !(slots[i].key == key)) i = next(i);
+      if (!slots[i].used) return false;
+
+      /*
+       * Instead of leaving a tombstone, the entries of the same probe sequence
+       * are shifted back into the hole, so that lookups never get slower.
+       */
+      for (size_t j = next(i);; j = next(j))
+      {
+        if (!slots[j].used) break;
+
+        size_t home = index_of(slots[j].key);
+        // Move j to i unless its home lies cyclically in (i, j].
+        bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (stays) continue;
+
+        slots[i] = std::move(slots[j]);
+        i = j;
+      }
+
+      slots[i] = slot();
+      --count;
+
+      return true;
+    }
+
+    /**
+     * @brief Calls @p f with each key and value.
+     *
+     * The map must not be modified by @p f.
+     */
+    template<typename F>
+    void for_each(F f) const
+    {
+      for (const slot& s : slots)
+      {
+        if (s.used) f(s.key, s.value);
+      }
+    }
+
+    /**
+     * @brief Returns the number of entries.
+     */
+    size_t size() const
+    {
+      return count;
+    }
+
+    /**
+     * @brief Returns @c true if the map is empty.
+     */
+    bool empty() const
+    {
+      return count == 0;
+    }
+
+    /**
+     * @brief Removes all the entries.
+     */
+    void clear()
+    {
+      slots.clear();
+      count = 0;
+    }
+
+  private:
+    struct slot
+    {
+      K key = K();
+      V value = V();
+      bool used = false;
+    };
+
+    size_t index_of(const K& key) const
+    {
+      // Fibonacci hashing spreads sequential keys such as watch descriptors.
+      uint64_t h = static_cast<uint64_t>(H()(key)) * 0x9e3779b97f4a7c15ULL;
+      return static_cast<size_t>(h >> (64 - bits));
+    }
+
+    size_t next(size_t i) const
+    {
+      return (i + 1) & (slots.size() - 1);
+    }
+
+    void grow()
+    {
+      std::vector<slot> old;
+      old.swap(slots);
+
+      bits = old.empty() ? 4 : bits + 1;
+      slots.resize(size_t(1) << bits);
+      count = 0;
+
+      for (slot& s : old)
+      {
+        if (s.used) (*this)[s.key] = std::move(s.value);
+      }
+    }
+
+    std::vector<slot> slots;
+    size_t count = 0;
+    unsigned int bits = 0;
+  };
+}
+
+#endif  /* LIBFSW_FLAT_MAP_H */
@@ -22,6 +22,7 @@
 #include "libfswatch_exception.hpp"
 #include "../c/libfswatch_log.h"
 #include "string/string_utils.hpp"
+#include <algorithm>
 #include <cstdlib>
 #include <memory>
 #include <thread>
@@ -46,12 +47,14 @@ namespace fsw
   #define FSW_MONITOR_RUN_GUARD_UNLOCK run_guard.unlock();
 
   #define FSW_MONITOR_NOTIFY_GUARD std::unique_lock<std::mutex> notify_guard(notify_mutex);
+  #define FSW_MONITOR_PATHS_GUARD std::unique_lock<std::mutex> paths_guard(paths_mutex);
 #else
   #define FSW_MONITOR_RUN_GUARD
   #define FSW_MONITOR_RUN_GUARD_LOCK
   #define FSW_MONITOR_RUN_GUARD_UNLOCK
 
   #define FSW_MONITOR_NOTIFY_GUARD
+  #define FSW_MONITOR_PATHS_GUARD
 #endif
 
   monitor::monitor(std::vector<std::string> paths,
@@ -176,6 +179,101 @@ namespace fsw
     watch_access = access;
   }
 
+  bool monitor::supports_path_changes() const
+  {
+    return false;
+  }
+
+  void monitor::add_root_path(const std::string& path)
+  {
+    change_root_path(path, true);
+  }
+
+  void monitor::remove_root_path(const std::string& path)
+  {
+    change_root_path(path, false);
+  }
+
+  void monitor::change_root_path(const std::string& path, bool add)
+  {
+    // Holding run_mutex, the monitor cannot start or stop meanwhile.
+    FSW_MONITOR_RUN_GUARD;
+    FSW_MONITOR_PATHS_GUARD;
+
+    if (!running)
+    {
+      auto i = std::find(paths.begin(), paths.end(), path);
+
+      if (add && i == paths.end()) paths.push_back(path);
+      if (!add && i != paths.end()) paths.erase(i);
+
+      return;
+    }
+
+    if (!supports_path_changes())
+    {
+      throw libfsw_exception(_("The monitor does not support path changes while running."),
+                             FSW_ERR_UNSUPPORTED_OPERATION);
+    }
+
+    path_changes.emplace_back(path, add);
+#ifdef HAVE_CXX_MUTEX
+    paths_guard.unlock();
+#endif
+    on_paths_changed();
+  }
+
+  std::vector<std::string> monitor::get_root_paths() const
+  {
+    FSW_MONITOR_PATHS_GUARD;
+
+    std::vector<std::string> root_paths = paths;
+
+    for (const auto& change : path_changes)
+    {
+      auto i = std::find(root_paths.begin(), root_paths.end(), change.first);
+
+      if (change.second && i == root_paths.end()) root_paths.push_back(change.first);
+      if (!change.second && i != root_paths.end()) root_paths.erase(i);
+    }
+
+    return root_paths;
+  }
+
+  bool monitor::take_path_changes(std::vector<std::string>& added,
+                                  std::vector<std::string>& removed)
+  {
+    FSW_MONITOR_PATHS_GUARD;
+
+    if (path_changes.empty()) return false;
+
+    // A path both added and removed ends up in the list of its last change.
+    for (const auto& change : path_changes)
+    {
+      auto i = std::find(paths.begin(), paths.end(), change.first);
+      std::vector<std::string>& to = change.second ? added : removed;
+      std::vector<std::string>& from = change.second ? removed : added;
+
+      if (change.second == (i != paths.end())) continue;
+
+      if (change.second) paths.push_back(change.first);
+      else paths.erase(i);
+
+      auto j = std::find(from.begin(), from.end(), change.first);
+      if (j != from.end()) from.erase(j);
+      else to.push_back(change.first);
+    }
+
+    path_changes.clear();
+
+    return !added.empty() || !removed.empty();
+  }
+
+  void monitor::on_paths_changed()
+  {
+    // No-op implementation.
+  }
+
   bool monitor::accept_event_type(fsw_event_flag event_type) const
   {
     // If no filters are set, then accept the event.
@@ -275,6 +373,13 @@ namespace fsw
     FSW_MONITOR_RUN_GUARD;
     if (this->running) return;
 
+    // stop() was called before the monitor started: the request is taken now.
+    if (this->should_stop)
+    {
+      this->should_stop = false;
+      return;
+    }
+
     this->running = true;
     FSW_MONITOR_RUN_GUARD_UNLOCK;
 
@@ -304,12 +409,15 @@ namespace fsw
     // Stopping a monitor is a cooperative task: the caller request a task to
     // stop and it's responsibility of each monitor to check for this flag and
     // timely stop the processing loop.
+    //
+    // A monitor which has not started yet keeps the request, and its next
+    // start() returns at once.
     FSW_MONITOR_RUN_GUARD;
-    if (!this->running || this->should_stop) return;
+    if (this->should_stop) return;
 
     FSW_ELOG(_("Stopping the monitor.\n"));
     this->should_stop = true;
-    on_stop();
+    if (this->running) on_stop();
   }
 
   bool monitor::is_running()
@@ -39,6 +39,7 @@
 #  include <atomic>
 #  include <chrono>
 #  include <map>
+#  include <utility>
 #  include "event.hpp"
 #  include "../c/cmonitor.h"
 
@@ -368,7 +369,8 @@ namespace fsw
      *     _stopped_, locking on monitor::run_mutex.
      *
      * This call does _not_ return until the monitor is stopped and events are
-     * notified from its thread.
+     * notified from its thread.  If stop() was called before, it returns at
+     * once without running the monitor.
      *
      * State changes are performed thread-safely locking on monitor::run_mutex.
      *
@@ -384,7 +386,9 @@ namespace fsw
      * execute the monitoring loop in its thread and to not return until the
      * monitor is stopped, stop() is designed to be called from another thread.
      * stop() is a cooperative signal that must be handled in an
-     * implementation-specific way in the run() function.
+     * implementation-specific way in the run() function.  A monitor which has
+     * not started yet keeps the request: its next start() returns at once, so
+     * the thread calling it can be joined right after stop().
      *
      * State changes are performed thread-safely locking on monitor::run_mutex.
      *
@@ -430,6 +434,49 @@ namespace fsw
      */
     void set_watch_access(bool access);
 
+    /**
+     * @brief Add a path to watch.
+     *
+     * A path can be added to a monitor which is not running yet, or to a
+     * running monitor whose implementation supports_path_changes().  A running
+     * monitor starts watching the path at its next iteration, without scanning
+     * the paths it is already watching.  Adding a path which is already
+     * watched has no effect.
+     *
+     * @param path The path to add.
+     * @throw libfsw_exception if the monitor is running and does not support
+     * path changes.
+     */
+    void add_root_path(const std::string& path);
+
+    /**
+     * @brief Stop watching a path.
+     *
+     * This function is the counterpart of add_root_path().  The nodes below
+     * @p path which are also below another watched path keep being watched.
+     *
+     * @param path The path to remove.
+     * @throw libfsw_exception if the monitor is running and does not support
+     * path changes.
+     */
+    void remove_root_path(const std::string& path);
+
+    /**
+     * @brief Get the watched paths.
+     *
+     * @return The watched paths, including the changes that a running monitor
+     * has not processed yet.
+     */
+    std::vector<std::string> get_root_paths() const;
+
+    /**
+     * @brief Check whether paths can be added or removed while running.
+     *
+     * @return @c true if add_root_path() and remove_root_path() may be called
+     * on a running monitor.  The default implementation returns @c false.
+     */
+    virtual bool supports_path_changes() const;
+
   protected:
     /**
      * @brief Check whether an event should be accepted.
@@ -513,6 +560,31 @@ namespace fsw
      */
     virtual void on_stop();
 
+    /**
+     * @brief Apply the pending path changes.
+     *
+     * This function is called from run() by the monitors which
+     * supports_path_changes(): it applies the changes requested by
+     * add_root_path() and remove_root_path() to monitor::paths, which is only
+     * modified on the thread executing run() while the monitor is running.
+     *
+     * @param added The paths that have been added.
+     * @param removed The paths that have been removed.
+     * @return @c true if any path has been added or removed.
+     */
+    bool take_path_changes(std::vector<std::string>& added,
+                           std::vector<std::string>& removed);
+
+    /**
+     * @brief Execute an implementation-specific handler for path changes.
+     *
+     * This function is executed by add_root_path() and remove_root_path() on a
+     * running monitor, after the change has been queued.  Monitors blocking on
+     * a wait longer than their latency should wake up and call
+     * take_path_changes().  The default implementation is a no-op.
+     */
+    virtual void on_paths_changed();
+
   protected:
     /**
      * @brief List of paths to watch.
@@ -600,10 +672,18 @@ namespace fsw
      * @brief Mutex used to serialize access to the notify_events() method.
      */
     mutable std::mutex notify_mutex;
+
+    /**
+     * @brief Mutex used to serialize access to monitor::paths and to the
+     * pending path changes.
+     */
+    mutable std::mutex paths_mutex;
 #  endif
 
   private:
     std::chrono::milliseconds get_latency_ms() const;
+    void change_root_path(const std::string& path, bool add);
+    std::vector<std::pair<std::string, bool>> path_changes;
     std::vector<compiled_monitor_filter> filters;
     std::vector<fsw_event_type_filter> event_type_filters;
 
@@ -21,6 +21,7 @@
 #include "gettext_defs.h"
 #include "monitor_factory.hpp"
 #include "libfswatch_exception.hpp"
+#include "../c/libfswatch_log.h"
 #if defined(HAVE_FSEVENTS_FILE_EVENTS)
   #include "fsevents_monitor.hpp"
 #endif
@@ -33,6 +34,9 @@
 #if defined(HAVE_SYS_INOTIFY_H)
   #include "inotify_monitor.hpp"
 #endif
+#if defined(HAVE_FANOTIFY_DFID_NAME)
+  #include "fanotify_monitor.hpp"
+#endif
 #if defined(HAVE_WINDOWS)
   #include "windows_monitor.hpp"
 #endif
@@ -52,6 +56,8 @@ namespace fsw
     type = fsw_monitor_type::kqueue_monitor_type;
 #elif defined(HAVE_PORT_H)
     type = fsw_monitor_type::fen_monitor_type;
+#elif defined(HAVE_FANOTIFY_DFID_NAME)
+    type = fsw_monitor_type::fanotify_monitor_type;
 #elif defined(HAVE_SYS_INOTIFY_H)
     type = fsw_monitor_type::inotify_monitor_type;
 #elif defined(HAVE_WINDOWS)
@@ -87,6 +93,19 @@ namespace fsw
       case inotify_monitor_type:
         return new inotify_monitor(paths, callback, context);
 #endif
+#if defined(HAVE_FANOTIFY_DFID_NAME)
+      case fanotify_monitor_type:
+        // Without the privileges or the kernel support, inotify is used instead.
+        try
+        {
+          return new fanotify_monitor(paths, callback, context);
+        }
+        catch (const libfsw_exception& ex)
+        {
+          FSW_ELOGF(_("Falling back to inotify: %s\n"), ex.what());
+          return new inotify_monitor(paths, callback, context);
+        }
+#endif
 #if defined(HAVE_WINDOWS)
       case windows_monitor_type:
         return new windows_monitor(paths, callback, context);
@@ -120,6 +139,9 @@ namespace fsw
 #if defined(HAVE_SYS_INOTIFY_H)
     creator_by_string_set[fsw_quote(inotify_monitor)] = fsw_monitor_type::inotify_monitor_type;
 #endif
+#if defined(HAVE_FANOTIFY_DFID_NAME)
+    creator_by_string_set[fsw_quote(fanotify_monitor)] = fsw_monitor_type::fanotify_monitor_type;
+#endif
 #if defined(HAVE_WINDOWS)
     creator_by_string_set[fsw_quote(windows_monitor)] = fsw_monitor_type::windows_monitor_type;
 #endif
@@ -100,4 +100,22 @@ namespace fsw
     fsw_logf_perror(_("Cannot lstat %s"), path.c_str());
     return false;
   }
+
+  bool is_path_below(const string& path, const string& root)
+  {
+    if (path.compare(0, root.size(), root) != 0) return false;
+    if (path.size() == root.size()) return true;
+
+    return (!root.empty() && root.back() == '/') || path[root.size()] == '/';
+  }
+
+  bool is_path_below_any(const string& path, const vector<string>& roots)
+  {
+    for (const string& root : roots)
+    {
+      if (is_path_below(path, root)) return true;
+    }
+
+    return false;
+  }
 }
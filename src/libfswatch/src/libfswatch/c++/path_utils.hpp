@@ -84,5 +84,27 @@ namespace fsw
    * @return @c true if the function succeeds, @c false otherwise.
    */
   bool stat_path(const std::string& path, struct stat& fd_stat);
+
+  /**
+   * @brief Checks whether a path is @p root or one of its descendants.
+   *
+   * The check is lexical: @p path is below @p root if it is equal to it or if
+   * it starts with @p root followed by a directory separator.
+   *
+   * @param path The path to check.
+   * @param root The candidate ancestor.
+   * @return @c true if @p path is below @p root, @c false otherwise.
+   */
+  bool is_path_below(const std::string& path, const std::string& root);
+
+  /**
+   * @brief Checks whether a path is below any of @p roots.
+   *
+   * @param path The path to check.
+   * @param roots The candidate ancestors.
+   * @return @c true if @p path is below one of @p roots, @c false otherwise.
+   */
+  bool is_path_below_any(const std::string& path,
+                         const std::vector<std::string>& roots);
 }
 #endif  /* FSW_PATH_UTILS_H */
@@ -21,12 +21,19 @@
 #include "poll_monitor.hpp"
 #include <unistd.h>
 #include <cstdlib>
+#include <dirent.h>
 #include <fcntl.h>
+#include <algorithm>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <system_error>
+#include <thread>
 #include <utility>
 #include "c/libfswatch_log.h"
 #include "path_utils.hpp"
-#include "libfswatch_map.hpp"
+#include "libfswatch_exception.hpp"
+#include "libfswatch_flat_map.hpp"
 
 #define HAVE_STRUCT_STAT_ST_MTIME
 #if defined HAVE_STRUCT_STAT_ST_MTIME
@@ -42,160 +49,412 @@ namespace fsw
   using std::vector;
   using std::string;
 
+  // Number of shards of the table of the tracked files.
+  static const size_t TABLE_SHARDS = 64;
+
   typedef struct poll_monitor::poll_monitor_data
   {
-    fsw_hash_map<string, poll_monitor::watched_file_info> tracked_files;
+    /*
+     * The files found by the scans.  There is a single table: each scan stamps
+     * the files it finds with its generation, and the files left with an older
+     * one have been removed.  The table is split into shards, each with its
+     * own lock, so that the scanning threads seldom wait for each other.
+     *
+     * When directories are pruned, the names of the subdirectories of each
+     * directory are kept as well, so that they can be checked without reading
+     * it.
+     */
+    struct shard
+    {
+      std::mutex mutex;
+      fsw_flat_map<string, poll_monitor::watched_file_info> tracked_files;
+      fsw_flat_map<string, vector<string>> subdirectories;
+    };
+
+    shard shards[TABLE_SHARDS];
+
+    shard& shard_of(const string& path)
+    {
+      return shards[std::hash<string>()(path) % TABLE_SHARDS];
+    }
   }
   poll_monitor_data;
 
+  /*
+   * The state of a scan: the directories which are waiting to be read, which
+   * the threads take in turn and add the subdirectories they find to.
+   */
+  struct poll_monitor::poll_scan
+  {
+    bool report;
+    bool prune;
+    std::mutex mutex;
+    std::condition_variable cv;
+    vector<poll_directory> directories;
+    size_t busy = 0;
+  };
+
   poll_monitor::poll_monitor(vector<string> paths,
                              FSW_EVENT_CALLBACK *callback,
                              void *context) :
     monitor(std::move(paths), callback, context)
   {
-    previous_data = new poll_monitor_data();
-    new_data = new poll_monitor_data();
+    data = new poll_monitor_data();
     time(&curr_time);
   }
 
   poll_monitor::~poll_monitor()
   {
-    delete previous_data;
-    delete new_data;
+    delete data;
   }
 
-  bool poll_monitor::initial_scan_callback(const string& path,
-                                           const struct stat& stat)
+  static long parse_property(const string& value, long min_value)
   {
-    if (previous_data->tracked_files.count(path))
-      return false;
+    char *end = nullptr;
+    long parsed_value = strtol(value.c_str(), &end, 0);
 
-    watched_file_info wfi{FSW_MTIME(stat), FSW_CTIME(stat)};
-    previous_data->tracked_files[path] = wfi;
+    if (*end != '\0' || parsed_value < min_value)
+    {
+      string msg = string(_("Invalid value: ")) + value;
+      throw libfsw_exception(msg.c_str());
+    }
 
-    return true;
+    return parsed_value;
+  }
+
+  void poll_monitor::configure_scan()
+  {
+    unsigned int processors = std::thread::hardware_concurrency();
+    scan_threads = std::min(std::max(processors, 1u), 8u);
+
+    string threads = get_property(POLL_SCAN_THREADS);
+    string refresh = get_property(POLL_PRUNE_REFRESH);
+
+    if (!threads.empty()) scan_threads = parse_property(threads, 1);
+    if (!refresh.empty()) prune_refresh = parse_property(refresh, 1);
+
+    prune = (get_property(POLL_PRUNE) == "true") && !follow_symlinks;
   }
 
-  bool poll_monitor::intermediate_scan_callback(const string& path,
-                                                const struct stat& stat)
+  bool poll_monitor::track(const string& path,
+                           const struct stat& fd_stat,
+                           bool report,
+                           vector<event>& found,
+                           bool& unchanged)
   {
-    if (new_data->tracked_files.count(path)) return false;
+    poll_monitor_data::shard& shard = data->shard_of(path);
+    std::lock_guard<std::mutex> lock(shard.mutex);
 
-    watched_file_info wfi{FSW_MTIME(stat), FSW_CTIME(stat)};
-    new_data->tracked_files[path] = wfi;
+    watched_file_info *wfi = shard.tracked_files.find(path);
+    unchanged = false;
 
-    if (previous_data->tracked_files.count(path))
+    if (wfi == nullptr)
     {
-      watched_file_info pwfi = previous_data->tracked_files[path];
-      vector<fsw_event_flag> flags;
+      shard.tracked_files[path] = {FSW_MTIME(fd_stat), FSW_CTIME(fd_stat), generation, 0, false};
+      if (report) found.emplace_back(path, curr_time, vector<fsw_event_flag>{fsw_event_flag::Created});
 
-      if (FSW_MTIME(stat) > pwfi.mtime)
-      {
-        flags.push_back(fsw_event_flag::Updated);
-      }
+      return true;
+    }
 
-      if (FSW_CTIME(stat) > pwfi.ctime)
-      {
-        flags.push_back(fsw_event_flag::AttributeModified);
-      }
+    // Already found by this scan.
+    if (wfi->generation == generation) return false;
 
-      if (!flags.empty())
-      {
-        events.emplace_back(path, curr_time, flags);
-      }
+    vector<fsw_event_flag> flags;
 
-      previous_data->tracked_files.erase(path);
+    if (FSW_MTIME(fd_stat) > wfi->mtime)
+    {
+      flags.push_back(fsw_event_flag::Updated);
     }
-    else
+
+    if (FSW_CTIME(fd_stat) > wfi->ctime)
     {
-      vector<fsw_event_flag> flags;
-      flags.push_back(fsw_event_flag::Created);
-      events.emplace_back(path, curr_time, flags);
+      flags.push_back(fsw_event_flag::AttributeModified);
     }
 
-    return true;
-  }
+    unchanged = wfi->settled
+      && FSW_MTIME(fd_stat) == wfi->mtime
+      && FSW_CTIME(fd_stat) == wfi->ctime;
 
-  bool poll_monitor::add_path(const string& path,
-                              const struct stat& fd_stat,
-                              poll_monitor_scan_callback poll_callback)
-  {
-    return ((*this).*(poll_callback))(path, fd_stat);
+    wfi->mtime = FSW_MTIME(fd_stat);
+    wfi->ctime = FSW_CTIME(fd_stat);
+    wfi->generation = generation;
+
+    if (report && !flags.empty())
+    {
+      found.emplace_back(path, curr_time, flags);
+    }
+
+    return true;
   }
 
-  void poll_monitor::scan(const string& path, poll_monitor_scan_callback fn)
+  void poll_monitor::visit(const string& path,
+                           const struct stat& fd_stat,
+                           poll_scan& scan,
+                           vector<event>& found,
+                           vector<poll_directory>& directories)
   {
-    struct stat fd_stat;
-    if (!lstat_path(path, fd_stat)) return;
-
     if (follow_symlinks && S_ISLNK(fd_stat.st_mode))
     {
       string link_path;
-      if (read_link_path(path, link_path))
-        scan(link_path, fn);
+      struct stat link_stat;
+
+      try
+      {
+        if (!read_link_path(path, link_path)) return;
+      }
+      catch (const std::system_error& ex)
+      {
+        return;
+      }
+
+      if (lstat_path(link_path, link_stat))
+        visit(link_path, link_stat, scan, found, directories);
 
       return;
     }
 
+    bool unchanged;
+
     if (!accept_path(path)) return;
-    if (!add_path(path, fd_stat, fn)) return;
+    if (!track(path, fd_stat, scan.report, found, unchanged)) return;
     if (!recursive) return;
     if (!S_ISDIR(fd_stat.st_mode)) return;
 
-    vector<string> children = get_directory_children(path);
+    directories.push_back({path, scan.prune && unchanged});
+  }
+
+  void poll_monitor::read_directory(const string& path,
+                                    poll_scan& scan,
+                                    vector<event>& found,
+                                    vector<poll_directory>& directories)
+  {
+    DIR *dir = opendir(path.c_str());
+
+    if (!dir)
+    {
+      fsw_logf_perror(_("Cannot opendir %s"), path.c_str());
+      return;
+    }
+
+    vector<string> subdirectories;
 
-    for (const string& child : children)
+    /*
+     * readdir() reads the entries in batches, and fstatat() looks up each one
+     * in the open directory instead of resolving its whole path.
+     */
+    while (struct dirent *ent = readdir(dir))
     {
+      string child = ent->d_name;
       if (child == "." || child == "..") continue;
 
-      scan(path + "/" + child, fn);
+      struct stat fd_stat;
+
+      if (fstatat(dirfd(dir), ent->d_name, &fd_stat, AT_SYMLINK_NOFOLLOW) != 0)
+      {
+        fsw_logf_perror(_("Cannot lstat %s"), (path + "/" + child).c_str());
+        continue;
+      }
+
+      if (prune && S_ISDIR(fd_stat.st_mode)) subdirectories.push_back(child);
+
+      visit(path + "/" + child, fd_stat, scan, found, directories);
     }
+
+    closedir(dir);
+
+    poll_monitor_data::shard& shard = data->shard_of(path);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    watched_file_info *wfi = shard.tracked_files.find(path);
+    if (wfi == nullptr) return;
+
+    /*
+     * A change made in the same second as the directory was examined leaves
+     * its times as they were: such a directory is read again next time.
+     */
+    wfi->listed = generation;
+    wfi->settled = wfi->ctime < curr_time;
+
+    if (!prune) return;
+
+    if (subdirectories.empty())
+      shard.subdirectories.erase(path);
+    else
+      shard.subdirectories[path] = std::move(subdirectories);
   }
 
-  void poll_monitor::find_removed_files()
+  void poll_monitor::revisit_directory(const string& path,
+                                       poll_scan& scan,
+                                       vector<event>& found,
+                                       vector<poll_directory>& directories)
   {
-    vector<fsw_event_flag> flags;
-    flags.push_back(fsw_event_flag::Removed);
+    vector<string> subdirectories;
 
-    for (auto& removed : previous_data->tracked_files)
     {
-      events.emplace_back(removed.first, curr_time, flags);
+      poll_monitor_data::shard& shard = data->shard_of(path);
+      std::lock_guard<std::mutex> lock(shard.mutex);
+
+      if (const vector<string> *names = shard.subdirectories.find(path))
+        subdirectories = *names;
+    }
+
+    // The entries are the same as when the directory was last read: only the
+    // subdirectories need to be checked.
+    for (const string& child : subdirectories)
+    {
+      struct stat fd_stat;
+      if (!lstat_path(path + "/" + child, fd_stat)) continue;
+
+      visit(path + "/" + child, fd_stat, scan, found, directories);
     }
   }
 
-  void poll_monitor::swap_data_containers()
+  void poll_monitor::scan_directories(poll_scan& scan, vector<event>& found)
   {
-    delete previous_data;
-    previous_data = new_data;
-    new_data = new poll_monitor_data();
+    std::unique_lock<std::mutex> lock(scan.mutex);
+
+    for (;;)
+    {
+      // The scan is over when no directory is waiting and none is being read.
+      scan.cv.wait(lock, [&scan] { return !scan.directories.empty() || scan.busy == 0; });
+      if (scan.directories.empty()) break;
+
+      poll_directory dir = std::move(scan.directories.back());
+      scan.directories.pop_back();
+      ++scan.busy;
+      lock.unlock();
+
+      vector<poll_directory> directories;
+
+      if (dir.unchanged)
+        revisit_directory(dir.path, scan, found, directories);
+      else
+        read_directory(dir.path, scan, found, directories);
+
+      lock.lock();
+      --scan.busy;
+      for (poll_directory& d : directories) scan.directories.push_back(std::move(d));
+      scan.cv.notify_all();
+    }
   }
 
-  void poll_monitor::collect_data()
+  void poll_monitor::scan(const vector<string>& roots, bool report)
   {
-    poll_monitor_scan_callback fn = &poll_monitor::intermediate_scan_callback;
+    poll_scan scan;
+    scan.report = report;
+    // Every prune_refresh-th scan reads all the directories.
+    scan.prune = prune && (generation % prune_refresh != 0);
+
+    for (const string& path : roots)
+    {
+      struct stat fd_stat;
+      if (!lstat_path(path, fd_stat)) continue;
 
-    for (string& path : paths)
+      visit(path, fd_stat, scan, events, scan.directories);
+    }
+
+    // The directories are read by the pool, and by this thread as well.
+    size_t threads = std::min(scan_threads, std::max<size_t>(scan.directories.size(), 1));
+    vector<vector<event>> found(threads - 1);
+    vector<std::thread> workers;
+
+    for (size_t i = 0; i + 1 < threads; ++i)
     {
-      scan(path, fn);
+      workers.emplace_back([this, &scan, &found, i] { scan_directories(scan, found[i]); });
     }
 
-    find_removed_files();
-    swap_data_containers();
+    scan_directories(scan, events);
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+      workers[i].join();
+      events.insert(events.end(), found[i].begin(), found[i].end());
+    }
   }
 
-  void poll_monitor::collect_initial_data()
+  bool poll_monitor::is_pruned(const string& path) const
   {
-    poll_monitor_scan_callback fn = &poll_monitor::initial_scan_callback;
+    // The entries of a directory which was found, but not read, by this scan
+    // are still there.
+    size_t slash = path.rfind('/');
+    if (slash == string::npos) return false;
 
-    for (string& path : paths)
+    string parent = path.substr(0, slash);
+    const watched_file_info *wfi = data->shard_of(parent).tracked_files.find(parent);
+
+    return wfi != nullptr && wfi->generation == generation && wfi->listed != generation;
+  }
+
+  void poll_monitor::find_removed_files()
+  {
+    vector<fsw_event_flag> flags;
+    flags.push_back(fsw_event_flag::Removed);
+
+    for (poll_monitor_data::shard& shard : data->shards)
     {
-      scan(path, fn);
+      vector<string> removed;
+
+      shard.tracked_files.for_each([this, &removed](const string& path,
+                                                    const watched_file_info& wfi)
+      {
+        if (wfi.generation == generation) return;
+        if (prune && is_pruned(path)) return;
+
+        removed.push_back(path);
+      });
+
+      for (const string& path : removed)
+      {
+        shard.tracked_files.erase(path);
+        shard.subdirectories.erase(path);
+        events.emplace_back(path, curr_time, flags);
+      }
     }
   }
 
+  bool poll_monitor::supports_path_changes() const
+  {
+    return true;
+  }
+
+  void poll_monitor::apply_path_changes()
+  {
+    vector<string> added;
+    vector<string> removed;
+
+    if (!take_path_changes(added, removed)) return;
+
+    // Forget the files of the removed paths, unless they are still below
+    // another watched path.
+    for (poll_monitor_data::shard& shard : data->shards)
+    {
+      vector<string> forgotten;
+
+      shard.tracked_files.for_each([this, &removed, &forgotten](const string& path,
+                                                                const watched_file_info&)
+      {
+        if (is_path_below_any(path, removed) && !is_path_below_any(path, paths))
+          forgotten.push_back(path);
+      });
+
+      for (const string& path : forgotten)
+      {
+        shard.tracked_files.erase(path);
+        shard.subdirectories.erase(path);
+      }
+    }
+
+    // The added paths are scanned like at startup: their files are not
+    // reported as created.
+    scan(added, false);
+  }
+
   void poll_monitor::run()
   {
-    collect_initial_data();
+    configure_scan();
+
+    // The files found at startup are not reported.
+    scan(paths, false);
 
     for (;;)
     {
@@ -211,7 +470,11 @@ namespace fsw
 
       time(&curr_time);
 
-      collect_data();
+      apply_path_changes();
+
+      ++generation;
+      scan(paths, true);
+      find_removed_files();
 
       if (!events.empty())
       {
@@ -36,11 +36,44 @@ namespace fsw
    * @brief `stat()`-based monitor.
    *
    * This monitor uses the `stat()` function to periodically check the observed
-   * paths and detect changes.
+   * paths and detect changes.  Directories are read by a pool of threads, and
+   * the state of the files is kept in a single table stamped with the
+   * generation of the scan which last found them.
    */
   class poll_monitor : public monitor
   {
   public:
+    /**
+     * @brief Number of threads reading the directories at each scan.  The
+     * default value is the number of processors, at most 8.
+     *
+     * Scanning network filesystems is mostly waiting for the server, so more
+     * threads than processors may help there.
+     */
+    static constexpr const char *POLL_SCAN_THREADS = "poll.scan.threads";
+
+    /**
+     * @brief Set to `true` to skip reading the directories which did not
+     * change.
+     *
+     * Creating, removing or renaming an entry updates the modification time of
+     * its directory.  When this property is set, a directory whose times did
+     * not change since it was last read is not read again: only its
+     * subdirectories are checked.  The other changes to its files are
+     * detected by the full scans, which run every #POLL_PRUNE_REFRESH scans.
+     * This makes polling large, mostly static trees much cheaper, especially
+     * on network filesystems.
+     *
+     * Directories are not pruned when symbolic links are followed.
+     */
+    static constexpr const char *POLL_PRUNE = "poll.prune";
+
+    /**
+     * @brief When #POLL_PRUNE is set, the number of scans between two full
+     * scans.  The default value is 10.
+     */
+    static constexpr const char *POLL_PRUNE_REFRESH = "poll.prune.refresh";
+
     /**
      * @brief Constructs an instance of this class.
      */
@@ -53,6 +86,13 @@ namespace fsw
      */
     virtual ~poll_monitor();
 
+    /**
+     * @brief Paths can be added and removed while the monitor is running.
+     *
+     * The changes are applied before the next poll.
+     */
+    bool supports_path_changes() const override;
+
   protected:
     void run();
 
@@ -62,32 +102,54 @@ namespace fsw
     poll_monitor(const poll_monitor& orig) = delete;
     poll_monitor& operator=(const poll_monitor& that) = delete;
 
-    typedef bool (poll_monitor::*poll_monitor_scan_callback)(
-      const std::string& path,
-      const struct stat& stat);
-
     typedef struct watched_file_info
     {
       time_t mtime;
       time_t ctime;
+      unsigned int generation;
+      unsigned int listed;  // Generation of the scan which last read the directory.
+      bool settled;         // The directory was not changed while it was read.
     } watched_file_info;
 
+    typedef struct poll_directory
+    {
+      std::string path;
+      bool unchanged;
+    } poll_directory;
+
     struct poll_monitor_data;
+    struct poll_scan;
 
-    void scan(const std::string& path, poll_monitor_scan_callback fn);
-    void collect_initial_data();
-    void collect_data();
-    bool add_path(const std::string& path,
-                  const struct stat& fd_stat,
-                  poll_monitor_scan_callback poll_callback);
-    bool initial_scan_callback(const std::string& path, const struct stat& stat);
-    bool intermediate_scan_callback(const std::string& path,
-                                    const struct stat& stat);
+    void configure_scan();
+    void scan(const std::vector<std::string>& roots, bool report);
+    void scan_directories(poll_scan& scan, std::vector<event>& found);
+    void read_directory(const std::string& path,
+                        poll_scan& scan,
+                        std::vector<event>& found,
+                        std::vector<poll_directory>& directories);
+    void revisit_directory(const std::string& path,
+                           poll_scan& scan,
+                           std::vector<event>& found,
+                           std::vector<poll_directory>& directories);
+    void visit(const std::string& path,
+               const struct stat& fd_stat,
+               poll_scan& scan,
+               std::vector<event>& found,
+               std::vector<poll_directory>& directories);
+    bool track(const std::string& path,
+               const struct stat& fd_stat,
+               bool report,
+               std::vector<event>& found,
+               bool& unchanged);
+    bool is_pruned(const std::string& path) const;
     void find_removed_files();
-    void swap_data_containers();
+    void apply_path_changes();
 
-    poll_monitor_data *previous_data;
-    poll_monitor_data *new_data;
+    poll_monitor_data *data;
+    unsigned int generation = 0;
+    size_t scan_threads;
+    bool prune = false;
+    unsigned int prune_refresh = 10;
 
     std::vector<event> events;
     time_t curr_time;
@@ -48,7 +48,8 @@ extern "C"
     inotify_monitor_type,            /**< Linux `inotify` monitor. */
     windows_monitor_type,            /**< Windows monitor. */
     poll_monitor_type,               /**< `stat()`-based poll monitor. */
-    fen_monitor_type                 /**< Solaris/Illumos monitor. */
+    fen_monitor_type,                /**< Solaris/Illumos monitor. */
+    fanotify_monitor_type            /**< Linux `fanotify` monitor. */
   };
 
 #  ifdef __cplusplus
@@ -0,0 +1,90 @@
+#include <fstream>
+#include <sstream>
+#include <system_error>
+#include <thread>
+
+#include "store.h"
+
+namespace bolo_store {
+using namespace bolo;
+using namespace std::string_literals;
+namespace fs = std::filesystem;
+
+ChunkStore::ChunkStore(fs::path root, bolo_compress::Scheme scheme,
+                       const bolo_compress::Options &opts)
+    : root_(std::move(root)), scheme_(scheme), opts_(opts) {
+  // chunks are small, and are put by many threads already
+  opts_.threads = 1;
+}
+
+fs::path ChunkStore::Path(const std::string &hash) const {
+  return root_ / hash.substr(0, 2) / hash;
+}
+
+bool ChunkStore::Has(const std::string &hash) const {
+  std::error_code ec;
+  return fs::exists(Path(hash), ec);
+}
+
+Result<std::string, std::string> ChunkStore::Put(const char *data, size_t size) const {
+  auto hash = Sha256(data, size);
+  if (Has(hash)) return Ok(hash);
+
+  auto path = Path(hash);
+  std::error_code ec;
+  fs::create_directories(path.parent_path(), ec);
+  if (ec) return Err("failed to create "s + path.parent_path().string());
+
+  // another thread may be putting the same chunk: each one writes a file of its own, and the
+  // renames replace a complete copy with another
+  auto part = path.string() + "." +
+              std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id())) + ".part";
+  std::ofstream ofs(part, std::ios_base::binary | std::ios_base::trunc);
+  if (!ofs) return Err("failed to open "s + part);
+
+  std::istringstream in(std::string(data, size));
+  auto ins = bolo_compress::Compress(in, ofs, scheme_, opts_);
+  ofs.close();
+  if (!ins && !ofs) ins = Danger("failed to write "s + part);
+  if (!ins) fs::rename(part, path, ec);
+  if (!ins && ec) ins = Danger("failed to rename "s + part + ": " + ec.message());
+
+  if (ins) {
+    fs::remove(part, ec);
+    return Err(ins.error());
+  }
+  return Ok(hash);
+}
+
+Result<std::string, std::string> ChunkStore::Get(const std::string &hash) const {
+  std::ifstream ifs(Path(hash), std::ios_base::binary);
+  if (!ifs) return Err("missing chunk "s + hash);
+
+  std::ostringstream out;
+  if (auto ins = bolo_compress::Uncompress(ifs, out, bolo_compress::Scheme::STORE, opts_))
+    return Err("chunk "s + hash + ": " + ins.error());
+
+  auto data = out.str();
+  if (Sha256(data.data(), data.size()) != hash) return Err("corrupted chunk "s + hash);
+  return Ok(std::move(data));
+}
+
+Result<size_t, std::string> ChunkStore::CollectGarbage(
+    const std::unordered_set<std::string> &live) try {
+  size_t removed = 0;
+  if (!fs::exists(root_)) return Ok(removed);
+
+  // everything else in the store goes, the parts left by interrupted backups included
+  for (auto &dir : fs::directory_iterator(root_)) {
+    if (!dir.is_directory()) continue;
+    for (auto &f : fs::directory_iterator(dir.path())) {
+      if (live.count(f.path().filename().string()) > 0) continue;
+      fs::remove(f.path());
+      removed++;
+    }
+  }
+  return Ok(removed);
+} catch (const fs::filesystem_error &e) {
+  return Err("filesystem error: "s + e.what());
+}
+};  // namespace bolo_store
@@ -0,0 +1,73 @@
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <array>
+
+#include "store.h"
+
+namespace bolo_store {
+
+namespace {
+// random gear values, from splitmix64 so that every build cuts the same chunks
+constexpr std::array<uint64_t, 256> MakeGear() {
+  std::array<uint64_t, 256> gear{};
+  uint64_t x = 0;
+  for (auto &g : gear) {
+    x += 0x9e3779b97f4a7c15;
+    uint64_t z = x;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    g = z ^ (z >> 31);
+  }
+  return gear;
+}
+constexpr auto kGear = MakeGear();
+
+// `bits` ones in the high bits of the hash, which depend on the most bytes
+uint64_t Mask(int bits) { return ~uint64_t{0} << (64 - bits); }
+};  // namespace
+
+Chunker::Chunker(const ChunkerOptions &opts) : opts_(opts) {
+  int bits = 0;
+  while ((size_t{1} << (bits + 1)) <= opts_.avg_size) bits++;
+  opts_.min_size = std::min(opts_.min_size, opts_.avg_size);
+  opts_.max_size = std::max(opts_.max_size, opts_.avg_size);
+  mask_small_ = Mask(bits + 2);
+  mask_large_ = Mask(std::max(bits - 2, 1));
+}
+
+size_t Chunker::Next(const char *data, size_t size) const {
+  if (size <= opts_.min_size) return size;
+
+  auto n = std::min(size, opts_.max_size);
+  auto normal = std::min(n, opts_.avg_size);
+  auto p = reinterpret_cast<const uint8_t *>(data);
+
+  // no cut point before min_size, so the hash starts there
+  uint64_t h = 0;
+  size_t i = opts_.min_size;
+  for (; i < normal; i++) {
+    h = (h << 1) + kGear[p[i]];
+    if (!(h & mask_small_)) return i + 1;
+  }
+  for (; i < n; i++) {
+    h = (h << 1) + kGear[p[i]];
+    if (!(h & mask_large_)) return i + 1;
+  }
+  return n;
+}
+
+std::string Sha256(const char *data, size_t size) {
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  EVP_Digest(data, size, md, &len, EVP_sha256(), nullptr);
+
+  static const char digits[] = "0123456789abcdef";
+  std::string hex;
+  for (unsigned i = 0; i < len; i++) {
+    hex.push_back(digits[md[i] >> 4]);
+    hex.push_back(digits[md[i] & 15]);
+  }
+  return hex;
+}
+};  // namespace bolo_store
@@ -0,0 +1,352 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <thread>
+
+#include "lib/jsonlib.h"
+#include "store.h"
+#include "thread_pool.h"
+
+namespace bolo_store {
+using namespace bolo;
+using namespace std::string_literals;
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+// found by the json library through the namespace of Entry
+void to_json(json &j, const Entry &e) {
+  j = json{{"path", e.path},
+           {"type", e.type == fs::file_type::directory ? "dir" : "file"},
+           {"perms", static_cast<unsigned>(e.perms)},
+           {"size", e.size},
+           {"mtime", e.mtime},
+           {"mtime_nsec", e.mtime_nsec},
+           {"inode", e.inode},
+           {"chunks", e.chunks}};
+}
+
+void from_json(const json &j, Entry &e) {
+  j.at("path").get_to(e.path);
+  e.type = j.at("type") == "dir" ? fs::file_type::directory : fs::file_type::regular;
+  e.perms = static_cast<fs::perms>(j.at("perms").get<unsigned>());
+  j.at("size").get_to(e.size);
+  j.at("mtime").get_to(e.mtime);
+  // written by version 1 without them: such entries are read again by the next snapshot
+  e.mtime_nsec = j.value("mtime_nsec", int64_t{0});
+  e.inode = j.value("inode", uint64_t{0});
+  j.at("chunks").get_to(e.chunks);
+}
+
+namespace {
+constexpr int kManifestVersion = 2;
+
+bool ByPath(const Entry &a, const Entry &b) { return a.path < b.path; }
+
+// stat `p` and chunk its data into `store`, unless it is unchanged since `base`
+Result<Entry, std::string> ScanEntry(const fs::path &p, const fs::path &relative_dir,
+                                     const ChunkStore &store, const Chunker &chunker,
+                                     const Manifest *base) {
+  struct stat st;
+  if (::stat(p.c_str(), &st) != 0)
+    return Err("cannot stat "s + p.string() + ": " + strerror(errno));
+
+  Entry e;
+  e.path = p.lexically_relative(relative_dir).string();
+  e.perms = static_cast<fs::perms>(st.st_mode & 07777);
+  e.mtime = st.st_mtim.tv_sec;
+  e.mtime_nsec = st.st_mtim.tv_nsec;
+  e.inode = st.st_ino;
+  if (S_ISDIR(st.st_mode)) {
+    e.type = fs::file_type::directory;
+    e.path += "/";
+    return Ok(std::move(e));
+  }
+  if (!S_ISREG(st.st_mode)) return Err("Unsupported file type: "s + p.string());
+  e.type = fs::file_type::regular;
+  e.size = st.st_size;
+
+  if (auto old = base ? base->Find(e.path) : nullptr; old && old->Unchanged(e)) {
+    e.chunks = old->chunks;
+    return Ok(std::move(e));
+  }
+
+  std::ifstream ifs(p, std::ios_base::binary);
+  if (!ifs) return Err("failed to open "s + p.string());
+
+  // the chunker is given max_size bytes at a time unless the file ends
+  auto max_size = chunker.options().max_size;
+  std::vector<char> buf(std::min<uint64_t>(e.size + 1, std::max<size_t>(4 << 20, 2 * max_size)));
+  size_t begin = 0, end = 0;
+  uint64_t total = 0;
+  bool eof = false;
+  while (true) {
+    if (!eof && end - begin < max_size) {
+      std::memmove(buf.data(), buf.data() + begin, end - begin);
+      end -= begin;
+      begin = 0;
+      ifs.read(buf.data() + end, buf.size() - end);
+      eof = static_cast<size_t>(ifs.gcount()) < buf.size() - end;
+      end += ifs.gcount();
+    }
+    if (begin == end) break;
+
+    auto n = chunker.Next(buf.data() + begin, end - begin);
+    auto hash = store.Put(buf.data() + begin, n);
+    if (!hash) return Err(hash.error());
+    e.chunks.push_back(std::move(hash.value()));
+    begin += n;
+    total += n;
+  }
+
+  if (ifs.bad() || total != e.size)
+    return Err("file changed while being backed up: "s + p.string());
+  return Ok(std::move(e));
+}
+
+// scan `paths` on `threads` workers; the entries are sorted by path
+Result<std::vector<Entry>, std::string> ScanEntries(const std::vector<fs::path> &paths,
+                                                    const fs::path &relative_dir,
+                                                    const ChunkStore &store,
+                                                    const Chunker &chunker, size_t threads,
+                                                    const Manifest *base) {
+  // one task per entry; the results are taken in order, so no worker waits for another.
+  // submitter thread -> worker pool -> this thread, with a bounded number of tasks in flight
+  std::vector<Entry> entries;
+  std::string error;
+  {
+    ThreadPool pool(threads);
+    OrderedQueue<Result<Entry, std::string>> queue(threads * 4);
+
+    std::thread submitter([&] {
+      for (auto &p : paths) {
+        auto f = pool.Submit([&, p] { return ScanEntry(p, relative_dir, store, chunker, base); });
+        if (!queue.Push(std::move(f))) break;
+      }
+      queue.Close();
+    });
+
+    std::future<Result<Entry, std::string>> f;
+    while (queue.Pop(f)) {
+      auto e = f.get();
+      if (!e) {
+        error = e.error();
+        break;
+      }
+      entries.push_back(std::move(e.value()));
+    }
+    queue.Close();
+    submitter.join();
+  }
+  if (!error.empty()) return Err(error);
+
+  std::sort(entries.begin(), entries.end(), ByPath);
+  return Ok(std::move(entries));
+}
+};  // namespace
+
+void Manifest::Chunks(std::unordered_set<std::string> &out) const {
+  for (auto &e : entries) out.insert(e.chunks.begin(), e.chunks.end());
+}
+
+const Entry *Manifest::Find(const std::string &path) const {
+  Entry key;
+  key.path = path;
+  auto it = std::lower_bound(entries.begin(), entries.end(), key, ByPath);
+  return it != entries.end() && it->path == path ? &*it : nullptr;
+}
+
+Manifest Manifest::Delta(const Manifest &from, const Manifest &to) {
+  Manifest layer;
+  auto a = from.entries.begin(), b = to.entries.begin();
+  while (a != from.entries.end() || b != to.entries.end()) {
+    if (b == to.entries.end() || (a != from.entries.end() && a->path < b->path)) {
+      layer.removed.push_back((a++)->path);
+    } else if (a == from.entries.end() || b->path < a->path) {
+      layer.entries.push_back(*b++);
+    } else {
+      if (!(*a == *b)) layer.entries.push_back(*b);
+      a++, b++;
+    }
+  }
+  return layer;
+}
+
+void Manifest::Apply(const Manifest &layer) {
+  std::vector<Entry> merged;
+  merged.reserve(entries.size() + layer.entries.size());
+  // entries of the layer win over the ones of the same path
+  std::set_union(layer.entries.begin(), layer.entries.end(), entries.begin(), entries.end(),
+                 std::back_inserter(merged), ByPath);
+  merged.erase(std::remove_if(merged.begin(), merged.end(),
+                              [&](const Entry &e) {
+                                return std::binary_search(layer.removed.begin(),
+                                                          layer.removed.end(), e.path);
+                              }),
+               merged.end());
+  entries = std::move(merged);
+}
+
+Result<Manifest, std::string> Manifest::Load(const fs::path &path) try {
+  std::ifstream ifs(path);
+  if (!ifs) return Err("failed to open "s + path.string());
+
+  json j;
+  ifs >> j;
+  if (j.at("version").get<int>() > kManifestVersion)
+    return Err("unsupported manifest version of "s + path.string());
+
+  Manifest m;
+  j.at("entries").get_to(m.entries);
+  m.removed = j.value("removed", std::vector<std::string>{});
+  return Ok(std::move(m));
+} catch (const json::exception &e) {
+  return Err("broken manifest "s + path.string() + ": " + e.what());
+}
+
+Insidious<std::string> Manifest::Save(const fs::path &path) const {
+  auto part = path.string() + ".part";
+  {
+    std::ofstream ofs(part, std::ios_base::trunc);
+    if (!ofs) return Danger("failed to open "s + part);
+    ofs << json{{"version", kManifestVersion}, {"entries", entries}, {"removed", removed}};
+    if (!ofs) return Danger("failed to write "s + part);
+  }
+
+  std::error_code ec;
+  fs::rename(part, path, ec);
+  if (ec) return Danger("failed to rename "s + part + ": " + ec.message());
+  return Safe;
+}
+
+Result<Manifest, std::string> Snapshot(const fs::path &path, const ChunkStore &store,
+                                       const Chunker &chunker, size_t threads,
+                                       const Manifest *base) try {
+  auto relative_dir = path.parent_path();
+
+  std::vector<fs::path> paths{path};
+  if (fs::is_directory(path))
+    for (auto &e : fs::recursive_directory_iterator(path)) paths.push_back(e.path());
+
+  auto entries = ScanEntries(paths, relative_dir, store, chunker, threads, base);
+  if (!entries) return Err(entries.error());
+
+  Manifest m;
+  m.entries = std::move(entries.value());
+  return Ok(std::move(m));
+} catch (const fs::filesystem_error &e) {
+  return Err("filesystem error: "s + e.what());
+}
+
+Result<Manifest, std::string> Patch(const fs::path &path, const std::vector<fs::path> &changed,
+                                    const Manifest &base, const ChunkStore &store,
+                                    const Chunker &chunker, size_t threads) try {
+  auto root = path.lexically_normal();
+  auto relative_dir = root.parent_path();
+
+  // the changed paths, with everything under them, and their parent directories alone
+  std::map<fs::path, bool> targets;  // path -> recursive
+  for (auto &c : changed) {
+    auto p = c.lexically_normal();
+    if (!p.has_filename()) p = p.parent_path();
+    auto rel = p.lexically_relative(root);
+    if (rel.empty() || *rel.begin() == "..") continue;
+    targets[p] = true;
+    if (p != root) targets.emplace(p.parent_path(), false);
+  }
+
+  std::set<fs::path> paths;
+  for (auto &[p, recursive] : targets) {
+    if (!fs::exists(fs::symlink_status(p))) continue;
+    paths.insert(p);
+    if (recursive && fs::is_directory(p))
+      for (auto &e : fs::recursive_directory_iterator(p)) paths.insert(e.path());
+  }
+
+  auto entries = ScanEntries({paths.begin(), paths.end()}, relative_dir, store, chunker, threads,
+                             &base);
+  if (!entries) return Err(entries.error());
+  Manifest now;
+  now.entries = std::move(entries.value());
+
+  Manifest layer;
+  for (auto &e : now.entries) {
+    auto old = base.Find(e.path);
+    if (!old || !(*old == e)) layer.entries.push_back(e);
+  }
+
+  // the entries of the targets that are gone; a file may have become a directory
+  auto gone = [&](const Entry &e) {
+    if (now.Find(e.path) == nullptr) layer.removed.push_back(e.path);
+  };
+  for (auto &[p, recursive] : targets) {
+    auto name = p.lexically_relative(relative_dir).string();
+    if (auto e = base.Find(name)) gone(*e);
+    auto dir = name + "/";
+    Entry key;
+    key.path = dir;
+    for (auto it = std::lower_bound(base.entries.begin(), base.entries.end(), key, ByPath);
+         it != base.entries.end() && it->path.compare(0, dir.size(), dir) == 0; it++) {
+      if (!recursive && it->path != dir) break;
+      gone(*it);
+    }
+  }
+  std::sort(layer.removed.begin(), layer.removed.end());
+  layer.removed.erase(std::unique(layer.removed.begin(), layer.removed.end()),
+                      layer.removed.end());
+  return Ok(std::move(layer));
+} catch (const fs::filesystem_error &e) {
+  return Err("filesystem error: "s + e.what());
+}
+
+Insidious<std::string> Restore(const Manifest &manifest, const ChunkStore &store,
+                               const fs::path &dir,
+                               const std::function<bool(const Entry &)> &filter) try {
+  std::vector<const Entry *> dirs;
+  for (auto &e : manifest.entries) {
+    if (!filter(e)) continue;
+
+    // a manifest of another store may try to leave `dir`
+    fs::path name(e.path);
+    if (name.is_absolute() || std::find(name.begin(), name.end(), "..") != name.end())
+      return Danger("unsafe path in manifest: "s + e.path);
+
+    auto path = dir / name;
+    if (e.type == fs::file_type::directory) {
+      fs::create_directories(path);
+      dirs.push_back(&e);
+      continue;
+    }
+
+    fs::create_directories(path.parent_path());
+    std::ofstream ofs(path, std::ios_base::binary | std::ios_base::trunc);
+    if (!ofs) return Danger("failed to open: "s + path.string());
+    for (auto &hash : e.chunks) {
+      auto data = store.Get(hash);
+      if (!data) return Danger(data.error());
+      ofs.write(data.value().data(), data.value().size());
+    }
+    ofs.close();
+    if (!ofs) return Danger("failed to write to "s + path.string());
+
+    // the access time is left as it is
+    struct timespec times[2] = {{0, UTIME_OMIT}, {static_cast<time_t>(e.mtime), e.mtime_nsec}};
+    if (::utimensat(AT_FDCWD, path.c_str(), times, 0) != 0)
+      return Danger("failed to set the modification time of "s + path.string());
+    fs::permissions(path, e.perms);
+  }
+
+  // the permissions of directories last, they may not allow to write into them
+  for (auto it = dirs.rbegin(); it != dirs.rend(); it++)
+    fs::permissions(dir / (*it)->path, (*it)->perms);
+  return Safe;
+} catch (const fs::filesystem_error &e) {
+  return Danger("filesystem error: "s + e.what());
+}
+};  // namespace bolo_store
@@ -1,12 +1,21 @@
 #include "tar.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
 #include <algorithm>
+#include <cerrno>
+#include <charconv>
 #include <cstring>
+#include <functional>
 #include <iostream>
 #include <system_error>
+#include <thread>
 #include <type_traits>
+#include <unordered_map>
 
 #include "result.h"
+#include "thread_pool.h"
 
 namespace bolo_tar {
 
@@ -15,31 +24,65 @@ using namespace std::string_literals;
 namespace fs = std::filesystem;
 
 Result<std::shared_ptr<Tar>, std::string> Tar::Open(const fs::path &path) {
-  std::fstream fs(path, std::ios_base::in | std::ios_base::app | std::ios_base::out);
+  // not opened for appending: new entries are written over the end-of-archive blocks
+  std::error_code ec;
+  if (!fs::exists(path, ec)) std::ofstream(path, std::ios_base::binary);
+  auto fs = std::make_unique<std::fstream>(
+      path, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
 
-  if (!fs) return Err("failed to open "s + path.string());
+  if (!*fs) return Err("failed to open "s + path.string());
 
-  return Ok(std::shared_ptr<Tar>(new Tar(std::move(fs))));
+  auto p = fs.get();
+  return Ok(std::shared_ptr<Tar>(new Tar(std::move(fs), p, p)));
 }
 
-Insidious<std::string> Tar::Write() {
-  fs_.flush();
-  if (!fs_) return Danger("failed to flush"s);
-  return Safe;
+std::shared_ptr<Tar> Tar::Writer(std::ostream &out) {
+  return std::shared_ptr<Tar>(new Tar(nullptr, nullptr, &out));
+}
+
+std::shared_ptr<Tar> Tar::Reader(std::istream &in) {
+  return std::shared_ptr<Tar>(new Tar(nullptr, &in, nullptr));
+}
+
+char *Tar::Buffer() {
+  if (buf_ == nullptr)
+    buf_.reset(static_cast<char *>(std::aligned_alloc(kBufferAlignment, kBufferSize)));
+  if (buf_ == nullptr) throw std::bad_alloc();
+  return buf_.get();
+}
+
+void Tar::Skip(std::streamoff n) {
+  // a plain stream (e.g. a pipe) cannot seek
+  if (file_ != nullptr)
+    in_->seekg(n, std::ios_base::cur);
+  else
+    in_->ignore(n);
 }
 
 namespace {
 /*
+    POSIX ustar header:
+
     Field offset	Field size	Field
     0	    100	File name
-    100	  8	File mode
-    108	  8	Owner's numeric user ID
-    116	  8	Group's numeric user ID
-    124	  12	File size in bytes (octal base)
+    100	  8	File mode (octal)
+    108	  8	Owner's numeric user ID (octal)
+    116	  8	Group's numeric user ID (octal)
+    124	  12	File size in bytes (octal)
     136	  12	Last modification time in numeric Unix time format (octal)
     148	  8	Checksum for header record
-    156	  1	Link indicator (file type)
+    156	  1	Type flag
     157	  100	Name of linked file
+    257	  6	"ustar\0"
+    263	  2	"00"
+    265	  32	Owner user name
+    297	  32	Owner group name
+    329	  8	Device major number
+    337	  8	Device minor number
+    345	  155	Filename prefix
+
+    A PAX extended header (type 'x') before a ustar header holds the fields that do not fit in
+    it as "length key=value\n" records. The archive ends with two zero blocks.
 */
 #pragma pack(push)
 #pragma pack(1)
@@ -56,195 +99,727 @@ struct TarHeader {
       char file_size[12] = {0};               // octal base
       char last_modification_time[12] = {0};  // octal
       char checksum[8] = {0};
-      char filetype[1] = {0};  // '0': normal file, '1': otherwise
+      char filetype[1] = {0};
       char linked_file[100] = {0};
+      char magic[6] = {0};  // "ustar\0"; zeros in the headers bolo wrote before ustar
+      char version[2] = {0};
+      char owner_name[32] = {0};
+      char group_name[32] = {0};
+      char dev_major[8] = {0};
+      char dev_minor[8] = {0};
+      char prefix[155] = {0};
     };
   };
 
   TarHeader() { std::memset(this, 0, sizeof(TarHeader)); }
 
-  static std::unique_ptr<TarHeader> CreateHeader(const std::string &filename, int file_size,
-                                                 fs::perms perms, fs::file_type type) {
-    auto size_s = std::to_string(file_size);
-    auto perms_s = std::to_string(static_cast<unsigned>(perms));
-    if (filename.length() + 1 > sizeof(TarHeader::filename)) return nullptr;
-    if (size_s.size() + 1 > sizeof(TarHeader::file_size)) return nullptr;
-    if (perms_s.size() + 1 > sizeof(TarHeader::filemode)) return nullptr;
+  bool zero() const {
+    return std::all_of(_, _ + FileAlignment, [](char c) { return c == '\0'; });
+  }
 
-    auto header = std::make_unique<TarHeader>();
-    std::strncpy(header->file_size, size_s.c_str(), sizeof(TarHeader::file_size));
-    std::strncpy(header->filename, filename.c_str(), sizeof(TarHeader::filename));
-    std::strncpy(header->filemode, perms_s.c_str(), sizeof(TarHeader::filemode));
-    header->filetype[0] = type == fs::file_type::regular ? '0' : '1';
+  // GNU tar writes "ustar  \0"
+  bool ustar() const { return std::memcmp(magic, "ustar", 5) == 0; }
 
-    return header;
+  std::string name() const {
+    std::string name(filename, strnlen(filename, sizeof filename));
+    if (ustar() && prefix[0] != '\0')
+      name = std::string(prefix, strnlen(prefix, sizeof prefix)) + "/" + name;
+    return name;
   }
 
-  std::string file_name() const { return filename; }
-
-  fs::file_type file_type() const {
-    return filetype[0] == '0' ? fs::file_type::regular : fs::file_type::directory;
+  // the sum of the header bytes, with the checksum field taken as spaces
+  uint32_t sum() const {
+    uint32_t s = 0;
+    for (auto c : _) s += static_cast<uint8_t>(c);
+    for (auto c : checksum) s += ' ' - static_cast<uint8_t>(c);
+    return s;
   }
+};
+#pragma pack(pop)
+static_assert(sizeof(TarHeader) == FileAlignment, "tar header size");
+
+// PAX and GNU long name headers larger than this are not read
+constexpr uint64_t kMaxExtendedHeader = 1 << 20;
+
+uint64_t Padded(uint64_t n) { return (n + FileAlignment - 1) / FileAlignment * FileAlignment; }
 
-  Maybe<fs::perms> perms() const {
-    try {
-      return Just(static_cast<fs::perms>(std::stoul(filemode)));
-    } catch (...) {
-      return Nothing;
+// `v` as `n - 1` octal digits and a NUL; false if it does not fit
+template <size_t n>
+bool PutOctal(char (&field)[n], uint64_t v) {
+  for (size_t i = n - 1; i-- > 0; v >>= 3) field[i] = static_cast<char>('0' + (v & 7));
+  field[n - 1] = '\0';
+  return v == 0;
+}
+
+// an octal number padded with spaces or NULs, or a base-256 one (GNU) if the high bit of the
+// first byte is set; an empty field is 0
+template <size_t n>
+Maybe<uint64_t> GetOctal(const char (&field)[n]) {
+  uint64_t v = 0;
+  if (static_cast<uint8_t>(field[0]) & 0x80) {
+    v = static_cast<uint8_t>(field[0]) & 0x7f;
+    for (size_t i = 1; i < n; i++) {
+      if (v >> 56) return Nothing;
+      v = v << 8 | static_cast<uint8_t>(field[i]);
     }
+    return Just(v);
   }
 
-  Maybe<int> filesize() const {
-    try {
-      return Just(std::stoi(file_size));
-    } catch (...) {
-      return Nothing;
+  size_t i = 0;
+  while (i < n && field[i] == ' ') i++;
+  for (; i < n && field[i] >= '0' && field[i] <= '7'; i++) {
+    if (v >> 61) return Nothing;
+    v = v << 3 | static_cast<uint64_t>(field[i] - '0');
+  }
+  if (i < n && field[i] != ' ' && field[i] != '\0') return Nothing;
+  return Just(v);
+}
+
+// a decimal number of a PAX record; fractions of a second are dropped
+template <typename T>
+bool GetDecimal(const std::string &s, T &v) {
+  auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), v);
+  return ec == std::errc{} && end != s.data() && (end == s.data() + s.size() || *end == '.');
+}
+
+// one "length key=value\n" record of a PAX header; the length counts its own digits
+std::string PaxRecord(const std::string &key, const std::string &value) {
+  auto n = key.size() + value.size() + 3;  // ' ', '=' and '\n'
+  auto len = n + 1;
+  while (len != n + std::to_string(len).size()) len = n + std::to_string(len).size();
+  return std::to_string(len) + " " + key + "=" + value + "\n";
+}
+
+bool ParsePax(const std::string &data, std::unordered_map<std::string, std::string> &records) {
+  for (size_t pos = 0; pos < data.size();) {
+    size_t len;
+    auto [end, ec] = std::from_chars(data.data() + pos, data.data() + data.size(), len);
+    if (ec != std::errc{} || *end != ' ' || len == 0 || len > data.size() - pos) return false;
+
+    std::string record(end + 1, data.data() + pos + len);
+    auto eq = record.find('=');
+    if (eq == std::string::npos || record.back() != '\n') return false;
+    records[record.substr(0, eq)] = record.substr(eq + 1, record.size() - eq - 2);
+    pos += len;
+  }
+  return true;
+}
+
+void Seal(TarHeader &h) {
+  std::memcpy(h.magic, "ustar", 6);
+  std::memcpy(h.version, "00", 2);
+  PutOctal(h.checksum, h.sum());
+  h.checksum[7] = ' ';
+}
+
+// the headers of `f`: a ustar header, preceded by a PAX header if some field does not fit
+std::string EncodeHeaders(const Tar::TarFile &f) {
+  TarHeader h;
+  std::string pax;
+
+  // a long name is split at a '/' into prefix and name, or else kept in the PAX header
+  auto &name = f.filename;
+  if (name.size() <= sizeof h.filename) {
+    std::memcpy(h.filename, name.data(), name.size());
+  } else {
+    auto slash = name.find('/', name.size() - sizeof h.filename - 1);
+    if (slash != std::string::npos && slash <= sizeof h.prefix && slash + 1 < name.size()) {
+      std::memcpy(h.prefix, name.data(), slash);
+      std::memcpy(h.filename, name.data() + slash + 1, name.size() - slash - 1);
+    } else {
+      pax += PaxRecord("path", name);
+      std::memcpy(h.filename, name.data(), sizeof h.filename);
     }
   }
-};
-#pragma pack(pop)
-static_assert(sizeof(TarHeader) == FileAlignment, "tar header size");
-};  // namespace
 
-Insidious<std::string> Tar::AppendFile(const std::filesystem::path &path,
-                                       const fs::path &relative_dir) {
-  // header
-  auto header =
-      TarHeader::CreateHeader(path.lexically_relative(relative_dir).string(), fs::file_size(path),
-                              fs::status(path).permissions(), fs::file_type::regular);
-  if (header == nullptr) return Danger("failed to create file header"s);
-  fs_.write(reinterpret_cast<const char *>(header.get()), FileAlignment);
+  PutOctal(h.filemode, static_cast<uint64_t>(f.perms) & 07777);
+  if (!PutOctal(h.owner_id, f.uid)) pax += PaxRecord("uid", std::to_string(f.uid));
+  if (!PutOctal(h.group_id, f.gid)) pax += PaxRecord("gid", std::to_string(f.gid));
+  if (!PutOctal(h.file_size, f.size)) {
+    pax += PaxRecord("size", std::to_string(f.size));
+    PutOctal(h.file_size, 0);
+  }
+  if (f.mtime < 0 || !PutOctal(h.last_modification_time, f.mtime)) {
+    pax += PaxRecord("mtime", std::to_string(f.mtime));
+    PutOctal(h.last_modification_time, 0);
+  }
+  h.filetype[0] = f.type == fs::file_type::directory ? '5' : '0';
+  Seal(h);
+
+  std::string out;
+  if (!pax.empty()) {
+    TarHeader x;
+    auto base = "PaxHeader/"s + fs::path(name).filename().string();
+    std::memcpy(x.filename, base.data(), std::min(base.size(), sizeof x.filename));
+    PutOctal(x.filemode, 0644);
+    PutOctal(x.file_size, pax.size());
+    std::memcpy(x.last_modification_time, h.last_modification_time,
+                sizeof x.last_modification_time);
+    x.filetype[0] = 'x';
+    Seal(x);
+
+    out.append(reinterpret_cast<const char *>(&x), FileAlignment);
+    out += pax;
+    out.resize(Padded(out.size()));
+  }
+  out.append(reinterpret_cast<const char *>(&h), FileAlignment);
+  return out;
+}
 
-  std::ifstream ifs(path);
-  if (!ifs) return Danger("failed to open "s + path.string());
+// the header fields of `path`, with one stat call
+Tar::TarFile Stat(const fs::path &path) {
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0)
+    throw fs::filesystem_error("cannot stat", path,
+                               std::error_code(errno, std::generic_category()));
+
+  Tar::TarFile f;
+  f.type = S_ISREG(st.st_mode)   ? fs::file_type::regular
+           : S_ISDIR(st.st_mode) ? fs::file_type::directory
+                                 : fs::file_type::unknown;
+  f.perms = static_cast<fs::perms>(st.st_mode & 07777);
+  f.size = f.type == fs::file_type::regular ? st.st_size : 0;
+  f.mtime = st.st_mtime;
+  f.uid = st.st_uid;
+  f.gid = st.st_gid;
+  return f;
+}
 
-  // Copy file content
-  while (ifs.good() && fs_.good()) {
-    char buf[FileAlignment] = {0};
-    ifs.read(buf, FileAlignment);
-    if (ifs.gcount() == 0) break;
+// names in the tar are relative to `relative_dir`, directories end with '/'
+std::string EntryName(const fs::path &path, const fs::path &relative_dir, fs::file_type type) {
+  auto name = path.lexically_relative(relative_dir).string();
+  return type == fs::file_type::directory ? name + "/" : name;
+}
 
-    fs_.write(buf, FileAlignment);
+// files up to this size are read ahead by the workers of the parallel archiver
+constexpr uintmax_t kPrefetchLimit = 1 << 20;
+
+std::vector<fs::directory_entry> ListDirectory(const fs::path &dir, bool sorted) {
+  std::vector<fs::directory_entry> children(fs::directory_iterator(dir), {});
+  if (sorted) std::sort(children.begin(), children.end());
+  return children;
+}
+};  // namespace
+
+uint64_t Tar::TarFile::end() const { return data_offset + Padded(size); }
+
+struct Tar::Record {
+  fs::path path;
+  TarFile file;         // as stat'ed, without the name
+  bool loaded = false;  // `data` holds the content of a regular file
+  std::string data;
+};
+
+Insidious<std::string> Tar::Write() {
+  if (out_ == nullptr) return Danger("tar is not writable"s);
+
+  // end the archive; an opened file gets the end only if something was appended, and the next
+  // Append writes over it
+  static const char zeros[2 * FileAlignment] = {0};
+  if (file_ == nullptr || !index_.empty()) {
+    if (file_ != nullptr) file_->seekp(offset_);
+    out_->write(zeros, sizeof zeros);
   }
 
-  if (!fs_.good()) return Danger("failed to write to output file"s);
-  if (!ifs.eof()) return Danger("failed to read from input file"s);
+  out_->flush();
+  if (!*out_) return Danger("failed to flush"s);
+  return Safe;
+}
+
+void Tar::Put(const char *data, size_t n) {
+  out_->write(data, n);
+  offset_ += n;
+}
+
+Insidious<std::string> Tar::PutHeader(TarFile f) {
+  auto headers = EncodeHeaders(f);
+  f.offset = offset_;
+  f.data_offset = offset_ + headers.size();
+  Put(headers.data(), headers.size());
+  if (!out_->good()) return Danger("failed to write the header of "s + f.filename);
 
+  index_.push_back(std::move(f));
+  return Safe;
+}
+
+Insidious<std::string> Tar::AppendFile(const std::filesystem::path &path, const TarFile &f) {
+  if (auto ins = PutHeader(f)) return ins;
+
+  std::ifstream ifs(path, std::ios_base::binary);
+  if (!ifs) return Danger("failed to open "s + path.string());
+
+  // Copy exactly the `size` bytes promised by the header, padded to the alignment.
+  // Reads and writes this large bypass the stream buffers.
+  auto buf = Buffer();
+  for (uint64_t left = f.size; left > 0 && out_->good();) {
+    auto n = static_cast<size_t>(std::min<uint64_t>(left, kBufferSize));
+    ifs.read(buf, n);
+    if (static_cast<size_t>(ifs.gcount()) != n)
+      return Danger("file changed while being archived: "s + path.string());
+    left -= n;
+
+    auto padded = Padded(n);
+    std::memset(buf + n, 0, padded - n);
+    Put(buf, padded);
+  }
+
+  if (!out_->good()) return Danger("failed to write to output file"s);
   return Safe;
 }
 
 Insidious<std::string> Tar::AppendDirectory(const std::filesystem::path &path,
-                                            const fs::path &relative_dir) {
+                                            const fs::path &relative_dir, const TarFile &f,
+                                            bool sorted) {
   // directory header
-  auto header = TarHeader::CreateHeader(path.lexically_relative(relative_dir).string() + "/", 0,
-                                        fs::status(path).permissions(), fs::file_type::directory);
-  if (header == nullptr) return Danger("failed to create file header"s);
-  fs_.write(reinterpret_cast<const char *>(header.get()), FileAlignment);
+  auto ins = PutHeader(f);
 
-  auto ins = fs_.good() ? Insidious<std::string>(Safe)
-                        : Danger("failed to write directory header: "s + path.string());
-
-  for (auto &p : fs::directory_iterator(path)) {
+  for (auto &p : ListDirectory(path, sorted)) {
     if (ins) break;
-    ins = AppendImpl(p, relative_dir);
+    ins = AppendImpl(p, relative_dir, sorted);
   }
   return ins;
 }
 
-Insidious<std::string> Tar::AppendImpl(const fs::path &path, const fs::path &relative_dir) {
+Insidious<std::string> Tar::AppendImpl(const fs::path &path, const fs::path &relative_dir,
+                                       bool sorted) {
   if (!fs::exists(path)) return Danger("file: `" + path.string() + "` does not exists"s);
 
-  if (fs::is_regular_file(path))
-    return AppendFile(path, relative_dir);
-  else if (fs::is_directory(path))
-    return AppendDirectory(path, relative_dir);
+  auto f = Stat(path);
+  f.filename = EntryName(path, relative_dir, f.type);
+  if (f.type == fs::file_type::regular)
+    return AppendFile(path, f);
+  else if (f.type == fs::file_type::directory)
+    return AppendDirectory(path, relative_dir, f, sorted);
   else
-    return Danger("Unsupported file type: "s +
-                  std::to_string(static_cast<unsigned>(fs::status(path).type())));
+    return Danger("Unsupported file type: "s + path.string());
 }
 
-Insidious<std::string> Tar::Append(const fs::path &path) try {
-  return AppendImpl(path, path.parent_path());
+Insidious<std::string> Tar::WriteRecord(const Record &r, const fs::path &relative_dir) {
+  auto f = r.file;
+  f.filename = EntryName(r.path, relative_dir, f.type);
+  if (f.type == fs::file_type::directory) return PutHeader(f);
+
+  if (f.type != fs::file_type::regular)
+    return Danger("Unsupported file type: "s + r.path.string());
+
+  // large files are streamed by the writer itself
+  if (!r.loaded) return AppendFile(r.path, f);
+
+  if (auto ins = PutHeader(f)) return ins;
+
+  static const char zeros[FileAlignment] = {0};
+  Put(r.data.data(), r.data.size());
+  Put(zeros, (FileAlignment - r.data.size() % FileAlignment) % FileAlignment);
+  if (!out_->good()) return Danger("failed to write to output file"s);
+  return Safe;
+}
+
+/*
+ * walker thread -> worker pool -> ordered writer (this thread)
+ *
+ * The walker visits the tree in the order of the serial archiver. Each directory it enters has
+ * the listings of all its subdirectories requested from the pool at once, so the walk runs
+ * ahead of the writer, and every entry it visits is queued as a stat-and-read task. The writer
+ * takes the finished records in the order they were queued.
+ */
+Insidious<std::string> Tar::AppendParallel(const fs::path &path, const fs::path &relative_dir,
+                                           const AppendOptions &opts) {
+  using Listing = Result<std::vector<fs::directory_entry>, std::string>;
+  using Entry = Result<Record, std::string>;
+
+  ThreadPool pool(opts.threads);
+  OrderedQueue<Entry> queue(opts.threads * 4);
+
+  auto list = [&pool, sorted = opts.sorted](const fs::path &dir) {
+    return pool.Submit([dir, sorted]() -> Listing {
+      try {
+        return Ok(ListDirectory(dir, sorted));
+      } catch (const fs::filesystem_error &e) {
+        return Err("filesystem: "s + e.what());
+      }
+    });
+  };
+
+  auto stat = [&pool](const fs::path &p) {
+    return pool.Submit([p]() -> Entry {
+      try {
+        Record r{p, Stat(p), false, {}};
+        if (r.file.type != fs::file_type::regular || r.file.size > kPrefetchLimit)
+          return Ok(std::move(r));
+
+        std::ifstream ifs(p, std::ios_base::binary);
+        if (!ifs) return Err("failed to open "s + p.string());
+        r.data.resize(r.file.size);
+        ifs.read(r.data.data(), r.data.size());
+        if (static_cast<uint64_t>(ifs.gcount()) != r.file.size)
+          return Err("file changed while being archived: "s + p.string());
+        r.loaded = true;
+        return Ok(std::move(r));
+      } catch (const fs::filesystem_error &e) {
+        return Err("filesystem: "s + e.what());
+      }
+    });
+  };
+
+  // returns false once the writer has stopped
+  std::function<bool(std::future<Listing>)> walk = [&](std::future<Listing> listing) {
+    auto children = listing.get();
+    if (!children) {
+      auto error = children.error();
+      return queue.Push(pool.Submit([error]() -> Entry { return Err(error); }));
+    }
+
+    // request the listings of all subdirectories now, they are walked in order below
+    std::vector<std::future<Listing>> subdirs;
+    for (auto &c : children.value()) {
+      std::error_code ec;
+      subdirs.emplace_back(c.is_directory(ec) ? list(c.path()) : std::future<Listing>{});
+    }
+
+    for (size_t i = 0; i < subdirs.size(); i++) {
+      if (!queue.Push(stat(children.value()[i].path()))) return false;
+      if (subdirs[i].valid() && !walk(std::move(subdirs[i]))) return false;
+    }
+    return true;
+  };
+
+  std::thread walker([&] {
+    std::error_code ec;
+    if (queue.Push(stat(path)) && fs::is_directory(path, ec)) walk(list(path));
+    queue.Close();
+  });
+
+  Insidious<std::string> ins = Safe;
+  std::future<Entry> f;
+  while (!ins && queue.Pop(f)) {
+    auto r = f.get();
+    ins = r ? WriteRecord(r.value(), relative_dir) : Danger(r.error());
+  }
+  queue.Close();
+  walker.join();
+  return ins;
+}
+
+Insidious<std::string> Tar::Append(const fs::path &path, const AppendOptions &opts) try {
+  if (out_ == nullptr) return Danger("tar is not writable"s);
+  if (file_ != nullptr) {
+    // entries go after the last one of an opened archive, over its end
+    if (index_.empty()) {
+      auto files = List();
+      if (!files) return Danger(files.error());
+      offset_ = files.value().empty() ? 0 : files.value().back().end();
+    }
+    file_->clear();
+    file_->seekp(offset_);
+  }
+  if (opts.threads <= 1) return AppendImpl(path, path.parent_path(), opts.sorted);
+
+  if (!fs::exists(path)) return Danger("file: `" + path.string() + "` does not exists"s);
+  return AppendParallel(path, path.parent_path(), opts);
 } catch (const fs::filesystem_error &e) {
   return Danger("filesystem: "s + e.what());
 }
 
+Insidious<std::string> Tar::ReadHeader(TarFile &f, bool &end) {
+  end = false;
+  std::unordered_map<std::string, std::string> pax;  // records of a PAX header of the entry
+  std::string long_name;                             // of a GNU long name header
+  auto pos = f.offset;
+
+  while (true) {
+    TarHeader h;
+    in_->read(reinterpret_cast<char *>(&h), FileAlignment);
+    // archives of older versions have no end blocks
+    if (in_->gcount() == 0 && in_->eof() && pos == f.offset) {
+      end = true;
+      return Safe;
+    }
+    if (in_->gcount() != FileAlignment) return Danger("unexpected end of tar"s);
+    pos += FileAlignment;
+
+    if (h.zero()) {
+      end = true;
+      return Safe;
+    }
+
+    if (!h.ustar()) {
+      // the header of older versions: decimal size and mode, '0' for files, '1' for directories
+      f.filename = h.name();
+      f.type = h.filetype[0] == '0' ? fs::file_type::regular : fs::file_type::directory;
+      f.data_offset = pos;
+      try {
+        f.size = std::stoull(std::string(h.file_size, strnlen(h.file_size, sizeof h.file_size)));
+        f.perms = static_cast<fs::perms>(
+            std::stoul(std::string(h.filemode, strnlen(h.filemode, sizeof h.filemode))));
+      } catch (...) {
+        return Danger("failed to parse the tar header of `"s + f.filename + "`");
+      }
+      return Safe;
+    }
+
+    auto checksum = GetOctal(h.checksum);
+    if (!checksum || checksum.value() != h.sum())
+      return Danger("broken tar header checksum of `"s + h.name() + "`");
+
+    auto size = GetOctal(h.file_size);
+    auto mode = GetOctal(h.filemode);
+    auto mtime = GetOctal(h.last_modification_time);
+    auto uid = GetOctal(h.owner_id);
+    auto gid = GetOctal(h.group_id);
+    if (!size || !mode || !mtime || !uid || !gid)
+      return Danger("failed to parse the tar header of `"s + h.name() + "`");
+
+    auto type = h.filetype[0];
+    if (type == 'x' || type == 'g' || type == 'L' || type == 'K') {
+      // extended headers of the next entry ('g' and the GNU long link 'K' are ignored)
+      if (size.value() > kMaxExtendedHeader) return Danger("tar extended header too large"s);
+      std::string data(Padded(size.value()), '\0');
+      in_->read(data.data(), data.size());
+      if (static_cast<size_t>(in_->gcount()) != data.size())
+        return Danger("unexpected end of tar"s);
+      pos += data.size();
+      data.resize(size.value());
+
+      if (type == 'x' && !ParsePax(data, pax)) return Danger("broken PAX header"s);
+      if (type == 'L') long_name = data.c_str();
+      continue;
+    }
+
+    f.filename = pax.count("path") ? pax["path"] : !long_name.empty() ? long_name : h.name();
+    f.size = size.value();
+    f.perms = static_cast<fs::perms>(mode.value() & 07777);
+    f.mtime = static_cast<int64_t>(mtime.value());
+    f.uid = static_cast<uint32_t>(uid.value());
+    f.gid = static_cast<uint32_t>(gid.value());
+    if ((pax.count("size") && !GetDecimal(pax["size"], f.size)) ||
+        (pax.count("mtime") && !GetDecimal(pax["mtime"], f.mtime)) ||
+        (pax.count("uid") && !GetDecimal(pax["uid"], f.uid)) ||
+        (pax.count("gid") && !GetDecimal(pax["gid"], f.gid)))
+      return Danger("broken PAX header of `"s + f.filename + "`");
+
+    if (type == '0' || type == '\0' || type == '7')
+      f.type = fs::file_type::regular;
+    else if (type == '5')
+      f.type = fs::file_type::directory;
+    else
+      return Danger("unsupported type `"s + type + "` of `" + f.filename + "` in tar");
+
+    f.data_offset = pos;
+    return Safe;
+  }
+}
+
 Result<std::vector<Tar::TarFile>, std::string> Tar::List() {
+  if (in_ == nullptr) return Err("tar is not readable"s);
   std::vector<Tar::TarFile> files;
 
   // move to begin of tar file
-  fs_.seekg(0);
-  while (fs_.good()) {
-    // try to read a tar header
-    TarHeader header;
-    fs_.read(reinterpret_cast<char *>(&header), FileAlignment);
-    if (fs_.gcount() == 0 && fs_.eof()) break;
-
-    // get tar file info from header
-    auto filename = header.file_name();
-    auto size = header.filesize();
-    if (!size) return Err("failed to extract size of `"s + filename + "` from tar header");
-    auto perms = header.perms();
-    if (!perms) return Err("failed to extract perms of `"s + filename + "` from tar header");
-    auto type = filename.back() == '/' ? fs::file_type::directory : fs::file_type::regular;
+  if (file_ != nullptr) {
+    in_->clear();
+    in_->seekg(0);
+  }
 
-    files.push_back(Tar::TarFile{filename, size.value(), perms.value(), type});
+  for (uint64_t offset = 0;;) {
+    TarFile f;
+    f.offset = offset;
+    bool end;
+    if (auto ins = ReadHeader(f, end)) return Err(ins.error());
+    if (end) break;
 
-    int off = (size.value() + FileAlignment - 1) / FileAlignment * FileAlignment;
-    fs_.seekg(off, std::ios_base::cur);
+    Skip(f.end() - f.data_offset);
+    offset = f.end();
+    files.push_back(std::move(f));
   }
 
-  if (!fs_.eof()) return Err("failed to list tar"s);
-
   return Ok(files);
 }
 
 Insidious<std::string> Tar::Extract(const fs::path &dir) {
+  return Extract(dir, [](const TarFile &) { return true; });
+}
+
+Insidious<std::string> Tar::Extract(const fs::path &dir,
+                                    const std::function<bool(const TarFile &)> &filter) {
+  if (in_ == nullptr) return Danger("tar is not readable"s);
+
   // move to the begin of tar file
-  fs_.seekg(0);
+  if (file_ != nullptr) {
+    in_->clear();
+    in_->seekg(0);
+  }
 
-  while (fs_.good()) {
-    //  try to read a header
-    TarHeader header;
-    fs_.read(reinterpret_cast<char *>(&header), FileAlignment);
-    if (fs_.gcount() == 0 && fs_.eof()) break;
+  for (uint64_t offset = 0;;) {
+    TarFile f;
+    f.offset = offset;
+    bool end;
+    if (auto ins = ReadHeader(f, end)) return ins;
+    if (end) break;
 
-    auto filename = header.file_name();
-    auto size = header.filesize();
-    if (!size) return Danger("failed to extract size of `"s + filename + "` from tar header");
+    if (filter(f)) {
+      if (auto ins = ExtractEntry(dir, f)) return ins;
+    } else {
+      Skip(f.end() - f.data_offset);
+    }
+    offset = f.end();
+  }
+  return Safe;
+}
 
-    auto perms = header.perms();
-    if (!perms) return Danger("failed to extract perms of `"s + filename + "` from tar header");
+Insidious<std::string> Tar::Extract(const fs::path &dir, std::vector<TarFile> entries) {
+  if (in_ == nullptr) return Danger("tar is not readable"s);
 
-    if (header.file_type() == fs::file_type::directory) {
-      fs::create_directories(dir / filename);
+  std::sort(entries.begin(), entries.end(),
+            [](const TarFile &a, const TarFile &b) { return a.offset < b.offset; });
+
+  uint64_t offset = 0;  // of the stream
+  if (file_ != nullptr) in_->clear();
+  for (auto &e : entries) {
+    // a file is seeked to, a plain stream skipped forward
+    if (file_ != nullptr) {
+      in_->seekg(e.offset);
     } else {
-      auto ins = ExtractFile(dir / filename, size.value());
-      if (ins) return ins;
+      if (e.offset < offset) continue;  // duplicate
+      Skip(e.offset - offset);
     }
 
-    fs::permissions(dir / filename, perms.value());
+    TarFile f;
+    f.offset = e.offset;
+    bool end;
+    if (auto ins = ReadHeader(f, end)) return ins;
+    if (end || f.filename != e.filename)
+      return Danger("the index does not match the tar: `"s + e.filename + "`");
+    if (auto ins = ExtractEntry(dir, f)) return ins;
+
+    offset = f.end();
+  }
+  return Safe;
+}
+
+Insidious<std::string> Tar::ExtractEntry(const fs::path &dir, const TarFile &f) {
+  // entries of other archivers may try to leave `dir`
+  fs::path name(f.filename);
+  if (name.is_absolute() || std::find(name.begin(), name.end(), "..") != name.end())
+    return Danger("unsafe path in tar: "s + f.filename);
+
+  auto path = dir / name;
+  if (f.type == fs::file_type::directory) {
+    fs::create_directories(path);
+  } else {
+    fs::create_directories(path.parent_path());
+    auto ins = ExtractFile(path, f.size);
+    if (ins) return ins;
+
+    // the access time is left as it is
+    struct timespec times[2] = {{0, UTIME_OMIT}, {static_cast<time_t>(f.mtime), 0}};
+    if (::utimensat(AT_FDCWD, path.c_str(), times, 0) != 0)
+      return Danger("failed to set the modification time of "s + path.string());
   }
 
-  if (!fs_.eof()) return Danger("failed to extract"s);
+  fs::permissions(path, f.perms);
   return Safe;
 }
 
-Insidious<std::string> Tar::ExtractFile(const std::filesystem::path &path, int size) {
-  std::ofstream ofs(path);
+Insidious<std::string> Tar::ExtractFile(const std::filesystem::path &path, uint64_t size) {
+  std::ofstream ofs(path, std::ios_base::binary);
   if (!ofs) return Danger("failed to open: "s + path.string());
 
-  while (size > 0 && ofs.good() && fs_.good()) {
-    char buf[FileAlignment] = {0};
-    fs_.read(buf, FileAlignment);
-    ofs.write(buf, std::min(size, FileAlignment));
-    size -= FileAlignment;
+  // the data is padded to the alignment, and the padding is read along with it
+  auto buf = Buffer();
+  uint64_t left = size;
+  uint64_t padded = Padded(size);
+  while (padded > 0 && ofs.good() && in_->good()) {
+    auto n = static_cast<size_t>(std::min<uint64_t>(padded, kBufferSize));
+    in_->read(buf, n);
+    ofs.write(buf, std::min<uint64_t>(left, n));
+    left -= std::min<uint64_t>(left, n);
+    padded -= n;
   }
 
   if (!ofs) return Danger("failed to write to "s + path.string());
-  if (!fs_) return Danger("failed to read from tar file"s);
+  if (!*in_) return Danger("failed to read from tar file"s);
 
   return Safe;
 }
 
+namespace {
+/*
+ * Index file:
+ *   magic "BTIX", uint8 version, uint64 count, then per entry
+ *   uint64 offset, uint64 size, uint32 perms, int64 mtime, uint8 type, uint32 name length, name,
+ *   uint64 data offset, uint32 uid, uint32 gid
+ * with all integers little endian.
+ */
+constexpr char kIndexMagic[] = "BTIX";
+constexpr uint8_t kIndexVersion = 1;
+
+template <typename T>
+void PutLE(std::ostream &out, T v) {
+  char b[sizeof(T)];
+  for (size_t i = 0; i < sizeof(T); i++) b[i] = static_cast<char>(v >> (8 * i));
+  out.write(b, sizeof b);
+}
+
+template <typename T>
+bool GetLE(std::istream &in, T &v) {
+  char b[sizeof(T)];
+  if (!in.read(b, sizeof b)) return false;
+  std::make_unsigned_t<T> u = 0;
+  for (size_t i = 0; i < sizeof(T); i++)
+    u |= static_cast<std::make_unsigned_t<T>>(static_cast<uint8_t>(b[i])) << (8 * i);
+  v = static_cast<T>(u);
+  return true;
+}
+};  // namespace
+
+Insidious<std::string> Tar::WriteIndex(std::ostream &out, const std::vector<TarFile> &index) {
+  out.write(kIndexMagic, 4);
+  PutLE<uint8_t>(out, kIndexVersion);
+  PutLE<uint64_t>(out, index.size());
+  for (auto &f : index) {
+    PutLE<uint64_t>(out, f.offset);
+    PutLE<uint64_t>(out, f.size);
+    PutLE<uint32_t>(out, static_cast<uint32_t>(f.perms));
+    PutLE<int64_t>(out, f.mtime);
+    PutLE<uint8_t>(out, f.type == fs::file_type::directory ? 1 : 0);
+    PutLE<uint32_t>(out, f.filename.size());
+    out.write(f.filename.data(), f.filename.size());
+    PutLE<uint64_t>(out, f.data_offset);
+    PutLE<uint32_t>(out, f.uid);
+    PutLE<uint32_t>(out, f.gid);
+  }
+
+  if (!out) return Danger("failed to write tar index"s);
+  return Safe;
+}
+
+Result<std::vector<Tar::TarFile>, std::string> Tar::ReadIndex(std::istream &in) {
+  char magic[4];
+  uint8_t version;
+  uint64_t count;
+  if (!in.read(magic, 4) || std::memcmp(magic, kIndexMagic, 4) != 0)
+    return Err("not a tar index"s);
+  if (!GetLE(in, version) || version != kIndexVersion)
+    return Err("unsupported tar index version"s);
+  if (!GetLE(in, count)) return Err("broken tar index"s);
+
+  std::vector<TarFile> index;
+  for (uint64_t i = 0; i < count; i++) {
+    TarFile f;
+    uint32_t perms, name_len;
+    uint8_t type;
+    if (!GetLE(in, f.offset) || !GetLE(in, f.size) || !GetLE(in, perms) || !GetLE(in, f.mtime) ||
+        !GetLE(in, type) || !GetLE(in, name_len))
+      return Err("broken tar index"s);
+
+    f.filename.resize(name_len);
+    if (!in.read(f.filename.data(), name_len) || !GetLE(in, f.data_offset) || !GetLE(in, f.uid) ||
+        !GetLE(in, f.gid))
+      return Err("broken tar index"s);
+    f.perms = static_cast<fs::perms>(perms);
+    f.type = type ? fs::file_type::directory : fs::file_type::regular;
+    index.push_back(std::move(f));
+  }
+  return Ok(std::move(index));
+}
+
 };  // namespace bolo_tar
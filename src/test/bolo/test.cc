@@ -2,11 +2,18 @@
 #include <catch.h>
 #include <test_util.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <ctime>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
 #include <tuple>
 #include <unordered_map>
 #include <vector>
@@ -67,6 +74,64 @@ void DeleteFiles() {
   fs::remove_all(test_dir);
 }
 
+// a monitor whose events are sent by the test
+class FakeMonitor : public fsw::monitor {
+ public:
+  FakeMonitor(const std::vector<std::string> &paths, fsw::FSW_EVENT_CALLBACK *callback,
+              void *context)
+      : fsw::monitor(paths, callback, context) {}
+
+  bool supports_path_changes() const override { return true; }
+
+  void Emit(const std::string &path, fsw_event_flag flag) {
+    notify_events({{path, std::time(nullptr), {flag}}});
+  }
+  void Overflow() { notify_overflow(""); }
+
+ protected:
+  void run() override {
+    std::unique_lock<std::mutex> lock(run_mutex);
+    stopped_.wait(lock, [this] { return should_stop; });
+  }
+  void on_stop() override { stopped_.notify_all(); }
+
+ private:
+  std::condition_variable stopped_;
+};
+
+// the last monitor created by bolo, once it is running
+struct FakeMonitors {
+  std::atomic<FakeMonitor *> last = nullptr;
+
+  Bolo::MonitorFactory Factory() {
+    return [this](const std::vector<std::string> &paths, fsw::FSW_EVENT_CALLBACK *callback,
+                  void *context) {
+      auto m = new FakeMonitor(paths, callback, context);
+      last = m;
+      return m;
+    };
+  }
+
+  FakeMonitor *Running() {
+    for (int i = 0; i < 500; i++) {
+      auto m = last.load();
+      if (m != nullptr && m->is_running()) return m;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return nullptr;
+  }
+};
+
+// waits until `n` updates are done
+bool WaitUpdates(Bolo &b, uint64_t n) {
+  for (int i = 0; i < 1000; i++) {
+    auto m = b.UpdateMetrics();
+    if (m.dispatched >= n && m.pending == 0 && m.running == 0) return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
 TEST_CASE("Bolo-error", "error") {
   // failed to load
   REQUIRE(CreateConfigFile("{ \"backup_list\": [], \"next_\": 0 ,\"backup_path\":\"hello\"}"));
@@ -177,3 +242,301 @@ TEST_CASE("Bolo", "test") {
 
   DeleteFiles();
 }
+
+TEST_CASE("Bolo-codecs", "test") {
+  REQUIRE(CreateFiles());
+  REQUIRE(
+      CreateConfigFile("{ \"backup_list\": [], \"next_id\": "
+                       "0,\"backup_dir\":\"backup_path/\", \"enable_auto_update\": false, "
+                       "\"cloud_mount_path\":\"backup_path/\" }"));
+
+  std::vector<std::tuple<std::string, bolo_compress::Scheme, int>> codecs{
+      {"java.txt", bolo_compress::Scheme::FAST, 1},
+      {"best/language/haskell.txt", bolo_compress::Scheme::DEFLATE, 9},
+      {"path/ruby.txt", bolo_compress::Scheme::HUFFMAN, 6},
+  };
+
+  std::vector<BackupFileId> ids;
+  {
+    auto b = std::move(Bolo::LoadFromJsonFile(config_path).value());
+    for (auto &[origin, scheme, level] : codecs) {
+      auto res = b->Backup(origin, true, false, false, "", scheme, level);
+      if (!res) std::cerr << res.error() << std::endl;
+      REQUIRE(!!res);
+      ids.push_back(res.value().id);
+    }
+  }
+
+  // the codec is kept in the config and detected again on restore
+  auto b = std::move(Bolo::LoadFromJsonFile(config_path).value());
+  fs::create_directory("restore");
+  for (size_t i = 0; i < ids.size(); i++) {
+    auto f = b->GetBackupFile(ids[i]).value();
+    REQUIRE(f.scheme == std::get<1>(codecs[i]));
+    REQUIRE(f.level == std::get<2>(codecs[i]));
+
+    auto ins = b->Restore(ids[i], "restore");
+    if (ins) std::cerr << ins.error() << std::endl;
+    REQUIRE(!ins);
+    REQUIRE(CompareFiles(fs::path("restore") / f.filename, f.path));
+    REQUIRE(!b->Remove(ids[i]));
+  }
+
+  DeleteFiles();
+}
+
+TEST_CASE("Bolo-selective", "test") {
+  REQUIRE(CreateFiles());
+  REQUIRE(
+      CreateConfigFile("{ \"backup_list\": [], \"next_id\": "
+                       "0,\"backup_dir\":\"backup_path/\", \"enable_auto_update\": false, "
+                       "\"cloud_mount_path\":\"backup_path/\" }"));
+
+  // large enough for the compressed stream to have blocks without any selected file
+  for (auto d : {"sel/a", "sel/b/c"}) {
+    fs::create_directories(d);
+    for (int i = 0; i < 4; i++)
+      REQUIRE(WriteString(fs::path(d) / ("f" + std::to_string(i) + ".txt"),
+                          Repeat(d + std::to_string(i), 40000)));
+  }
+  REQUIRE(WriteString("sel/b/c/g.bin", Repeat("bin", 10)));
+
+  // compressed (with an index) and encrypted (without one); plain copies are made in the
+  // background, and could be restored before they are complete
+  std::vector<std::tuple<bool, bool, std::string>> kinds{
+      {true, false, ""},
+      {true, true, "key"},
+  };
+
+  auto b = std::move(Bolo::LoadFromJsonFile(config_path).value());
+  for (auto &[compressed, encrypted, key] : kinds) {
+    auto res = b->Backup("sel", compressed, encrypted, false, key);
+    REQUIRE(!!res);
+    auto id = res.value().id;
+    REQUIRE(fs::exists(res.value().index_path()) == (compressed && !encrypted));
+
+    fs::create_directory("restore");
+    auto ins = b->Restore(id, "restore", key, {"sel/b", "sel/a/f2.txt"});
+    if (ins) std::cerr << ins.error() << std::endl;
+    REQUIRE(!ins);
+    REQUIRE(std::system("diff -r sel/b restore/sel/b") == 0);
+    REQUIRE(CompareFiles("restore/sel/a/f2.txt", "sel/a/f2.txt"));
+    REQUIRE(std::distance(fs::directory_iterator("restore/sel/a"), {}) == 1);
+
+    // existing files are reported and left alone, the others are restored
+    REQUIRE(WriteString("restore/sel/a/f2.txt", "changed"));
+    REQUIRE(!!b->Restore(id, "restore", key, {"sel/a/f[0-2].txt"}));
+    REQUIRE(std::distance(fs::directory_iterator("restore/sel/a"), {}) == 3);
+    REQUIRE(CompareFiles("restore/sel/a/f0.txt", "sel/a/f0.txt"));
+    REQUIRE(fs::file_size("restore/sel/a/f2.txt") == 7);
+    REQUIRE(!!b->Restore(id, "restore", key, {"none"}));
+
+    // the whole backup still refuses an existing name
+    REQUIRE(!!b->Restore(id, "restore", key));
+    fs::remove_all("restore");
+
+    REQUIRE(!b->Remove(id));
+    REQUIRE(!fs::exists(res.value().index_path()));
+  }
+
+  DeleteFiles();
+}
+
+TEST_CASE("Bolo-dedup", "test") {
+  REQUIRE(CreateFiles());
+  REQUIRE(
+      CreateConfigFile("{ \"backup_list\": [], \"next_id\": "
+                       "0,\"backup_dir\":\"backup_path/\", \"enable_auto_update\": false, "
+                       "\"cloud_mount_path\":\"backup_path/\" }"));
+
+  // random data, so that the chunks are cut by the content
+  std::mt19937 rng(7);
+  std::string big(2 << 20, 0);
+  for (auto &c : big) c = static_cast<char>(rng());
+  fs::create_directories("dd/sub");
+  REQUIRE(WriteString("dd/big.bin", big));
+  REQUIRE(WriteString("dd/sub/small.txt", "small"));
+
+  auto chunks = [] {
+    size_t n = 0;
+    for (auto &e : fs::recursive_directory_iterator("backup_path/chunks")) n += e.is_regular_file();
+    return n;
+  };
+
+  auto b = std::move(Bolo::LoadFromJsonFile(config_path).value());
+  REQUIRE(!b->Backup("dd", true, true, false, "key", bolo_compress::Scheme::DEFLATE, 6, true));
+
+  auto res = b->Backup("dd", true, false, false, "", bolo_compress::Scheme::DEFLATE, 6, true);
+  REQUIRE(!!res);
+  REQUIRE(res.value().is_deduplicated);
+  auto first = chunks();
+  REQUIRE(first > 10);
+
+  // the same contents in another backup take no more chunks
+  auto other = b->Backup("dd", false, false, false, "", bolo_compress::Scheme::STORE, 6, true);
+  REQUIRE(!!other);
+  REQUIRE(chunks() == first);
+  REQUIRE(!b->Remove(other.value().id));
+  REQUIRE(chunks() == first);
+
+  // a change in the middle only adds the chunks around it; the replaced ones are collected when
+  // the layers are put together, or the backup is removed
+  big.insert(big.size() / 2, "changed");
+  REQUIRE(WriteString("dd/big.bin", big));
+  auto id = res.value().id;
+  REQUIRE(!b->Update(id));
+  auto second = chunks();
+  REQUIRE(second > first);
+  REQUIRE(second <= first + 2);
+  // the update is a layer on top of the first snapshot
+  auto file = b->GetBackupFile(id).value();
+  REQUIRE(file.layers == 1);
+  REQUIRE(fs::exists(file.layer_path(1)));
+  REQUIRE(!b->Update(id));
+  REQUIRE(b->GetBackupFile(id).value().layers == 1);
+
+  fs::create_directory("restore");
+  auto ins = b->Restore(id, "restore");
+  if (ins) std::cerr << ins.error() << std::endl;
+  REQUIRE(!ins);
+  REQUIRE(std::system("diff -r dd restore/dd") == 0);
+  REQUIRE(!!b->Restore(id, "restore"));
+  fs::remove_all("restore");
+
+  fs::create_directory("restore");
+  REQUIRE(!b->Restore(id, "restore", "", {"dd/sub/*"}));
+  REQUIRE(CompareFiles("restore/dd/sub/small.txt", "dd/sub/small.txt"));
+  REQUIRE(!fs::exists("restore/dd/big.bin"));
+  fs::remove_all("restore");
+
+  // removed files are left out when the layers are put together
+  fs::remove("dd/sub/small.txt");
+  REQUIRE(WriteString("dd/added.txt", "added"));
+  REQUIRE(!b->Update(id));
+  REQUIRE(b->GetBackupFile(id).value().layers == 2);
+  fs::create_directory("restore");
+  REQUIRE(!b->Restore(id, "restore"));
+  REQUIRE(std::system("diff -r dd restore/dd") == 0);
+  fs::remove_all("restore");
+
+  // a patch only looks at the paths it is given
+  REQUIRE(WriteString("dd/sub/patched.txt", "patched"));
+  REQUIRE(WriteString("dd/added.txt", "not patched"));
+  REQUIRE(!b->Patch(id, {"dd/sub/patched.txt"}));
+  REQUIRE(b->GetBackupFile(id).value().layers == 3);
+  fs::create_directory("restore");
+  REQUIRE(!b->Restore(id, "restore"));
+  REQUIRE(CompareFiles("restore/dd/sub/patched.txt", "dd/sub/patched.txt"));
+  REQUIRE(fs::file_size("restore/dd/added.txt") == 5);
+  fs::remove_all("restore");
+
+  REQUIRE(!b->Remove(id));
+  REQUIRE(chunks() == 0);
+  REQUIRE(!fs::exists(file.layer_path(1)));
+
+  DeleteFiles();
+}
+
+TEST_CASE("Bolo-monitor", "test") {
+  REQUIRE(CreateFiles());
+  REQUIRE(CreateConfigFile(
+      "{ \"backup_list\": [], \"next_id\": 0,\"backup_dir\":\"backup_path/\", "
+      "\"enable_auto_update\": true, \"cloud_mount_path\":\"backup_path/\", "
+      "\"update_quiet_ms\": 10, \"update_max_delay_ms\": 100 }"));
+  fs::create_directories("mon/sub");
+  REQUIRE(WriteString("mon/sub/a.txt", "a"));
+
+  FakeMonitors monitors;
+  {
+    auto b = std::move(Bolo::LoadFromJsonFile(config_path, monitors.Factory()).value());
+    auto res = b->Backup("mon", true, false, false, "", bolo_compress::Scheme::DEFLATE, 6, true);
+    REQUIRE(!!res);
+    auto id = res.value().id;
+    auto m = monitors.Running();
+    REQUIRE(m != nullptr);
+
+    // lost events: the backup is updated in full, and the monitor keeps running
+    REQUIRE(WriteString("mon/sub/a.txt", "changed without an event"));
+    m->Overflow();
+    REQUIRE(WaitUpdates(*b, 1));
+    REQUIRE(m->is_running());
+    REQUIRE(b->GetBackupFile(id).value().layers == 1);
+
+    fs::create_directory("restore");
+    REQUIRE(!b->Restore(id, "restore"));
+    REQUIRE(CompareFiles("restore/mon/sub/a.txt", "mon/sub/a.txt"));
+    fs::remove_all("restore");
+  }
+
+  DeleteFiles();
+}
+
+TEST_CASE("Bolo-monitor-parallel", "test") {
+  REQUIRE(CreateFiles());
+  REQUIRE(CreateConfigFile(
+      "{ \"backup_list\": [], \"next_id\": 0,\"backup_dir\":\"backup_path/\", "
+      "\"enable_auto_update\": true, \"cloud_mount_path\":\"backup_path/\", "
+      "\"update_quiet_ms\": 10, \"update_max_delay_ms\": 100, \"update_workers\": 2 }"));
+
+  std::mt19937 rng(11);
+  auto random = [&](size_t size) {
+    std::string s(size, 0);
+    for (auto &c : s) c = static_cast<char>(rng());
+    return s;
+  };
+  // a tar of random data takes long to compress, and many new chunks long to store;
+  // a small deduplicated backup is patched at once
+  fs::create_directories("tar");
+  fs::create_directories("chunks");
+  fs::create_directories("fast");
+  REQUIRE(WriteString("tar/big.bin", random(1 << 20)));
+  REQUIRE(WriteString("chunks/big.bin", random(4 << 20)));
+  REQUIRE(WriteString("fast/a.txt", "a"));
+
+  FakeMonitors monitors;
+  {
+    auto b = std::move(Bolo::LoadFromJsonFile(config_path, monitors.Factory()).value());
+    auto tar = b->Backup("tar", true, false, false, "", bolo_compress::Scheme::DEFLATE, 9, false);
+    auto chunks =
+        b->Backup("chunks", true, false, false, "", bolo_compress::Scheme::DEFLATE, 6, true);
+    auto fast = b->Backup("fast", true, false, false, "", bolo_compress::Scheme::DEFLATE, 6, true);
+    REQUIRE(!!tar);
+    REQUIRE(!!chunks);
+    REQUIRE(!!fast);
+    auto m = monitors.Running();
+    REQUIRE(m != nullptr);
+
+    // the event is taken and the small backup updated while the other update still runs;
+    // deduplicated backups of the same store are updated at the same time too
+    uint64_t updates = 0;
+    for (auto [slow, path] : {std::make_pair(tar.value(), fs::path("tar/big.bin")),
+                              std::make_pair(chunks.value(), fs::path("chunks/big.bin"))}) {
+      REQUIRE(WriteString(path, random(fs::file_size(path))));
+      m->Emit(fs::absolute(path), fsw_event_flag::Updated);
+      bool started = false;
+      for (int i = 0; i < 1000 && !started; i++) {
+        started = b->UpdateMetrics().running == 1;
+        if (!started) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      REQUIRE(started);
+
+      REQUIRE(WriteString("fast/a.txt", path.string()));
+      m->Emit(fs::absolute("fast/a.txt"), fsw_event_flag::Updated);
+      updates += 2;
+      REQUIRE(WaitUpdates(*b, updates));
+
+      // the slow update is saved last
+      auto slow_time = b->GetBackupFile(slow.id).value().timestamp;
+      REQUIRE(slow_time > b->GetBackupFile(fast.value().id).value().timestamp);
+    }
+    REQUIRE(b->GetBackupFile(fast.value().id).value().layers == 2);
+
+    fs::create_directory("restore");
+    for (auto &res : {chunks, fast}) REQUIRE(!b->Restore(res.value().id, "restore"));
+    REQUIRE(CompareFiles("restore/fast/a.txt", "fast/a.txt"));
+    REQUIRE(CompareFiles("restore/chunks/big.bin", "chunks/big.bin"));
+    fs::remove_all("restore");
+  }
+
+  DeleteFiles();
+}
@@ -6,7 +6,9 @@
 
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <tuple>
 
 std::string test_dir = "__compress_test_dir__";
 using namespace std::string_literals;
@@ -55,7 +57,204 @@ TEST_CASE("compress") {
   StringTestCase(Repeat("hello\n", 10000));
   StringTestCase(Repeat("JAVA is the BEST language IN THE world!\n", 1024));
   StringTestCase(Repeat("cpp is the worst programming language in the world!\n", 1024));
+  StringTestCase("");
+  StringTestCase(Repeat("a", 1000));
 
   fs::current_path("..");
   fs::remove_all(test_dir);
 }
+
+std::string RoundTrip(const std::string &s, bolo_compress::Scheme scheme,
+                      const bolo_compress::Options &opts = {}) {
+  std::istringstream in(s);
+  std::stringstream z;
+  auto ins = bolo_compress::Compress(in, z, scheme, opts);
+  if (ins) std::cerr << ins.error() << std::endl;
+  REQUIRE(!ins);
+
+  std::ostringstream out;
+  ins = bolo_compress::Uncompress(z, out, scheme, opts);
+  if (ins) std::cerr << ins.error() << std::endl;
+  REQUIRE(!ins);
+  return out.str();
+}
+
+TEST_CASE("compress-blocks") {
+  std::string text = Repeat("Haskell is the best programming language in the world!\n", 4096);
+  std::string noise;
+  for (int i = 0; i < 300000; i++) noise.push_back(static_cast<char>((i * 2654435761u) >> 13));
+
+  bolo_compress::Options small;
+  small.block_size = 4096;
+
+  // many blocks, coded and stored ones
+  REQUIRE(RoundTrip(text + noise + text, bolo_compress::Scheme::DEFLATE, small) ==
+          text + noise + text);
+  REQUIRE(RoundTrip(text + noise + text, bolo_compress::Scheme::HUFFMAN, small) ==
+          text + noise + text);
+  REQUIRE(RoundTrip(noise, bolo_compress::Scheme::DEFLATE) == noise);
+
+  // blocks coded by a pool of workers still come out in order
+  for (size_t threads : {1, 3, 8}) {
+    small.threads = threads;
+    REQUIRE(RoundTrip(text + noise + text, bolo_compress::Scheme::DEFLATE, small) ==
+            text + noise + text);
+  }
+
+  // the two-pass format is still written on request and detected on read
+  REQUIRE(RoundTrip(text, bolo_compress::Scheme::HUFFMAN_LEGACY) == text);
+  REQUIRE(RoundTrip("", bolo_compress::Scheme::HUFFMAN_LEGACY) == "");
+}
+
+TEST_CASE("compress-lz77") {
+  std::string text;
+  for (int i = 0; i < 20000; i++) text += "line " + std::to_string(i % 977) + " of the log\n";
+  std::string runs = Repeat("a", 100000) + Repeat("ab", 50000) + "abc";
+
+  for (int level : {1, 6, 9}) {
+    bolo_compress::Options opts;
+    opts.level = level;
+    REQUIRE(RoundTrip(text, bolo_compress::Scheme::DEFLATE, opts) == text);
+    REQUIRE(RoundTrip(runs, bolo_compress::Scheme::DEFLATE, opts) == runs);
+  }
+
+  // matches must stay inside a tiny window
+  bolo_compress::Options narrow;
+  narrow.window = 16;
+  REQUIRE(RoundTrip(text, bolo_compress::Scheme::DEFLATE, narrow) == text);
+
+  // short inputs have no room for a match
+  for (auto s : {"", "x", "abcd", "abcdabcd"})
+    REQUIRE(RoundTrip(s, bolo_compress::Scheme::DEFLATE) == s);
+
+  // dictionary matches beat order-0 coding on repetitive text
+  std::istringstream in1(text), in2(text);
+  std::ostringstream deflate, huffman;
+  REQUIRE(!bolo_compress::Compress(in1, deflate, bolo_compress::Scheme::DEFLATE));
+  REQUIRE(!bolo_compress::Compress(in2, huffman, bolo_compress::Scheme::HUFFMAN));
+  REQUIRE(deflate.str().size() * 4 < huffman.str().size());
+}
+
+TEST_CASE("compress-codecs") {
+  std::string text;
+  for (int i = 0; i < 20000; i++) text += "entry " + std::to_string(i % 613) + ": ok\n";
+  std::string runs = Repeat("z", 70000) + Repeat("xyz", 30000) + "end";
+
+  for (auto scheme : {bolo_compress::Scheme::FAST, bolo_compress::Scheme::STORE,
+                      bolo_compress::Scheme::HUFFMAN, bolo_compress::Scheme::DEFLATE}) {
+    REQUIRE(RoundTrip(text, scheme) == text);
+    REQUIRE(RoundTrip(runs, scheme) == runs);
+    for (auto s : {"", "x", "abcdabcdabcdabcd"}) REQUIRE(RoundTrip(s, scheme) == s);
+  }
+
+  // the frame header names the codec and level
+  {
+    std::istringstream in(text);
+    std::ostringstream z;
+    bolo_compress::Options opts;
+    opts.level = 9;
+    REQUIRE(!bolo_compress::Compress(in, z, bolo_compress::Scheme::FAST, opts));
+    REQUIRE(z.str().substr(8, 3) == "\x01\x03\x09"s);
+    REQUIRE(z.str().size() * 3 < text.size());
+  }
+
+  // a stored block of "abc"; other versions are rejected
+  {
+    std::istringstream in("\x89" "BLZ\r\n\x1a\n\x01\x00\x00\x03\x00\x03" "abc\x00"s);
+    std::ostringstream out;
+    REQUIRE(!bolo_compress::Uncompress(in, out, bolo_compress::Scheme::DEFLATE));
+    REQUIRE(out.str() == "abc");
+
+    std::istringstream newer("\x89" "BLZ\r\n\x1a\n\x02\x00\x00\x03\x00\x03" "abc\x00"s);
+    REQUIRE(!!bolo_compress::Uncompress(newer, out, bolo_compress::Scheme::DEFLATE));
+  }
+
+  // unknown codecs are rejected
+  {
+    std::istringstream in("\x89" "BLZ\r\n\x1a\n\x01\x7f\x00\x00"s);
+    std::ostringstream out;
+    REQUIRE(!!bolo_compress::Uncompress(in, out, bolo_compress::Scheme::DEFLATE));
+  }
+
+  // without a frame header, STORE copies the input through
+  for (auto s : {""s, "tar"s, text}) {
+    std::istringstream in(s);
+    std::ostringstream out;
+    REQUIRE(!bolo_compress::Uncompress(in, out, bolo_compress::Scheme::STORE));
+    REQUIRE(out.str() == s);
+  }
+}
+
+TEST_CASE("compress-huffman-lengths") {
+  // fibonacci weights build the deepest possible tree: 24 levels for 25 symbols
+  std::string fib;
+  uint64_t a = 1, b = 1;
+  for (char c = 'a'; c < 'a' + 25; c++) {
+    fib += std::string(a, c);
+    std::tie(a, b) = std::make_tuple(b, a + b);
+  }
+
+  bolo_compress::Options opts;
+  opts.block_size = fib.size();
+  REQUIRE(RoundTrip(fib, bolo_compress::Scheme::HUFFMAN, opts) == fib);
+  REQUIRE(RoundTrip(fib, bolo_compress::Scheme::HUFFMAN_LEGACY) == fib);
+
+  // the limited code costs little against the unlimited one (about 2.62 bits per byte)
+  std::istringstream in(fib);
+  std::ostringstream z;
+  REQUIRE(!bolo_compress::Compress(in, z, bolo_compress::Scheme::HUFFMAN, opts));
+  REQUIRE(z.str().size() * 8 < fib.size() * 2.7);
+}
+
+TEST_CASE("compress-headers") {
+  // the legacy format: int64 byte count and int32 table size (little endian), ASCII codewords
+  {
+    std::istringstream in("\x03\0\0\0\0\0\0\0\x02\0\0\0" "a0$b1$\x20"s);
+    std::ostringstream out;
+    REQUIRE(!bolo_compress::Uncompress(in, out, bolo_compress::Scheme::DEFLATE));
+    REQUIRE(out.str() == "aab");
+  }
+
+  // packed tables keep small inputs worth coding: 11 bytes of stream header, 4 of block
+  // header and end marker, the rest is the table and the codewords
+  for (auto [s, limit] : {std::make_pair(Repeat("abc", 20), 36), {Repeat("0123456789", 10), 80}}) {
+    std::istringstream in(s);
+    std::ostringstream z;
+    REQUIRE(!bolo_compress::Compress(in, z, bolo_compress::Scheme::HUFFMAN));
+    REQUIRE(z.str().size() <= static_cast<size_t>(limit));
+    REQUIRE(RoundTrip(s, bolo_compress::Scheme::HUFFMAN) == s);
+  }
+}
+
+TEST_CASE("compress-ranges") {
+  std::string text;
+  for (int i = 0; i < 100000; i++) text += std::to_string(i) + ",";
+
+  std::string z;
+  {
+    std::istringstream in(text);
+    std::ostringstream out;
+    bolo_compress::Options opts;
+    opts.block_size = 64 << 10;
+    REQUIRE(!bolo_compress::Compress(in, out, bolo_compress::Scheme::DEFLATE, opts));
+    z = out.str();
+  }
+
+  // blocks 1 and 3 to 4 are decoded, 0 and 2 come out as zeros, the rest is cut off
+  const size_t block = 64 << 10;
+  for (size_t threads : {1, 4}) {
+    bolo_compress::Options opts;
+    opts.threads = threads;
+    opts.ranges = {{block + 10, block + 20}, {3 * block + 5, 4 * block + 1}};
+    std::istringstream in(z);
+    std::ostringstream out;
+    REQUIRE(!bolo_compress::Uncompress(in, out, bolo_compress::Scheme::DEFLATE, opts));
+
+    auto s = out.str();
+    REQUIRE(s.size() == 5 * block);
+    REQUIRE(s.substr(0, block) == std::string(block, '\0'));
+    REQUIRE(s.substr(block, block) == text.substr(block, block));
+    REQUIRE(s.substr(2 * block, block) == std::string(block, '\0'));
+    REQUIRE(s.substr(3 * block) == text.substr(3 * block, 2 * block));
+  }
+}
@@ -0,0 +1,51 @@
+#include <catch.h>
+#include <path_trie.h>
+
+#include <string>
+#include <vector>
+
+using namespace bolo;
+
+TEST_CASE("PathTrie", "trie") {
+  PathTrie<int> trie;
+  trie.Insert("/a/b", 1);
+  trie.Insert("/a/b/", 2);
+  trie.Insert("/a/bc", 3);
+  trie.Insert("/x", 4);
+  trie.Insert("rel/a/b", 5);
+  REQUIRE(trie.size() == 5);
+
+  REQUIRE(trie.Match("/a/b") == std::vector<int>{1, 2});
+  REQUIRE(trie.Match("/a/b/c/d.txt") == std::vector<int>{1, 2});
+  REQUIRE(trie.Match("/a/./b/../bc/") == std::vector<int>{3});
+  // components, not substrings
+  REQUIRE(trie.Match("/x/a/b").size() == 1);
+  REQUIRE(trie.Match("/a").empty());
+  REQUIRE(trie.Match("/a/b.txt").empty());
+  REQUIRE(trie.Match("rel/a/b/c") == std::vector<int>{5});
+  REQUIRE(trie.Match("/rel/a/b").empty());
+
+  REQUIRE(trie.Erase("/a/b", 2));
+  REQUIRE(!trie.Erase("/a/b", 2));
+  REQUIRE(!trie.Erase("/a", 1));
+  REQUIRE(trie.Match("/a/b/c") == std::vector<int>{1});
+  REQUIRE(trie.Erase("/a/b", 1));
+  REQUIRE(trie.Erase("/a/bc", 3));
+  REQUIRE(trie.Match("/a/b/c").empty());
+  REQUIRE(trie.size() == 2);
+
+  // the root matches every absolute path
+  trie.Insert("/", 6);
+  REQUIRE(trie.Match("/x/y") == std::vector<int>{6, 4});
+
+  REQUIRE(trie.Values().size() == 3);
+
+  // a copy keeps its values while the original changes
+  auto copy = trie;
+  trie.Insert("/x/y", 7);
+  REQUIRE(trie.Erase("/x", 4));
+  REQUIRE(trie.Match("/x/y") == std::vector<int>{6, 7});
+  REQUIRE(copy.Match("/x/y") == std::vector<int>{6, 4});
+  REQUIRE(copy.size() == 3);
+  REQUIRE(!copy.Erase("/x/y", 7));
+}
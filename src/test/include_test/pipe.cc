@@ -0,0 +1,45 @@
+#include <catch.h>
+#include <pipe.h>
+
+#include <sstream>
+#include <string>
+
+using namespace bolo;
+using namespace std::string_literals;
+
+namespace {
+Insidious<std::string> Copy(std::istream &in, std::ostream &out) {
+  out << in.rdbuf();
+  if (!out) return Danger("failed to copy"s);
+  return Safe;
+}
+};  // namespace
+
+TEST_CASE("Pipeline", "pipe") {
+  std::string data;
+  for (int i = 0; i < (3 << 20); i++) data.push_back(static_cast<char>(i * 7 + i / 13));
+
+  std::istringstream in(data);
+  std::ostringstream out;
+
+  auto ins = RunPipeline(in, {Copy, Copy, Copy}, out);
+  REQUIRE(!ins);
+  REQUIRE(out.str() == data);
+}
+
+TEST_CASE("Pipeline-error", "pipe") {
+  std::string data(4 << 20, 'x');
+  std::istringstream in(data);
+  std::ostringstream out;
+
+  // the last stage gives up early; the upstream stages must not block forever
+  auto fail = [](std::istream &in, std::ostream &) -> Insidious<std::string> {
+    char buf[16];
+    in.read(buf, sizeof buf);
+    return Danger("stop"s);
+  };
+
+  auto ins = RunPipeline(in, {Copy, Copy, fail}, out);
+  REQUIRE(!!ins);
+  REQUIRE(ins.error() == "stop");
+}
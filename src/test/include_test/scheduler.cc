@@ -0,0 +1,155 @@
+#include <catch.h>
+#include <scheduler.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace bolo;
+using namespace std::chrono_literals;
+namespace fs = std::filesystem;
+
+namespace {
+struct Run {
+  BackupFileId id;
+  std::vector<fs::path> paths;
+  bool full;
+};
+};  // namespace
+
+TEST_CASE("UpdateScheduler-debounce", "scheduler") {
+  std::mutex mutex;
+  std::vector<Run> runs;
+  SchedulerOptions opts;
+  // nothing is due on its own: only Flush and the destructor run updates
+  opts.quiet = 1h;
+  opts.max_delay = 1h;
+  auto s = std::make_unique<UpdateScheduler>(
+      [&](BackupFileId id, std::vector<fs::path> paths, bool full) {
+        std::lock_guard<std::mutex> lock(mutex);
+        runs.push_back({id, std::move(paths), full});
+      },
+      opts);
+
+  // a burst of events is one update, with the paths merged
+  for (auto p : {"/a/2", "/a/1", "/a/2"}) s->Schedule(1, {p});
+  s->Schedule(2, {}, true);
+  s->Schedule(2, {"/b"});
+  s->Schedule(3, {"/c"});
+  s->Cancel(3);
+
+  auto m = s->Metrics();
+  REQUIRE(m.pending == 2);
+  REQUIRE(m.scheduled == 6);
+  REQUIRE(m.dispatched == 0);
+
+  s->Flush();
+  std::unique_lock<std::mutex> lock(mutex);
+  REQUIRE(runs.size() == 2);
+  std::map<BackupFileId, Run> by_id;
+  for (auto &r : runs) by_id[r.id] = r;
+  REQUIRE(by_id[1].paths == std::vector<fs::path>{"/a/1", "/a/2"});
+  REQUIRE(!by_id[1].full);
+  REQUIRE(by_id[2].paths.empty());
+  REQUIRE(by_id[2].full);
+
+  m = s->Metrics();
+  REQUIRE(m.pending == 0);
+  REQUIRE(m.dispatched == 2);
+
+  // the pending updates are run when the scheduler goes
+  s->Schedule(4, {"/d"});
+  lock.unlock();
+  s.reset();
+  REQUIRE(runs.size() == 3);
+  REQUIRE(runs.back().id == 4);
+}
+
+TEST_CASE("UpdateScheduler-quiet", "scheduler") {
+  std::mutex mutex;
+  std::condition_variable cv;
+  int runs = 0;
+  SchedulerOptions opts;
+  opts.quiet = 100ms;
+  opts.max_delay = 1h;
+  UpdateScheduler s(
+      [&](BackupFileId, std::vector<fs::path>, bool) {
+        std::lock_guard<std::mutex> lock(mutex);
+        runs++;
+        cv.notify_all();
+      },
+      opts);
+
+  // the update is run once no event came for `quiet`
+  s.Schedule(1, {"/a"});
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    REQUIRE(cv.wait_for(lock, 10s, [&] { return runs == 1; }));
+  }
+  REQUIRE(s.Metrics().max_lag >= opts.quiet);
+}
+
+TEST_CASE("UpdateScheduler-max-delay", "scheduler") {
+  std::atomic<int> runs{0};
+  SchedulerOptions opts;
+  opts.quiet = 1h;
+  opts.max_delay = 100ms;
+  opts.max_paths = 2;
+  UpdateScheduler s([&](BackupFileId, std::vector<fs::path> paths,
+                        bool full) { runs += full && paths.empty(); },
+                    opts);
+
+  // a file written all the time is still backed up every max_delay
+  auto deadline = std::chrono::steady_clock::now() + 10s;
+  for (int i = 0; runs < 2 && std::chrono::steady_clock::now() < deadline; i++) {
+    s.Schedule(1, {"/f" + std::to_string(i)});
+    std::this_thread::sleep_for(10ms);
+  }
+  REQUIRE(runs >= 2);
+  auto m = s.Metrics();
+  REQUIRE(m.max_lag >= opts.max_delay);
+  REQUIRE(m.max_lag < opts.quiet);
+}
+
+TEST_CASE("UpdateScheduler-serial", "scheduler") {
+  std::mutex mutex;
+  std::map<BackupFileId, int> running;
+  int max_same = 0, max_all = 0, total = 0, runs = 0;
+
+  SchedulerOptions opts;
+  opts.quiet = 0ms;
+  opts.workers = 4;
+  {
+    UpdateScheduler s(
+        [&](BackupFileId id, std::vector<fs::path>, bool) {
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            max_same = std::max(max_same, ++running[id]);
+            max_all = std::max(max_all, ++total);
+            runs++;
+          }
+          std::this_thread::sleep_for(50ms);
+          std::lock_guard<std::mutex> lock(mutex);
+          running[id]--;
+          total--;
+        },
+        opts);
+
+    for (int i = 0; i < 10; i++) {
+      for (BackupFileId id : {1, 2, 3}) s.Schedule(id, {"/x"});
+      std::this_thread::sleep_for(10ms);
+    }
+    s.Flush();
+    REQUIRE(s.Metrics().pending == 0);
+    REQUIRE(s.Metrics().running == 0);
+  }
+
+  REQUIRE(max_same == 1);
+  REQUIRE(max_all > 1);
+  REQUIRE(runs >= 3);
+}
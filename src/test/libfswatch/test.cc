@@ -0,0 +1,484 @@
+#define CATCH_CONFIG_MAIN
+#include <catch.h>
+#include <test_util.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "libfswatch/c++/inotify_monitor.hpp"
+#include "libfswatch/c++/libfswatch_flat_map.hpp"
+#include "libfswatch/c++/poll_monitor.hpp"
+
+namespace fs = std::filesystem;
+using namespace std::chrono_literals;
+
+const fs::path test_dir = "__libfswatch_test_dir__";
+
+struct Event {
+  std::string path;
+  std::vector<fsw_event_flag> flags;
+
+  bool Has(fsw_event_flag flag) const {
+    return std::find(flags.begin(), flags.end(), flag) != flags.end();
+  }
+};
+
+// 收集 monitor 回调的 events
+class Events {
+ public:
+  static void Callback(const std::vector<fsw::event> &events, void *context) {
+    auto self = static_cast<Events *>(context);
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    for (auto &e : events) self->events_.push_back({e.get_path(), e.get_flags()});
+    self->cv_.notify_all();
+  }
+
+  // 等到收到满足 pred 的 event
+  bool Wait(std::function<bool(const Event &)> pred,
+            std::chrono::milliseconds timeout = 10s) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cv_.wait_for(lock, timeout,
+                        [&] { return std::any_of(events_.begin(), events_.end(), pred); });
+  }
+
+  bool Wait(const fs::path &path, std::chrono::milliseconds timeout = 10s) {
+    return Wait([&](const Event &e) { return e.path == path.string(); }, timeout);
+  }
+
+  // 取出收到的 events, 忽略 Sync() 的 probe
+  std::vector<Event> Take() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Event> events;
+    for (auto &e : events_) {
+      if (fs::path(e.path).filename().string().rfind(".probe", 0) != 0) events.push_back(e);
+    }
+    events_.clear();
+    return events;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<Event> events_;
+};
+
+// 在另一个线程运行 monitor
+class Running {
+ public:
+  explicit Running(fsw::monitor &m) : m_(m), thread_([this] { m_.start(); }) {}
+  ~Running() { Stop(); }
+
+  void Stop() {
+    if (!thread_.joinable()) return;
+    m_.stop();
+    thread_.join();
+  }
+
+ private:
+  fsw::monitor &m_;
+  std::thread thread_;
+};
+
+// 在 dir 中创建 probe 文件, 直到 monitor 报告了它, 此前的变化都已处理
+bool Sync(Events &events, const fs::path &dir) {
+  static int cnt = 0;
+  for (int i = 0; i < 50; i++) {
+    auto probe = dir / (".probe" + std::to_string(cnt++));
+    WriteString(probe, "probe");
+    if (events.Wait(probe, 300ms)) return true;
+  }
+  return false;
+}
+
+bool HasEventBelow(const std::vector<Event> &events, const fs::path &dir) {
+  auto prefix = dir.string() + "/";
+  return std::any_of(events.begin(), events.end(), [&](const Event &e) {
+    return e.path == dir.string() || e.path.rfind(prefix, 0) == 0;
+  });
+}
+
+fs::path MakeTestDir() {
+  fs::remove_all(test_dir);
+  fs::create_directories(test_dir);
+  return fs::canonical(test_dir);
+}
+
+struct CollidingHash {
+  size_t operator()(int key) const { return key % 7; }
+};
+
+template <typename H>
+void CompareFlatMap(uint32_t seed, int range) {
+  fsw::fsw_flat_map<int, int, H> map;
+  std::unordered_map<int, int> expected;
+  std::mt19937 rng(seed);
+
+  for (int i = 0; i < 20000; i++) {
+    int key = rng() % range;
+    switch (rng() % 3) {
+      case 0:
+        map[key] = i;
+        expected[key] = i;
+        break;
+      case 1:
+        REQUIRE(map.erase(key) == (expected.erase(key) == 1));
+        break;
+      case 2: {
+        auto value = map.find(key);
+        auto it = expected.find(key);
+        REQUIRE((value != nullptr) == (it != expected.end()));
+        if (value) REQUIRE(*value == it->second);
+      } break;
+    }
+    REQUIRE(map.size() == expected.size());
+  }
+
+  size_t cnt = 0;
+  map.for_each([&](const int &key, const int &value) {
+    cnt++;
+    REQUIRE(expected.count(key) == 1);
+    REQUIRE(expected[key] == value);
+  });
+  REQUIRE(cnt == expected.size());
+
+  map.clear();
+  REQUIRE(map.empty());
+  for (auto &kv : expected) REQUIRE(map.find(kv.first) == nullptr);
+}
+
+TEST_CASE("FlatMap") {
+  // 小 range 反复 erase, 大 range 反复 grow
+  CompareFlatMap<std::hash<int>>(1, 64);
+  CompareFlatMap<std::hash<int>>(2, 100000);
+  // 全部冲突时 erase 的 backward shift
+  CompareFlatMap<CollidingHash>(3, 200);
+}
+
+TEST_CASE("Inotify-move") {
+  auto root = MakeTestDir();
+  fs::create_directories(root / "dir1" / "sub");
+
+  {
+    Events events;
+    fsw::inotify_monitor m({root.string()}, Events::Callback, &events);
+    m.set_recursive(true);
+    Running running(m);
+    REQUIRE(Sync(events, root));
+
+    fs::rename(root / "dir1", root / "dir2");
+    REQUIRE(events.Wait(root / "dir2"));
+    REQUIRE(Sync(events, root / "dir2" / "sub"));
+    events.Take();
+
+    // 移动后的目录和子目录都以新路径报告
+    WriteString(root / "dir2" / "file", "file");
+    WriteString(root / "dir2" / "sub" / "file", "file");
+    REQUIRE(events.Wait(root / "dir2" / "file"));
+    REQUIRE(events.Wait(root / "dir2" / "sub" / "file"));
+    REQUIRE(Sync(events, root));
+
+    auto got = events.Take();
+    REQUIRE_FALSE(HasEventBelow(got, root / "dir1"));
+  }
+  // monitor 析构后再删除, 否则它的 watches 已被内核移除
+  fs::remove_all(test_dir);
+}
+
+TEST_CASE("Inotify-remove-root") {
+  auto root = MakeTestDir();
+  fs::create_directories(root / "a" / "sub");
+  fs::create_directories(root / "b");
+
+  {
+    Events events;
+    fsw::inotify_monitor m({(root / "a").string(), (root / "b").string()}, Events::Callback,
+                           &events);
+    m.set_recursive(true);
+    Running running(m);
+    REQUIRE(Sync(events, root / "a" / "sub"));
+
+    m.remove_root_path((root / "a").string());
+    REQUIRE(Sync(events, root / "b"));
+    events.Take();
+
+    WriteString(root / "a" / "file", "file");
+    WriteString(root / "a" / "sub" / "file", "file");
+    fs::create_directories(root / "a" / "new");
+    REQUIRE(Sync(events, root / "b"));
+
+    auto got = events.Take();
+    REQUIRE_FALSE(HasEventBelow(got, root / "a"));
+  }
+  fs::remove_all(test_dir);
+}
+
+TEST_CASE("Inotify-latency") {
+  auto root = MakeTestDir();
+
+  {
+    Events events;
+    fsw::inotify_monitor m({root.string()}, Events::Callback, &events);
+    m.set_latency(10);
+    m.set_property(fsw::inotify_monitor::INOTIFY_BATCH_MS, "10");
+    Running running(m);
+    REQUIRE(Sync(events, root));
+
+    // 单个变化在 batch 窗口内送达, 不用等 latency
+    auto start = std::chrono::steady_clock::now();
+    WriteString(root / "file", "file");
+    REQUIRE(events.Wait(root / "file", 10s));
+    REQUIRE(std::chrono::steady_clock::now() - start < 2s);
+
+    // stop() 唤醒 epoll_wait, 不用等 latency
+    start = std::chrono::steady_clock::now();
+    running.Stop();
+    REQUIRE(std::chrono::steady_clock::now() - start < 2s);
+  }
+  fs::remove_all(test_dir);
+}
+
+// 运行时增删 root, 内层 root 在外层 root 删除后仍被监控
+template <typename Monitor>
+void TestRootChanges() {
+  auto root = MakeTestDir();
+  auto a = root / "a", inner = root / "a" / "inner", b = root / "b";
+  fs::create_directories(inner);
+  fs::create_directories(b);
+
+  {
+    Events events;
+    Monitor m({b.string()}, Events::Callback, &events);
+    m.set_recursive(true);
+    REQUIRE(m.supports_path_changes());
+    Running running(m);
+    REQUIRE(Sync(events, b));
+
+    m.add_root_path(a.string());
+    REQUIRE(Sync(events, a));
+    REQUIRE(Sync(events, inner));
+    WriteString(a / "added", "added");
+    REQUIRE(events.Wait(a / "added"));
+
+    m.add_root_path(inner.string());
+    m.remove_root_path(a.string());
+    // poll 可能正在扫描, 第二个 probe 的扫描一定在删除之后
+    REQUIRE(Sync(events, b));
+    REQUIRE(Sync(events, b));
+    events.Take();
+
+    WriteString(a / "file", "file");
+    fs::create_directories(a / "new");
+    WriteString(inner / "file", "file");
+    REQUIRE(events.Wait(inner / "file"));
+    REQUIRE(Sync(events, b));
+
+    auto got = events.Take();
+    got.erase(std::remove_if(got.begin(), got.end(),
+                             [&](const Event &e) { return HasEventBelow({e}, inner); }),
+              got.end());
+    REQUIRE_FALSE(HasEventBelow(got, a));
+
+    m.remove_root_path(inner.string());
+    REQUIRE(Sync(events, b));
+    REQUIRE(Sync(events, b));
+    events.Take();
+
+    WriteString(inner / "removed", "removed");
+    WriteString(a / "removed", "removed");
+    REQUIRE(Sync(events, b));
+    REQUIRE_FALSE(HasEventBelow(events.Take(), a));
+  }
+  fs::remove_all(test_dir);
+}
+
+TEST_CASE("Inotify-root-changes") { TestRootChanges<fsw::inotify_monitor>(); }
+
+TEST_CASE("Poll-root-changes") { TestRootChanges<fsw::poll_monitor>(); }
+
+std::vector<std::string> Paths(const std::vector<Event> &events, fsw_event_flag flag) {
+  std::vector<std::string> paths;
+  for (auto &e : events) {
+    // 目录的内容变化时它的 mtime 也变化, 只比较文件的 Updated
+    if (flag == Updated && fs::is_directory(e.path)) continue;
+    if (e.Has(flag)) paths.push_back(e.path);
+  }
+  std::sort(paths.begin(), paths.end());
+  return paths;
+}
+
+std::vector<std::string> Sorted(std::vector<fs::path> paths) {
+  std::vector<std::string> res;
+  for (auto &p : paths) res.push_back(p.string());
+  std::sort(res.begin(), res.end());
+  return res;
+}
+
+TEST_CASE("Poll-scan-threads") {
+  auto root = MakeTestDir();
+  for (int i = 0; i < 40; i++) {
+    auto dir = root / ("d" + std::to_string(i));
+    fs::create_directories(dir / "sub");
+    for (int j = 0; j < 4; j++) WriteString(dir / ("f" + std::to_string(j)), "file");
+    WriteString(dir / "sub" / "f", "file");
+  }
+
+  {
+    Events events;
+    fsw::poll_monitor m({root.string()}, Events::Callback, &events);
+    m.set_recursive(true);
+    m.set_property(fsw::poll_monitor::POLL_SCAN_THREADS, "4");
+    m.set_property(fsw::poll_monitor::POLL_PRUNE, "false");
+    Running running(m);
+    REQUIRE(Sync(events, root));
+    events.Take();
+
+    std::vector<fs::path> created, updated, removed;
+    auto later = fs::file_time_type::clock::now() + 1h;
+    // d39 整个删除, d40 整个新建
+    for (int i = 0; i < 39; i++) {
+      auto dir = root / ("d" + std::to_string(i));
+      if (i % 2 == 0) {
+        created.push_back(dir / "new");
+        WriteString(dir / "new", "new");
+        created.push_back(dir / "sub" / "new");
+        WriteString(dir / "sub" / "new", "new");
+      }
+      // mtime 以秒比较, 设为将来的时间才一定被发现
+      if (i % 3 == 0) {
+        updated.push_back(dir / "f0");
+        fs::last_write_time(dir / "f0", later);
+      }
+      if (i % 5 == 0) {
+        removed.push_back(dir / "f1");
+        fs::remove(dir / "f1");
+      }
+    }
+    auto dir = root / "d39";
+    for (auto &p : {dir / "f0", dir / "f1", dir / "f2", dir / "f3", dir / "sub" / "f",
+                    dir / "sub", dir}) {
+      removed.push_back(p);
+    }
+    fs::remove_all(dir);
+    dir = root / "d40";
+    fs::create_directories(dir / "sub");
+    WriteString(dir / "sub" / "f", "file");
+    for (auto &p : {dir, dir / "sub", dir / "sub" / "f"}) created.push_back(p);
+
+    // 第二个 probe 的扫描一定在所有变化之后
+    REQUIRE(Sync(events, root));
+    REQUIRE(Sync(events, root));
+    auto got = events.Take();
+    REQUIRE(Paths(got, Created) == Sorted(created));
+    REQUIRE(Paths(got, Updated) == Sorted(updated));
+    REQUIRE(Paths(got, Removed) == Sorted(removed));
+  }
+  fs::remove_all(test_dir);
+}
+
+// 每个目录一个文件, 之后目录不再变化
+fs::path MakePrunedTree() {
+  auto root = MakeTestDir();
+  for (int i = 0; i < 10; i++) {
+    auto dir = root / ("d" + std::to_string(i));
+    fs::create_directories(dir / "sub");
+    WriteString(dir / "f", "file");
+    WriteString(dir / "sub" / "f", "file");
+  }
+  return root;
+}
+
+TEST_CASE("Poll-prune") {
+  auto root = MakePrunedTree();
+
+  {
+    Events events;
+    fsw::poll_monitor m({root.string()}, Events::Callback, &events);
+    m.set_recursive(true);
+    m.set_property(fsw::poll_monitor::POLL_PRUNE, "true");
+    m.set_property(fsw::poll_monitor::POLL_PRUNE_REFRESH, "1000");
+    Running running(m);
+    REQUIRE(Sync(events, root));
+
+    // 跳过的目录中的文件不能被当作已删除, probe 只改变了 root
+    for (int i = 0; i < 3; i++) REQUIRE(Sync(events, root));
+    auto got = events.Take();
+    REQUIRE_FALSE(HasEventBelow(got, root / "d0"));
+    REQUIRE(Paths(got, Removed).empty());
+
+    // 只改内容时目录不变, 在 refresh 之前不会被读
+    fs::last_write_time(root / "d0" / "f", fs::file_time_type::clock::now() + 1h);
+    for (int i = 0; i < 3; i++) REQUIRE(Sync(events, root));
+    REQUIRE(Paths(events.Take(), Updated).empty());
+
+    // 删除文件改变了目录, 目录被重新读
+    fs::remove(root / "d1" / "sub" / "f");
+    REQUIRE(events.Wait([&](const Event &e) {
+      return e.path == (root / "d1" / "sub" / "f").string() && e.Has(Removed);
+    }));
+    REQUIRE(Sync(events, root));
+    REQUIRE(Paths(events.Take(), Removed) == Sorted({root / "d1" / "sub" / "f"}));
+  }
+  fs::remove_all(test_dir);
+}
+
+TEST_CASE("Poll-prune-refresh") {
+  auto root = MakePrunedTree();
+
+  {
+    Events events;
+    fsw::poll_monitor m({root.string()}, Events::Callback, &events);
+    m.set_recursive(true);
+    m.set_property(fsw::poll_monitor::POLL_PRUNE, "true");
+    m.set_property(fsw::poll_monitor::POLL_PRUNE_REFRESH, "2");
+    Running running(m);
+    REQUIRE(Sync(events, root));
+
+    // 只改内容的文件由 refresh 的完整扫描发现
+    auto file = root / "d0" / "sub" / "f";
+    fs::last_write_time(file, fs::file_time_type::clock::now() + 1h);
+    REQUIRE(events.Wait([&](const Event &e) { return e.path == file.string() && e.Has(Updated); }));
+    REQUIRE(Sync(events, root));
+    REQUIRE(Sync(events, root));
+    REQUIRE(Paths(events.Take(), Removed).empty());
+  }
+  fs::remove_all(test_dir);
+}
+
+TEST_CASE("Poll-prune-settled") {
+  auto root = MakeTestDir();
+
+  {
+    Events events;
+    fsw::poll_monitor m({root.string()}, Events::Callback, &events);
+    m.set_recursive(true);
+    m.set_property(fsw::poll_monitor::POLL_PRUNE, "true");
+    m.set_property(fsw::poll_monitor::POLL_PRUNE_REFRESH, "1000");
+    Running running(m);
+
+    std::vector<fs::path> files;
+    for (int i = 0; i < 3; i++) {
+      REQUIRE(Sync(events, root));
+      // 在下一次扫描之前创建目录, 扫描多半与它在同一秒
+      std::this_thread::sleep_for(950ms);
+      auto dir = root / ("new" + std::to_string(i));
+      fs::create_directories(dir);
+      REQUIRE(events.Wait(dir));
+
+      // 紧接着扫描创建的文件不改变目录以秒计的 mtime, 目录仍要再读一次
+      files.push_back(dir / "f");
+      WriteString(files.back(), "file");
+    }
+
+    for (auto &f : files) REQUIRE(events.Wait(f, 5s));
+  }
+  fs::remove_all(test_dir);
+}
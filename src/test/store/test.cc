@@ -0,0 +1,245 @@
+#define CATCH_CONFIG_MAIN
+#include <catch.h>
+#include <test_util.h>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "store.h"
+
+namespace fs = std::filesystem;
+using namespace bolo_store;
+
+std::string Random(size_t size, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::string s(size, '\0');
+  for (auto &c : s) c = static_cast<char>(rng());
+  return s;
+}
+
+std::vector<std::string> Chunks(const Chunker &chunker, const std::string &s) {
+  std::vector<std::string> chunks;
+  for (size_t pos = 0; pos < s.size();) {
+    auto n = chunker.Next(s.data() + pos, s.size() - pos);
+    chunks.push_back(s.substr(pos, n));
+    pos += n;
+  }
+  return chunks;
+}
+
+TEST_CASE("store-chunker") {
+  Chunker chunker;
+  auto data = Random(8 << 20, 1);
+
+  auto chunks = Chunks(chunker, data);
+  size_t total = 0;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    total += chunks[i].size();
+    REQUIRE(chunks[i].size() <= chunker.options().max_size);
+    if (i + 1 < chunks.size()) REQUIRE(chunks[i].size() >= chunker.options().min_size);
+  }
+  REQUIRE(total == data.size());
+  // close to the average size
+  REQUIRE(chunks.size() > data.size() / (2 * chunker.options().avg_size));
+  REQUIRE(chunks.size() < data.size() / (chunker.options().avg_size / 2));
+
+  // an insertion only changes the chunks around it
+  auto edited = data.substr(0, 3 << 20) + "inserted" + data.substr(3 << 20);
+  auto other = Chunks(chunker, edited);
+  std::unordered_set<std::string> set(chunks.begin(), chunks.end());
+  size_t changed = 0;
+  for (auto &c : other) changed += set.count(c) == 0;
+  REQUIRE(changed <= 3);
+}
+
+TEST_CASE("store-chunks") {
+  ChunkStore store("store_test_chunks", bolo_compress::Scheme::FAST);
+
+  auto a = Repeat("chunk a ", 10000);
+  auto b = Random(100000, 2);
+  auto ha = store.Put(a.data(), a.size());
+  auto hb = store.Put(b.data(), b.size());
+  REQUIRE(ha);
+  REQUIRE(hb);
+  REQUIRE(ha.value() == Sha256(a.data(), a.size()));
+  REQUIRE(Sha256("abc", 3) == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+  // stored once, and compressed
+  REQUIRE(store.Put(a.data(), a.size()).value() == ha.value());
+  REQUIRE(store.Has(ha.value()));
+  size_t files = 0;
+  for (auto &e : fs::recursive_directory_iterator("store_test_chunks"))
+    files += e.is_regular_file();
+  REQUIRE(files == 2);
+  REQUIRE(fs::file_size(fs::path("store_test_chunks") / ha.value().substr(0, 2) / ha.value()) <
+          a.size() / 10);
+
+  REQUIRE(store.Get(ha.value()).value() == a);
+  REQUIRE(store.Get(hb.value()).value() == b);
+  REQUIRE(!store.Get(Sha256("none", 4)));
+
+  // damaged chunks are detected
+  {
+    std::fstream f(fs::path("store_test_chunks") / hb.value().substr(0, 2) / hb.value(),
+                   std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    f.seekp(5000);
+    f.put('!');
+  }
+  REQUIRE(!store.Get(hb.value()));
+
+  auto removed = store.CollectGarbage({ha.value()});
+  REQUIRE(removed);
+  REQUIRE(removed.value() == 1);
+  REQUIRE(store.Has(ha.value()));
+  REQUIRE(!store.Has(hb.value()));
+
+  fs::remove_all("store_test_chunks");
+}
+
+TEST_CASE("store-snapshot") {
+  fs::create_directories("store_test_dir/in/sub/empty");
+  REQUIRE(WriteString("store_test_dir/in/big", Random(3 << 20, 3)));
+  REQUIRE(WriteString("store_test_dir/in/sub/small", "small"));
+  REQUIRE(WriteString("store_test_dir/in/sub/zero", ""));
+  REQUIRE(WriteString("store_test_dir/in/copy", Random(3 << 20, 3)));
+
+  ChunkStore store("store_test_dir/chunks");
+  Chunker chunker;
+  auto m = Snapshot("store_test_dir/in", store, chunker, 4);
+  if (!m) std::cerr << m.error() << std::endl;
+  REQUIRE(m);
+  REQUIRE(m.value().entries.size() == 7);
+  REQUIRE(m.value().entries[0].path == "in/");
+
+  // the two equal files share their chunks
+  std::unordered_set<std::string> chunks;
+  m.value().Chunks(chunks);
+  REQUIRE(chunks.size() == m.value().entries[1].chunks.size() + 1);
+
+  REQUIRE(!m.value().Save("store_test_dir/manifest"));
+  auto loaded = Manifest::Load("store_test_dir/manifest");
+  REQUIRE(loaded);
+  REQUIRE(loaded.value().entries.size() == 7);
+
+  auto ins =
+      Restore(loaded.value(), store, "store_test_dir/out", [](const Entry &) { return true; });
+  if (ins) std::cerr << ins.error() << std::endl;
+  REQUIRE(!ins);
+  REQUIRE(std::system("diff -r store_test_dir/in store_test_dir/out/in") == 0);
+  auto skew = fs::last_write_time("store_test_dir/out/in/big") -
+              fs::last_write_time("store_test_dir/in/big");
+  REQUIRE(std::chrono::abs(skew) < std::chrono::seconds(1));
+
+  // entries may not leave the restore directory
+  for (auto name : {"../escape", "/tmp/store_test_escape", "in/../../escape"}) {
+    Manifest bad;
+    bad.entries.emplace_back();
+    bad.entries[0].path = name;
+    bad.entries[0].type = fs::file_type::regular;
+    REQUIRE(Restore(bad, store, "store_test_dir/out", [](const Entry &) { return true; }));
+  }
+  REQUIRE(!fs::exists("store_test_dir/escape"));
+  REQUIRE(!fs::exists("/tmp/store_test_escape"));
+
+  REQUIRE(!Manifest::Load("store_test_dir/none"));
+  fs::remove_all("store_test_dir");
+}
+
+TEST_CASE("store-incremental") {
+  fs::create_directories("store_test_dir/in/sub");
+  REQUIRE(WriteString("store_test_dir/in/kept", Random(1 << 20, 4)));
+  REQUIRE(WriteString("store_test_dir/in/sub/changed", "old"));
+  REQUIRE(WriteString("store_test_dir/in/sub/removed", "removed"));
+
+  ChunkStore store("store_test_dir/chunks");
+  Chunker chunker;
+  auto base = Snapshot("store_test_dir/in", store, chunker, 2);
+  REQUIRE(base);
+
+  // same size and mtime: the file is taken as unchanged, and its old chunks are kept
+  auto mtime = fs::last_write_time("store_test_dir/in/kept");
+  {
+    std::fstream f("store_test_dir/in/kept", std::ios_base::in | std::ios_base::out);
+    f << "x";
+  }
+  fs::last_write_time("store_test_dir/in/kept", mtime);
+  REQUIRE(WriteString("store_test_dir/in/sub/changed", "new contents"));
+  REQUIRE(WriteString("store_test_dir/in/added", "added"));
+  fs::remove("store_test_dir/in/sub/removed");
+
+  auto next = Snapshot("store_test_dir/in", store, chunker, 2, &base.value());
+  REQUIRE(next);
+  REQUIRE(next.value().Find("in/kept")->chunks == base.value().Find("in/kept")->chunks);
+  REQUIRE(next.value().Find("in/sub/removed") == nullptr);
+
+  auto layer = Manifest::Delta(base.value(), next.value());
+  std::vector<std::string> paths;
+  for (auto &e : layer.entries) paths.push_back(e.path);
+  // the mtime of the directories changed as well
+  REQUIRE(paths == std::vector<std::string>{"in/", "in/added", "in/sub/", "in/sub/changed"});
+  REQUIRE(layer.removed == std::vector<std::string>{"in/sub/removed"});
+
+  REQUIRE(!layer.Save("store_test_dir/layer"));
+  auto loaded = Manifest::Load("store_test_dir/layer");
+  REQUIRE(loaded);
+  REQUIRE(loaded.value().removed == layer.removed);
+
+  auto composed = base.value();
+  composed.Apply(loaded.value());
+  REQUIRE(composed.entries == next.value().entries);
+  REQUIRE(Manifest::Delta(composed, next.value()).entries.empty());
+
+  fs::remove_all("store_test_dir");
+}
+
+TEST_CASE("store-patch") {
+  fs::create_directories("store_test_dir/in/a/deep");
+  fs::create_directories("store_test_dir/in/b");
+  REQUIRE(WriteString("store_test_dir/in/a/deep/f", "f"));
+  REQUIRE(WriteString("store_test_dir/in/b/changed", "old"));
+  REQUIRE(WriteString("store_test_dir/in/b/untouched", "old"));
+
+  ChunkStore store("store_test_dir/chunks");
+  Chunker chunker;
+  auto base = Snapshot("store_test_dir/in", store, chunker, 2);
+  REQUIRE(base);
+
+  REQUIRE(WriteString("store_test_dir/in/b/changed", "new"));
+  REQUIRE(WriteString("store_test_dir/in/b/untouched", "changed, but no event"));
+  fs::remove_all("store_test_dir/in/a");
+  REQUIRE(WriteString("store_test_dir/in/a", "a is a file now"));
+  fs::create_directories("store_test_dir/in/c/d");
+  REQUIRE(WriteString("store_test_dir/in/c/d/e", "e"));
+
+  auto layer = Patch("store_test_dir/in",
+                     {"store_test_dir/in/b/changed", "store_test_dir/in/a",
+                      "store_test_dir/in/c/", "store_test_dir/in/gone", "store_test_dir/other"},
+                     base.value(), store, chunker, 2);
+  if (!layer) std::cerr << layer.error() << std::endl;
+  REQUIRE(layer);
+
+  std::vector<std::string> paths;
+  for (auto &e : layer.value().entries) paths.push_back(e.path);
+  // in/b/ is looked at, but its mtime is not changed by rewriting a file in it
+  REQUIRE(paths ==
+          std::vector<std::string>{"in/", "in/a", "in/b/changed", "in/c/", "in/c/d/", "in/c/d/e"});
+  REQUIRE(layer.value().removed == std::vector<std::string>{"in/a/", "in/a/deep/", "in/a/deep/f"});
+
+  // only the paths of the events are looked at
+  auto patched = base.value();
+  patched.Apply(layer.value());
+  REQUIRE(patched.Find("in/b/untouched")->chunks == base.value().Find("in/b/untouched")->chunks);
+  auto now = Snapshot("store_test_dir/in", store, chunker, 2);
+  REQUIRE(now);
+  for (auto m : {&patched, &now.value()})
+    m->entries.erase(m->entries.begin() + (m->Find("in/b/untouched") - m->entries.data()));
+  REQUIRE(patched.entries == now.value().entries);
+
+  fs::remove_all("store_test_dir");
+}
@@ -2,15 +2,20 @@
 #include <catch.h>
 
 #include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 #include "tar.h"
 
+using namespace std::string_literals;
+
 namespace fs = std::filesystem;
 
 std::vector<std::string> filenames{
@@ -182,3 +187,213 @@ TEST_CASE("Tar", "test") {
 
   REQUIRE(DeleteTestFile());
 }
+
+TEST_CASE("Tar-large", "test") {
+  using namespace bolo_tar;
+  fs::create_directories("tar_large_dir/in");
+  fs::create_directories("tar_large_dir/out");
+
+  // larger than the data buffer and not a multiple of the alignment
+  std::string big;
+  for (int i = 0; big.size() < (9 << 20) + 123; i++) big += std::to_string(i * 7919) + ",";
+  REQUIRE(WriteString("tar_large_dir/in/big.txt", big));
+  REQUIRE(WriteString("tar_large_dir/in/small.txt", "after the big one"));
+
+  std::stringstream archive;
+  auto ins = Tar::Writer(archive)->Append("tar_large_dir/in");
+  if (ins) std::cerr << ins.error() << std::endl;
+  REQUIRE(!ins);
+  REQUIRE(archive.str().size() % 512 == 0);
+
+  ins = Tar::Reader(archive)->Extract("tar_large_dir/out");
+  if (ins) std::cerr << ins.error() << std::endl;
+  REQUIRE(!ins);
+  REQUIRE(std::system("diff -r tar_large_dir/in tar_large_dir/out/in") == 0);
+
+  fs::remove_all("tar_large_dir");
+}
+
+TEST_CASE("Tar-parallel", "test") {
+  using namespace bolo_tar;
+  fs::create_directories("tar_parallel_dir/out");
+  for (int d = 0; d < 6; d++) {
+    auto dir = fs::path("tar_parallel_dir/in") / ("d" + std::to_string(d)) / "sub";
+    fs::create_directories(dir);
+    for (int i = 0; i < 20; i++)
+      REQUIRE(WriteString(dir / ("f" + std::to_string(i)), repeat(std::to_string(d * i), i * 97)));
+  }
+  // streamed by the writer instead of read ahead
+  REQUIRE(WriteString("tar_parallel_dir/in/large", repeat("0123456789", 150000)));
+
+  auto archive = [](const AppendOptions &opts) {
+    std::ostringstream out;
+    auto ins = Tar::Writer(out)->Append("tar_parallel_dir/in", opts);
+    if (ins) std::cerr << ins.error() << std::endl;
+    REQUIRE(!ins);
+    return out.str();
+  };
+
+  // the same bytes as the serial archiver, with and without sorting
+  for (bool sorted : {false, true}) {
+    auto serial = archive({1, sorted});
+    for (size_t threads : {2, 8}) REQUIRE(archive({threads, sorted}) == serial);
+  }
+
+  std::istringstream in(archive({4, true}));
+  auto ins = Tar::Reader(in)->Extract("tar_parallel_dir/out");
+  if (ins) std::cerr << ins.error() << std::endl;
+  REQUIRE(!ins);
+  REQUIRE(std::system("diff -r tar_parallel_dir/in tar_parallel_dir/out/in") == 0);
+
+  // errors of the workers reach the caller
+  std::ostringstream out;
+  REQUIRE(!!Tar::Writer(out)->Append("tar_parallel_dir/none", {4, false}));
+
+  fs::remove_all("tar_parallel_dir");
+}
+
+TEST_CASE("Tar-index", "test") {
+  using namespace bolo_tar;
+  fs::create_directories("tar_index_dir/out");
+  fs::create_directories("tar_index_dir/in/sub");
+  for (int i = 0; i < 10; i++)
+    REQUIRE(WriteString("tar_index_dir/in/sub/f" + std::to_string(i), repeat("x", i * 300)));
+
+  std::vector<Tar::TarFile> index;
+  {
+    auto r = Tar::Open("tar_index_dir/a.tar");
+    REQUIRE(r);
+    auto tar = r.value();
+    REQUIRE(!tar->Append("tar_index_dir/in", {2, true}));
+    REQUIRE(!tar->Write());
+    index = tar->index();
+
+    // the offsets written are those found by scanning the archive
+    auto res = tar->List();
+    REQUIRE(res);
+    REQUIRE(res.value().size() == index.size());
+    for (size_t i = 0; i < index.size(); i++) {
+      REQUIRE(res.value()[i].filename == index[i].filename);
+      REQUIRE(res.value()[i].offset == index[i].offset);
+    }
+  }
+  REQUIRE(index.size() == 12);
+  REQUIRE(index.back().mtime > 0);
+
+  std::stringstream idx;
+  REQUIRE(!Tar::WriteIndex(idx, index));
+  auto read = Tar::ReadIndex(idx);
+  REQUIRE(read);
+  REQUIRE(read.value().size() == index.size());
+  for (size_t i = 0; i < index.size(); i++) {
+    REQUIRE(read.value()[i].filename == index[i].filename);
+    REQUIRE(read.value()[i].offset == index[i].offset);
+    REQUIRE(read.value()[i].size == index[i].size);
+    REQUIRE(read.value()[i].perms == index[i].perms);
+    REQUIRE(read.value()[i].mtime == index[i].mtime);
+    REQUIRE(read.value()[i].type == index[i].type);
+  }
+  std::istringstream broken("BTIX");
+  REQUIRE(!Tar::ReadIndex(broken));
+
+  // two entries, in reverse order: seeked to in a file, skipped to in a stream
+  std::vector<Tar::TarFile> entries;
+  for (auto &f : index)
+    if (f.filename == "in/sub/" || f.filename == "in/sub/f7") entries.push_back(f);
+  REQUIRE(entries.size() == 2);
+  std::reverse(entries.begin(), entries.end());
+
+  auto r = Tar::Open("tar_index_dir/a.tar");
+  REQUIRE(r);
+  REQUIRE(!r.value()->Extract("tar_index_dir/out", entries));
+  REQUIRE(fs::file_size("tar_index_dir/out/in/sub/f7") == 7 * 300);
+  REQUIRE(!fs::exists("tar_index_dir/out/in/sub/f6"));
+
+  fs::remove_all("tar_index_dir/out/in");
+  std::ifstream ifs("tar_index_dir/a.tar", std::ios_base::binary);
+  REQUIRE(!Tar::Reader(ifs)->Extract("tar_index_dir/out", entries));
+  REQUIRE(fs::file_size("tar_index_dir/out/in/sub/f7") == 7 * 300);
+  REQUIRE(std::distance(fs::directory_iterator("tar_index_dir/out/in/sub"), {}) == 1);
+
+  // an index of another archive is refused
+  entries[0].filename = "in/sub/f8";
+  REQUIRE(!!r.value()->Extract("tar_index_dir/out", entries));
+
+  fs::remove_all("tar_index_dir");
+}
+
+TEST_CASE("Tar-ustar", "test") {
+  using namespace bolo_tar;
+  fs::create_directories("tar_ustar_dir/out");
+
+  // a name split into prefix and name, and one only a PAX header can hold
+  auto split = fs::path("tar_ustar_dir/in") / std::string(90, 'd') / std::string(80, 'e');
+  auto pax = fs::path("tar_ustar_dir/in") / std::string(200, 'p') / std::string(150, 'q');
+  fs::create_directories(split);
+  fs::create_directories(pax);
+  REQUIRE(WriteString(split / "file.txt", "split"));
+  REQUIRE(WriteString(pax / "file.txt", repeat("pax", 1000)));
+  REQUIRE(WriteString("tar_ustar_dir/in/old", "mtime"));
+  fs::last_write_time("tar_ustar_dir/in/old",
+                      fs::last_write_time("tar_ustar_dir/in/old") - std::chrono::hours(24 * 400));
+
+  {
+    std::ofstream ofs("tar_ustar_dir/a.tar", std::ios_base::binary);
+    auto tar = Tar::Writer(ofs);
+    REQUIRE(!tar->Append("tar_ustar_dir/in"));
+    REQUIRE(!tar->Write());
+  }
+
+  // standard tools read it, names and modification times included
+  REQUIRE(std::system("tar -xf tar_ustar_dir/a.tar -C tar_ustar_dir/out") == 0);
+  REQUIRE(std::system("diff -r tar_ustar_dir/in tar_ustar_dir/out/in") == 0);
+  auto skew = fs::last_write_time("tar_ustar_dir/out/in/old") -
+              fs::last_write_time("tar_ustar_dir/in/old");
+  REQUIRE(std::chrono::abs(skew) < std::chrono::seconds(1));
+  fs::remove_all("tar_ustar_dir/out/in");
+
+  // and archives of standard tools are read, in both pax and gnu formats
+  for (auto format : {"pax", "gnu"}) {
+    auto cmd = "tar --format="s + format + " -cf tar_ustar_dir/b.tar -C tar_ustar_dir in";
+    REQUIRE(std::system(cmd.c_str()) == 0);
+    std::ifstream ifs("tar_ustar_dir/b.tar", std::ios_base::binary);
+    auto ins = Tar::Reader(ifs)->Extract("tar_ustar_dir/out");
+    if (ins) std::cerr << ins.error() << std::endl;
+    REQUIRE(!ins);
+    REQUIRE(std::system("diff -r tar_ustar_dir/in tar_ustar_dir/out/in") == 0);
+    fs::remove_all("tar_ustar_dir/out/in");
+  }
+
+  // appending to an archive replaces its end
+  {
+    auto r = Tar::Open("tar_ustar_dir/a.tar");
+    REQUIRE(r);
+    REQUIRE(!r.value()->Append("tar_ustar_dir/in/old"));
+    REQUIRE(!r.value()->Write());
+    auto list = r.value()->List();
+    REQUIRE(list);
+    REQUIRE(list.value().back().filename == "old");
+    REQUIRE(list.value().back().size == 5);
+    REQUIRE(fs::file_size("tar_ustar_dir/a.tar") == list.value().back().end() + 1024);
+  }
+  REQUIRE(std::system("tar -tf tar_ustar_dir/a.tar | tail -1 | grep -qx old") == 0);
+
+  // archives of older versions: decimal fields, no magic and no end blocks
+  {
+    std::string header(512, '\0');
+    std::memcpy(&header[0], "legacy.txt", 10);
+    std::memcpy(&header[100], "420", 3);
+    std::memcpy(&header[124], "5", 1);
+    header[156] = '0';
+    std::istringstream in(header + "hello" + std::string(507, '\0'));
+    REQUIRE(!Tar::Reader(in)->Extract("tar_ustar_dir/out"));
+    REQUIRE(fs::file_size("tar_ustar_dir/out/legacy.txt") == 5);
+  }
+
+  // entries may not leave the extraction directory
+  REQUIRE(std::system("cd tar_ustar_dir && tar -cPf c.tar ../tar_ustar_dir/in/old") == 0);
+  std::ifstream ifs("tar_ustar_dir/c.tar", std::ios_base::binary);
+  REQUIRE(!!Tar::Reader(ifs)->Extract("tar_ustar_dir/out"));
+
+  fs::remove_all("tar_ustar_dir");
+}